@@ -16,6 +16,11 @@ other for generation
 There is a custom macro ECS_ID which generates ECS__##name for the given
 name which is used for handle declerations
 
+All the entities, archetypes and queries belong to a world and every call
+takes the world they are in. Components are registered once for all the
+worlds (before the worlds are used by other threads). Worlds share no
+state, so each one may be used from its own thread
+
 Definition of some structs has not been done in the header for 2 reasons:
 1. Private members in structs - 2. Left some freedom for the C file
  */
@@ -37,18 +42,46 @@ Definition of some structs has not been done in the header for 2 reasons:
 #define ECS_DECL_COMP(name) EcsComponent ECS_ID(name) = 0
 #define ECS_REG_COMP(name) \
 ECS_ID(name) = ecs_registerComponent(sizeof(name), alignof(name))
+#define ECS_REG_SPARSE_COMP(name) \
+ECS_ID(name) = ecs_registerComponentEx(sizeof(name), alignof(name), \
+ECS_STORAGE_SPARSE)
+#define ECS_REG_SHARED_COMP(name) \
+ECS_ID(name) = ecs_registerComponentEx(sizeof(name), alignof(name), \
+ECS_STORAGE_SHARED)
+/* tags have no type, declare them with ECS_DECL_COMP too */
+#define ECS_REG_TAG(name) \
+ECS_ID(name) = ecs_registerComponent(0, 1)
+
+#define ECS_REG_ARCH(world, ...) \
+ecs_registerArchetype(world, \
+(EcsComponent[]){MAP_LIST(ECS_ID, __VA_ARGS__)}, MAP_COUNT(__VA_ARGS__))
+
+#define ECS_ADD_COMPONENT(world, entity, component) \
+((component*)ecs_addComponent(world, entity, ECS_ID(component)))
+
+#define ECS_GET_COMPONENT(world, entity, component) \
+((component*)ecs_getComponent(world, entity, ECS_ID(component)))
+
+#define ECS_REF(world, entity, component) \
+ecs_makeRef(world, entity, ECS_ID(component))
+
+#define ECS_REF_GET(world, ref, component) \
+((component*)ecs_refGet(world, ref))
+
+#define ECS_HASH_STATE(world, ...) ecs_hashState(world, \
+(EcsComponent[]){MAP_LIST(ECS_ID, __VA_ARGS__)}, MAP_COUNT(__VA_ARGS__))
 
-#define ECS_REG_ARCH(...) \
-ecs_registerArchetype((EcsComponent[]){MAP_LIST(ECS_ID, __VA_ARGS__)}, \
-MAP_COUNT(__VA_ARGS__))
+#define ECS_ENTITY_FIELD(type, field) \
+ecs_registerEntityField(ECS_ID(type), offsetof(type, field))
 
-#define ECS_ADD_COMPONENT(entity, component) \
-(component*)ecs_addComponent(entity, ECS_ID(component))
+#define ECS_GROUP_BY(type, field) .groupBy = ECS_ID(type), \
+.groupOffset = offsetof(type, field), \
+.groupSize = sizeof(((type*)0)->field)
 
-#define ECS_GET_COMPONENT(entity, component) \
-(component*)ecs_getComponent(entity, ECS_ID(component))
+#define ECS_SINGLETON(world, name) \
+((name*)ecs_singleton(world, ECS_ID(name)))
 
-#define ECS_QUERY(...) ecs_makeQuery((EcsQueryDesc){__VA_ARGS__})
+#define ECS_QUERY(world, ...) ecs_makeQuery(world, (EcsQueryDesc){__VA_ARGS__})
 
 #define ECS_ACCESS(type, ...) .type = (EcsComponent[]){ \
 	MAP_LIST(ECS_ID, __VA_ARGS__) \
@@ -57,17 +90,62 @@ MAP_COUNT(__VA_ARGS__))
 typedef uint64_t Entity;
 typedef uint64_t EcsComponent;
 
+/*
+  table storage keeps the component in archetype columns, sparse storage
+  keeps it in a sparse set so adding and removing it never moves the
+  entity (for frequently toggled components), shared storage keeps a
+  single value per archetype (entities with the same value are grouped)
+ */
+typedef enum {
+	ECS_STORAGE_TABLE,
+	ECS_STORAGE_SPARSE,
+	ECS_STORAGE_SHARED,
+} EcsStorage;
+
+/* events delivered to observers */
+typedef enum {
+	ECS_ON_ADD, //the component was added
+	ECS_ON_REMOVE, //the component was removed or the entity destroyed
+	ECS_ON_SET, //the value was written through the command buffer
+} EcsEvent;
+
+struct EcsWorld;
+typedef struct EcsWorld EcsWorld;
+
 struct Archetype;
 typedef struct Archetype Archetype;
 
 struct EcsQuery;
 typedef struct EcsQuery EcsQuery;
 
+struct EcsPrefab;
+typedef struct EcsPrefab EcsPrefab;
+
+struct EcsSnapshot;
+typedef struct EcsSnapshot EcsSnapshot;
+
+/*
+  write lists the components the iterators hand out for writing (they are
+  included implicitly), changed lists the components checked by change
+  filtered iterators (all the included ones if left empty),
+  includeDisabled makes the iterators visit disabled entities too,
+  groupBy with a groupSize of 1, 2, 4 or 8 groups the rows by the integer
+  field at groupOffset in the component, a table or shared one (see
+  ECS_GROUP_BY)
+ */
 typedef struct {
 	EcsComponent *include;
 	int includeCount;
 	EcsComponent *exclude;
 	int excludeCount;
+	EcsComponent *write;
+	int writeCount;
+	EcsComponent *changed;
+	int changedCount;
+	bool includeDisabled;
+	EcsComponent groupBy;
+	size_t groupOffset;
+	size_t groupSize;
 } EcsQueryDesc;
 
 /*
@@ -76,62 +154,272 @@ typedef struct {
   also to cache component handles for iteration
  */
 typedef struct {
+	EcsWorld *world;
 	EcsQuery *query;
 	Entity entity;
 	int archIndex;
 	int slot;
+	bool changedOnly;
+	uint32_t since; //only for changedOnly
+	bool grouped;
+	uint64_t group; //only for grouped
+	int row; //position in the group order
+	int rowEnd;
 	void *includes[8];
 } EcsIter;
 
-/* initialize ecs */
-void ecs_init(void);
+/*
+  a reference to a component of an entity, caching where it is stored
+  the cache stays valid until a row leaves the archetype of the entity
+ */
+typedef struct {
+	Entity entity;
+	EcsComponent comp;
+	Archetype *arch; //NULL until resolved
+	int column; //-1 for shared values
+	uint32_t stamp; //rows version of arch when resolved
+	void *ptr;
+} EcsRef;
+
+/*
+  observers get the entities of one archetype at a time, the archetype
+  they joined (the one they left for ECS_ON_REMOVE). query restricts
+  them to the archetypes matched by it (every archetype if NULL)
+ */
+typedef void (*EcsObserverFn)(EcsWorld *, Archetype *, const Entity *,
+			      int, void *);
+
+typedef struct {
+	EcsEvent event;
+	EcsComponent comp;
+	EcsQuery *query;
+	EcsObserverFn callback;
+	void *ctx; //passed to the callback
+} EcsObserverDesc;
+
+/* create an empty world */
+EcsWorld *ecs_createWorld(void);
 
-/* free up resources used */
-void ecs_shutdown(void);
+/* free up the resources used by the world */
+void ecs_destroyWorld(EcsWorld *);
 
 /* enter deferred mode */
-void ecs_deferBegin(void);
+void ecs_deferBegin(EcsWorld *);
 
 /* exit deferred mode */
-void ecs_deferEnd(void);
-
-/* register a component (returns an id) */
+void ecs_deferEnd(EcsWorld *);
+
+/* current change detection tick */
+uint32_t ecs_getTick(EcsWorld *);
+
+/* advance the change detection tick (once per frame)
+   also publishes a snapshot if enabled and collects the archetypes
+   which stayed empty for too long */
+void ecs_progressTick(EcsWorld *);
+
+/* number of ticks an archetype made by the ecs may stay empty before it is
+   collected (0 disables collection in ecs_progressTick) */
+void ecs_setArchetypeIdleTicks(EcsWorld *, uint32_t);
+
+/* collect the idle archetypes now, pointers to them become invalid
+   (archetypes registered by the user or used by a prefab are kept) */
+void ecs_collectArchetypes(EcsWorld *);
+
+/* keep the component in the snapshots published by ecs_progressTick
+   (table components with data only) */
+void ecs_enableSnapshot(EcsWorld *, EcsComponent);
+
+/* the last published snapshot (NULL if none yet), it stays valid and
+   unchanged until released, may be called from any thread */
+const EcsSnapshot *ecs_acquireSnapshot(EcsWorld *);
+
+/* release a snapshot, may be called from any thread */
+void ecs_releaseSnapshot(const EcsSnapshot *);
+
+/* take one more reference to an acquired snapshot, to be released too */
+void ecs_retainSnapshot(const EcsSnapshot *);
+
+/* the tick the snapshot was taken at */
+uint32_t ecs_snapshotTick(const EcsSnapshot *);
+
+/* number of chunks (one per archetype having snapshotted components) */
+int ecs_snapshotChunkCount(const EcsSnapshot *);
+
+/* the values of the component in the chunk (NULL if not in it), the
+   entities of the rows and their count are written if not NULL */
+const void *ecs_snapshotColumn(const EcsSnapshot *, int, EcsComponent,
+			       const Entity **, int *);
+
+/* register an observer, it is called by ecs_deferEnd for the changes
+   applied by the flush (table, sparse and tag components, immediate
+   changes are not observed). Entities removed from the world are
+   already dead */
+void ecs_observe(EcsWorld *, EcsObserverDesc);
+
+/* hash of the values of the components (table, tags and shared) of every
+   entity having some of them, independent of the storage order. Hashes
+   of unchanged archetypes are reused from the last call, so columns must
+   only be written through stamped pointers (iterators stamp the
+   components of the query's write accesses only). Builds without NDEBUG
+   hash the reused archetypes again and assert nothing was missed */
+uint64_t ecs_hashState(EcsWorld *, const EcsComponent *, int);
+
+/* move every entity of src to dst, src is left empty. Both worlds must be
+   out of deferred mode and src not used by another thread meanwhile.
+   Registered entity fields of the table, sparse and shared values are
+   remapped to the new handles (0 if they pointed out of src). Observers
+   are not notified. Returns false, with both worlds unchanged, if dst
+   lacks entity slots, archetype rows or archetypes for the merge */
+bool ecs_merge(EcsWorld *dst, EcsWorld *src);
+
+/* the handle in the destination of an entity moved by the last merge of
+   src (0 if it was not moved) */
+Entity ecs_mergedEntity(EcsWorld *src, Entity);
+
+/* keep the state of the last depth ticks (saved by ecs_progressTick) so
+   the world can be rolled back for resimulation */
+void ecs_enableRollback(EcsWorld *, int);
+
+/* restore the state saved at the end of the tick, the current tick
+   becomes the next one and the later saved ticks are dropped. Returns
+   false if the tick is not in the ring (or in deferred mode). The shared
+   values of the groups having rows in the frame are restored too. Sparse
+   components are not rolled back and observers are not notified */
+bool ecs_rollbackTo(EcsWorld *, uint32_t);
+
+/* select the command buffer used by the calling thread in deferred mode
+   (0 by default, each thread issuing commands must use its own index) */
+void ecs_setThreadIndex(int);
+
+/* register a component (returns an id)
+   a size of 0 makes a tag which has no storage at all */
 EcsComponent ecs_registerComponent(size_t, size_t);
 
+/* register a component with the given storage kind */
+EcsComponent ecs_registerComponentEx(size_t, size_t, EcsStorage);
+
+/* the size the component was registered with */
+size_t ecs_componentSize(EcsComponent);
+
+/* declare a field of the component holding an entity handle, ecs_merge
+   points it to the merged entity (see ECS_ENTITY_FIELD) */
+void ecs_registerEntityField(EcsComponent, size_t);
+
 /* create an archetyoe with the specified set of components */
-Archetype *ecs_registerArchetype(EcsComponent *, size_t);
+Archetype *ecs_registerArchetype(EcsWorld *, EcsComponent *, size_t);
 
 /* checks if an entity is invalid (still alive?) */
-bool ecs_isValid(Entity);
+bool ecs_isValid(EcsWorld *, Entity);
 
-/* create an empty entity */
-Entity ecs_newEntity(void);
+/* create an empty entity
+   in deferred mode, the entity is put in an archetype at flush */
+Entity ecs_newEntity(EcsWorld *);
 
 /* destroy the entity (makes it invalid) */
-void ecs_destroy(Entity);
+void ecs_destroy(EcsWorld *, Entity);
 
 /* create an entity in the specified archetype */
-Entity ecs_newEntityInArch(Archetype *);
+Entity ecs_newEntityInArch(EcsWorld *, Archetype *);
 
-/* returns the archetype which the entity resides in */
-Archetype *ecs_getEntityArch(Entity);
+/* returns the archetype which the entity resides in
+   (NULL if created in deferred mode and not flushed yet) */
+Archetype *ecs_getEntityArch(EcsWorld *, Entity);
 
 /* add a component to an entity (changes archetype) */
-void *ecs_addComponent(Entity, EcsComponent);
+void *ecs_addComponent(EcsWorld *, Entity, EcsComponent);
 
 /* remove component from entity */
-void ecs_removeComponent(Entity, EcsComponent);
+void ecs_removeComponent(EcsWorld *, Entity, EcsComponent);
+
+/* get component if available (always NULL for tags) */
+void *ecs_getComponent(EcsWorld *, Entity, EcsComponent);
+
+/* make a reference to the component of the entity (resolved on first use) */
+EcsRef ecs_makeRef(EcsWorld *, Entity, EcsComponent);
+
+/* get the component through the reference, same as ecs_getComponent
+   but only resolved again after the entity may have moved */
+void *ecs_refGet(EcsWorld *, EcsRef *);
+
+/* copy the component of every entity to out, in the order of the list
+   (zeroed for the ones without it), returns how many had it */
+int ecs_gatherComponent(EcsWorld *, const Entity *, int, EcsComponent,
+			void *);
+
+/* copy the values of in to the component of every entity of the list,
+   the ones without it are skipped, returns how many had it */
+int ecs_scatterComponent(EcsWorld *, const Entity *, int, EcsComponent,
+			 const void *);
+
+/* sort the entity list by archetype and slot, so gathers and scatters
+   read the storage in order (dead entities go last) */
+void ecs_sortEntities(EcsWorld *, Entity *, int);
+
+/* checks if the entity has the component (works for tags too) */
+bool ecs_hasComponent(EcsWorld *, Entity, EcsComponent);
+
+/* enables or disables the entity without moving it, disabled entities
+   are skipped by queries (applied at flush in deferred mode) */
+void ecs_setEnabled(EcsWorld *, Entity, bool);
+
+/* checks if the entity is enabled */
+bool ecs_isEnabled(EcsWorld *, Entity);
 
-/* get component if available */
-void *ecs_getComponent(Entity, EcsComponent);
+/* moves the entity to the group having the given shared value
+   (adds the shared component if missing) */
+void ecs_setShared(EcsWorld *, Entity, EcsComponent, const void *);
+
+/* the shared value of an archetype, NULL if not in it */
+void *ecs_getSharedInArch(Archetype *, EcsComponent);
+
+/* the world wide value of a component, zeroed on first use */
+void *ecs_singleton(EcsWorld *, EcsComponent);
+
+/* make a prefab of the archetype with zeroed default values */
+EcsPrefab *ecs_makePrefab(EcsWorld *, Archetype *);
+
+/* default value of a component of the prefab (to be written) */
+void *ecs_getPrefabComponent(EcsPrefab *, EcsComponent);
+
+/* create count entities from the prefab, the handles are written to the
+   array if not NULL */
+void ecs_instantiate(EcsWorld *, EcsPrefab *, int, Entity *);
+
+/* create count entities with the zeroed components at once, appended to
+   their archetype. The handles are written to the array */
+void ecs_newEntities(EcsWorld *, const EcsComponent *, int, int, Entity *);
 
 /* make a query based on the defined accesses */
-EcsQuery *ecs_makeQuery(EcsQueryDesc);
+EcsQuery *ecs_makeQuery(EcsWorld *, EcsQueryDesc);
 
 /* make an iterator for getting entities from query */
-EcsIter ecs_queryIter(EcsQuery *);
+EcsIter ecs_queryIter(EcsWorld *, EcsQuery *);
+
+/* make an iterator which skips the archetypes whose watched components
+   have not been written at or after the given tick. Pass the tick the
+   last iteration ran at: writes made later in that tick are not missed,
+   the ones seen by that iteration may be reported again */
+EcsIter ecs_queryIterChangedSince(EcsWorld *, EcsQuery *, uint32_t);
+
+/* make an iterator over the rows of a grouped query with the given key */
+EcsIter ecs_queryIterGroup(EcsWorld *, EcsQuery *, uint64_t);
+
+/* writes the smallest distinct keys of a grouped query in ascending
+   order (at most max of them) and returns how many were written */
+int ecs_queryGroupKeys(EcsWorld *, EcsQuery *, uint64_t *, int);
 
 /* iterates over the query and checks if an entity is available */
 bool ecs_iterNext(EcsIter *);
 
+/* add a component to every entity matching the query
+   (moves whole archetypes at once outside deferred mode). The bulk
+   operations notify observers like a flush of the same commands */
+void ecs_addComponentToQuery(EcsWorld *, EcsQuery *, EcsComponent);
+
+/* remove a component from every entity matching the query */
+void ecs_removeComponentFromQuery(EcsWorld *, EcsQuery *, EcsComponent);
+
+/* destroy every entity matching the query (the query itself remains) */
+void ecs_destroyQuery(EcsWorld *, EcsQuery *);
+
 #endif //__ECS_MAIN__
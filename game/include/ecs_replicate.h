@@ -0,0 +1,56 @@
+#ifndef __ECS_REPLICATE__
+#define __ECS_REPLICATE__
+
+/*
+  Replication of components from a server world to client worlds
+
+The server makes one replicator with the replicated components (enabled
+for snapshots) and encodes each published snapshot for every client
+against the last tick acked by that client. A snapshot is captured once
+by its first encode and shared by the others. The stream only holds the
+entities created, destroyed or changed since that tick, with the
+changed 32-bit words of the values XORed with their old value and
+bit-packed
+
+The client makes a replicator with the same components in the same
+order and decodes the packets into its world. Server entities are
+mapped to entities of the client world, made and destroyed as needed.
+The tick of the last decoded packet is the one to ack
+
+Both sides keep the states of the last ticks, so a packet may be
+encoded against any of them and decoded out of a lost packet
+ */
+
+#include <ecs.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct EcsReplicator;
+typedef struct EcsReplicator EcsReplicator;
+
+#define ECS_REPLICATOR(...) ecs_createReplicator( \
+(EcsComponent[]){MAP_LIST(ECS_ID, __VA_ARGS__)}, MAP_COUNT(__VA_ARGS__))
+
+/* create a replicator of the components (table components with data) */
+EcsReplicator *ecs_createReplicator(const EcsComponent *, int);
+
+void ecs_destroyReplicator(EcsReplicator *);
+
+/* encode the snapshot as a delta against the acked tick (everything if it
+   is 0 or not kept anymore), returns the bytes written or 0 if the
+   buffer is too small. The replicator keeps a reference to the last
+   encoded snapshot. Not thread safe, encode every client from one thread */
+size_t ecs_replicateEncode(EcsReplicator *, const EcsSnapshot *, uint32_t,
+			   uint8_t *, size_t);
+
+/* apply a packet to the world, returns false if it is malformed, older
+   than the last one or its baseline is not kept anymore */
+bool ecs_replicateDecode(EcsReplicator *, EcsWorld *, const uint8_t *,
+			 size_t);
+
+/* tick of the last decoded packet (0 if none), to be acked */
+uint32_t ecs_replicateTick(const EcsReplicator *);
+
+#endif //__ECS_REPLICATE__
@@ -1,17 +1,71 @@
 #ifndef __TRANSFORM_MAIN__
 #define __TRANSFORM_MAIN__
 
+/*
+  Transform module
+
+Every transform belongs to an entity and may be attached to a parent
+transform. The local transform is relative to the parent, the world
+transform is computed by transform_propagate
+
+Transforms are kept sorted by their depth in the hierarchy with the
+children of a parent next to each other, so propagation is a linear
+pass over the storage. Only the dirty transforms and their subtrees are
+recomputed
+
+Transform handles are 64-bit, 32 bits for the index and 32 for the
+generation. Pointers returned by the module are valid until the next
+call to transform_propagate or transform_destroy, which move transforms
+in the storage
+ */
+
 #include <ryu/ryu.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define TRANSFORM_NONE UINT64_MAX
+
 typedef uint64_t TransformIndex;
 
 typedef struct vec2 {
 	float x;
 	float y;
-};
+} vec2;
+
+/* rotation is stored as (cos, sin) of the angle */
+typedef struct {
+	vec2 position;
+	vec2 rotation;
+	vec2 scale;
+} Transform;
+
+/* create an identity transform for the entity (as a root) */
+TransformIndex transform_regEntity(Entity);
+
+/* destroy the transform, its children become roots */
+void transform_destroy(TransformIndex);
+
+/* checks if the handle is still valid */
+bool transform_isValid(TransformIndex);
+
+/* the entity the transform belongs to */
+Entity transform_getEntity(TransformIndex);
+
+/* attach to a parent (TRANSFORM_NONE detaches)
+   returns false if it would make a cycle */
+bool transform_setParent(TransformIndex, TransformIndex);
+
+/* the parent of the transform or TRANSFORM_NONE */
+TransformIndex transform_getParent(TransformIndex);
+
+/* the local transform to be written (marks it dirty) */
+Transform *transform_getLocal(TransformIndex);
+
+/* the world transform as of the last propagation */
+const Transform *transform_getWorld(TransformIndex);
 
-//TransformIndex Transform_regEntity(Entity);
+/* recompute the world transforms of the dirty subtrees */
+void transform_propagate(void);
 
-#endif
+#endif //__TRANSFORM_MAIN__
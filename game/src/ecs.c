@@ -2,6 +2,8 @@
 
 #include <zoner/zon_arena.h>
 
+#include <assert.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,7 +13,7 @@
 Currently there are some hard static limits to the ECS which may turn
 dynamic in the next versions
 
-Entities are stored in a static array and are treated as a free list pool
+Entities are stored in a fixed array of the world and are treated as a free list pool
 When an Entity is not alive, its id would be the index of the next free
 entity. The last free entity would have UINT32_MAX as its index to
 indicate that there is no more free entities
@@ -21,9 +23,9 @@ stored in an arena which would be then applied on the main storage. The
 arena gets cleaned up at the end of deferred mode
 
 An entity with NULL archetype record means it has been created in
-deferred mode and has not been put in an archetype (not implemented yet)
-these entities do not get processed by queries and systems until the
-flush puts them in an archetype (invisiable to queries)
+deferred mode and has not been put in an archetype yet (its components
+are staged). These entities do not get processed by queries and systems
+until the flush puts them in an archetype (invisiable to queries)
  */
 
 /* static limits */
@@ -31,10 +33,56 @@ flush puts them in an archetype (invisiable to queries)
 #define MAX_COMPONENT_COUNT 64
 #define MAX_ARCHETYPE_COUNT 128
 #define MAX_QUERY_COUNT 64
+#define MAX_OBSERVER_COUNT 64
 #define MAX_ARCH_ENTITY 256
+#define MAX_ARCH_COMPONENT 8
+#define MAX_THREAD_COUNT 8
+#define MAX_PREFAB_COUNT 64
+#define MAX_MOVE_PLANS 8 //cached per archetype, replaced round robin
+#define SNAP_ALIGN 16 //alignment of the columns in snapshot chunks
+#define MAX_ROLLBACK_DEPTH 64
+#define MAX_ENTITY_FIELDS 4 //per component, remapped by merges
+
+#define STORAGE_CHUNK_SIZE 65536
+#define COLUMN_ALIGN 64 //alignment of every pooled block
+#define COLUMN_CLASS_COUNT 32 //pool size classes, COLUMN_ALIGN << class
+#define DEFAULT_IDLE_TICKS 60
+
+//words of the per archetype row masks
+#define ROW_WORDS (MAX_ARCH_ENTITY / 64)
 
 #define CREATE_ENTITY(i, g) (((uint64_t)(i) << 32) | (g))
 
+#if defined(_MSC_VER) && !defined(__clang__)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+/* index of the lowest set bit, bits must not be 0 */
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static int lowestBit(uint64_t bits)
+{
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+}
+#else
+#define lowestBit(bits) __builtin_ctzll(bits)
+#endif
+
+/* hint the cache line of the address is needed soon */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PREFETCH(ptr) _mm_prefetch((const char*)(ptr), _MM_HINT_T0)
+#else
+#define PREFETCH(ptr) __builtin_prefetch(ptr)
+#endif
+
+//how far ahead gather and scatter prefetch descriptors and rows
+#define DESC_PREFETCH_AHEAD 8
+#define ROW_PREFETCH_AHEAD 4
+
 /*
   Due to the fact that there would be only 64 components at max,
   we can write our filters as bitmasks with each component id being
@@ -50,678 +98,3684 @@ typedef uint64_t EcsMask;
 typedef struct {
 	size_t size;
 	size_t alignment;
+	EcsStorage storage;
 } ComponentDesc;
 
+/*
+  Sparse components are never part of an archetype, adding or removing
+  them does not move the entity. Removal moves the last element into the
+  hole, so a pointer to sparse data is valid until the component is
+  removed from any entity. Sets are made with the world (or by the first
+  query or add of a component registered later), so threads in deferred
+  mode only read them
+ */
+typedef struct {
+	uint32_t sparse[MAX_ENTITY_COUNT]; //dense index by entity index
+	uint32_t dense[MAX_ENTITY_COUNT]; //entity index by dense index
+	void *data; //component data by dense index
+	uint32_t count;
+	_Atomic uint32_t version; //tick of the last write
+} SparseSet;
+
+/*
+  the snapshotted columns of an archetype at some tick, immutable. A chunk
+  is only copied again if one of its columns was written or its rows
+  changed since, otherwise the next snapshot shares it. Readers may hold
+  it on any thread while the simulation writes the live columns
+ */
+typedef struct {
+	atomic_int refs; //snapshots sharing it
+	EcsMask mask; //snapshotted components in it
+	int count;
+	int compCount;
+	EcsComponent comps[MAX_ARCH_COMPONENT];
+	uint8_t *columns[MAX_ARCH_COMPONENT];
+	Entity *entities;
+	uint64_t disabled[ROW_WORDS];
+	int disabledCount;
+} SnapChunk;
+
+//the last chunk copied from an archetype, reused while it is not stale
+typedef struct {
+	SnapChunk *chunk;
+	uint32_t rows; //rows version of the copy
+	uint32_t tick; //columns written since are copied again
+} ChunkCache;
+
+struct EcsSnapshot {
+	atomic_int refs; //the world and the readers
+	uint32_t tick;
+	int chunkCount;
+	SnapChunk *chunks[MAX_ARCHETYPE_COUNT];
+};
+
+/*
+  how rows move from an archetype to dst, cached in the source archetype
+  so a move is a list of plain copies and zeroes
+ */
+typedef struct {
+	Archetype *dst;
+	uint32_t dstGeneration; //the plan is stale if dst was collected
+	uint8_t copyCount; //columns present in both
+	uint8_t zeroCount; //columns only in dst
+	uint8_t srcCol[MAX_ARCH_COMPONENT];
+	uint8_t dstCol[MAX_ARCH_COMPONENT]; //copied columns first
+	uint32_t size[MAX_ARCH_COMPONENT]; //by dstCol entry
+} MovePlan;
+
+/*
+  the state hash of an archetype for the components of mask. Row hashes
+  are summed so the storage order doesn't matter, and the hash is reused
+  while no hashed column was written and no row changed. Shared values
+  are written with no stamp, hence the digest checked every time
+ */
+typedef struct {
+	uint64_t hash;
+	EcsMask mask; //0 if never computed
+	uint32_t rows; //rows version when computed
+	int count;
+	uint32_t tick; //columns written since make it stale
+	uint64_t shared; //digest of the hashed shared values
+} HashCache;
+
 struct Archetype {
-	EcsComponent componentIds[8];
-	void *storage[8];
+	EcsComponent componentIds[MAX_ARCH_COMPONENT];
+	uint32_t colSize[MAX_ARCH_COMPONENT];
+	void *storage[MAX_ARCH_COMPONENT];
+	_Atomic uint32_t colVersion[MAX_ARCH_COMPONENT]; //tick of the last write
 	int compIndexCache[MAX_COMPONENT_COUNT];
+	void *shared[MAX_COMPONENT_COUNT]; //shared value by component
 	int compCount;
 	EcsMask mask;
 	Entity entities[MAX_ARCH_ENTITY];
 	int entCount;
+	uint64_t disabled[ROW_WORDS]; //rows skipped by queries, 0 past entCount
+	int disabledCount;
+	bool pinned; //referenced by the user, never collected
+	bool unused; //slot free to be reused
+	uint32_t emptySince; //tick the last row left at
+	uint32_t generation; //bumped when collected
+	uint32_t rowsVersion; //bumped when rows may change place, never reset
+	MovePlan plans[MAX_MOVE_PLANS];
+	int planCount;
+	int nextPlan; //replaced when every plan is used
+	ChunkCache snapCache; //snapshotted components
+	ChunkCache rollCache; //every component, for the rollback ring
+	HashCache hashCache;
+};
+
+/* an archetype plus a default value for each of its columns */
+struct EcsPrefab {
+	Archetype *arch;
+	void *defaults[MAX_ARCH_COMPONENT]; //default value by column
 };
 
 typedef struct {
 	Entity id;
 	Archetype *arch;
 	int slot; //index in archetype
+	EcsMask sparseMask; //sparse components of the entity
 } EntityDesc;
 
+/*
+  rows of a matched archetype ordered by the group key, checked again
+  only when the key column was written or rows were added or removed
+ */
+typedef struct {
+	uint64_t keys[MAX_ARCH_ENTITY]; //key of every ordered row
+	uint16_t rows[MAX_ARCH_ENTITY];
+	int count;
+	uint32_t checkedAt; //tick of the last check, 0 if never
+} GroupIndex;
+
 struct EcsQuery {
-	EcsMask include;
+	EcsMask include; //table components only
 	EcsMask exclude;
-	Archetype *matches[32];
+	EcsMask sparseInclude; //checked per entity
+	EcsMask sparseExclude;
+	Archetype **matches;
 	int matchCount;
+	int matchCap;
+	EcsMask write; //written by iterators
+	EcsMask watch; //checked by change filtered iterators
+	bool withDisabled; //iterates disabled rows too
+	EcsComponent groupBy;
+	size_t groupOffset;
+	size_t groupSize; //0 if not grouped
+	GroupIndex *groups; //by match
 	EcsComponent includeList[8];
 	int includeCount;
 };
 
+//staged data of a component, linked per entity
+typedef struct StagedComp {
+	struct StagedComp *next;
+	EcsComponent comp;
+	void *data;
+} StagedComp;
+
+/*
+  Buckets only exist for the entities touched in deferred mode. They are
+  kept in the order of the first command on the entity and found by the
+  entity index through an open addressing lookup table, so the cost of
+  deferred mode is proportional to the commands issued
+
+  For an entity created in deferred mode, addMask holds every component
+  of its final archetype. Components with no staged data are zeroed
+ */
 typedef struct {
-	bool active; //already in dirty list?
+	uint32_t entIndex;
 	bool destroy; //entity must die
+	bool create; //entity was created in deferred mode
+	Archetype *arch; //requested archetype of a created entity
+	const EcsPrefab *prefab; //defaults of a created entity, or NULL
+	bool toggled; //enabled state set in deferred mode
+	bool disabled;
 	EcsMask addMask; //bit mask of components to add
 	EcsMask remMask; //bit mask of components to remove
-	void *data[MAX_COMPONENT_COUNT]; //pointer to staged comp data
+	EcsMask sparseAddMask; //same for the sparse components
+	EcsMask sparseRemMask;
+	StagedComp *staged; //disabled adds keep their staged data
 } CmdBucket;
 
-// where we store component data and free on shutdown
-static ZonArena ecsStorage;
-// for storing staged components data
-static ZonArena cmdStorage;
+/*
+  Every thread has its own command buffer, selected by ecs_setThreadIndex.
+  At ecs_deferEnd the buffers are merged into the first one in thread
+  order: when several threads touch the same entity, destroy wins over
+  everything else and otherwise the later buffer wins. Reserving a handle
+  for a new entity is the only shared step and is guarded by a spin lock
+ */
+typedef struct {
+	CmdBucket *buckets; //in the order they were touched
+	size_t bucketCount;
+	size_t bucketCap;
+	uint32_t *lookup; //bucket index + 1 (0 is free)
+	size_t lookupCap; //always twice bucketCap
+	ZonArena storage; //for storing staged components data
+} CmdBuffer;
+
+//a created entity waiting to be inserted at flush
+typedef struct {
+	Archetype *arch;
+	CmdBucket *buck;
+} Spawn;
+
+/*
+  a change applied by a flush or a bulk operation, waiting for the
+  observers. Only recorded while an observer is registered
+ */
+typedef struct {
+	EcsEvent event;
+	Archetype *arch; //the one left for removals, the new one otherwise
+	uint32_t seq; //keeps the flush order within an archetype
+	Entity ent;
+	EcsMask mask; //components concerned
+} Change;
+
+/*
+  the state of the world at the end of a tick. Chunks are made like the
+  snapshot ones, so a frame only copies the archetypes changed since the
+  previous one. Empty archetypes are kept for at least the depth of the
+  ring so frames never point to a collected one
+ */
+typedef struct {
+	uint32_t tick; //0 if empty
+	int entCount;
+	uint32_t nextFreeEntity;
+	EntityDesc *descs;
+	int chunkCount;
+	Archetype *archs[MAX_ARCHETYPE_COUNT];
+	SnapChunk *chunks[MAX_ARCHETYPE_COUNT];
+	EcsMask singletonMask; //singletons in the frame, in component order
+	uint8_t *singletons;
+	size_t singletonCap;
+	uint8_t *shared; //shared values of archs, in component order
+	size_t sharedCap;
+} RollbackFrame;
+
+//growable array of pointers
+typedef struct {
+	void **items;
+	int count;
+	int cap;
+} PtrList;
 
-static int entCount = 0; // number of alive entities
-static EntityDesc entDescs[MAX_ENTITY_COUNT];
-static uint32_t nextFreeEntity = 0;
+/*
+  a pooled block waiting to be reused. Columns and shared values take
+  blocks of power of two sizes, carved from the storage chunks
+ */
+typedef struct FreeBlock {
+	struct FreeBlock *next;
+} FreeBlock;
 
-static CmdBucket cmdBuckets[MAX_ENTITY_COUNT];
-//entities to be processed at flush
-static uint32_t dirties[MAX_ENTITY_COUNT];
-static size_t dirtyCount = 0; //how many buckets to process at flush
+/*
+  everything owned by a world. Worlds share nothing but the component
+  registry and the thread index, so each one can be used by its own thread
+ */
+struct EcsWorld {
+	// where we store component data and free on shutdown
+	ZonArena ecsStorage; //the current chunk
+	PtrList storageChunks;
+	FreeBlock *freeBlocks[COLUMN_CLASS_COUNT];
+	PtrList unusedArchs; //archetype slots to reuse
+	uint32_t idleTicks; //before an empty archetype is collected
+
+	int entCount; // number of alive entities
+	EntityDesc entDescs[MAX_ENTITY_COUNT];
+	uint32_t nextFreeEntity;
+
+	CmdBuffer cmdBuffers[MAX_THREAD_COUNT];
+	atomic_flag entityLock; //guards the free list
+	atomic_flag snapLock; //guards the snapshot pointer
+	EcsMask snapMask; //snapshotted components
+	EcsSnapshot *snapshot; //the last published
+
+	int observerCount;
+	EcsObserverDesc observers[MAX_OBSERVER_COUNT];
+	Change *changes; //recorded by the flush while there are observers
+	int changeCount;
+	int changeCap;
+
+	RollbackFrame *frames; //ring, NULL if rollback is disabled
+	int rollbackDepth;
+	int nextFrame;
+
+	//where the entities went in the last merge, by index
+	Entity *mergedFrom;
+	Entity *mergedTo;
+	//entities created in deferred mode, inserted after the other commands
+	Spawn *spawns;
+	size_t spawnCap;
+
+	SparseSet *sparseSets[MAX_COMPONENT_COUNT]; //made outside deferred mode
+	void *singletons[MAX_COMPONENT_COUNT];
+
+	int archCount;
+	Archetype archetypes[MAX_ARCHETYPE_COUNT];
+
+	int prefabCount;
+	EcsPrefab prefabs[MAX_PREFAB_COUNT];
+
+	int queryCount;
+	EcsQuery queries[MAX_QUERY_COUNT];
+
+	PtrList compArchs[MAX_COMPONENT_COUNT]; //archetypes with the component
+	PtrList compQueries[MAX_COMPONENT_COUNT]; //queries indexed by it
+	PtrList looseQueries; //queries including no table component
+
+	bool inDeferred;
+	uint32_t currentTick; //0 means never written
+
+	Archetype *emptyArch; //empty arch for empty entities
+};
 
+//the component registry is shared by every world
 static int compCount = 0;
 static ComponentDesc compDescs[MAX_COMPONENT_COUNT];
+static EcsMask sparseComps = 0; //components with sparse storage
+static EcsMask tagComps = 0; //components with no data
+static EcsMask sharedComps = 0; //components with one value per archetype
+static size_t entityFields[MAX_COMPONENT_COUNT][MAX_ENTITY_FIELDS];
+static int entityFieldCount[MAX_COMPONENT_COUNT];
 
-static int archCount = 0;
-static Archetype archetypes[MAX_ARCHETYPE_COUNT];
+static THREAD_LOCAL int threadIndex = 0; //command buffer of the thread
 
-static int queryCount = 0;
-static EcsQuery queries[MAX_QUERY_COUNT];
+/* pops the lowest set bit of the mask and returns its index */
+static EcsComponent popLowestBit(EcsMask *mask)
+{
+	EcsMask bits = *mask;
+	EcsComponent comp = 0;
+
+	while (!(bits & 01)) {
+		++comp;
+		bits >>= 1;
+	}
+	*mask &= *mask - 1;
 
-static bool inDeferred = false;
+	return comp;
+}
 
-static Archetype *emptyArch = NULL; //empty arch for empty entities
+static SparseSet *makeSparseSet(EcsWorld *, EcsComponent);
 
-void ecs_init(void)
+EcsWorld *ecs_createWorld(void)
 {
+	EcsWorld *w = calloc(1, sizeof(EcsWorld));
+	if (!w) {
+		fprintf(stderr, "ecs_createWorld: out of memory\n");
+		exit(1);
+	}
+
 	//mark all entities as free
 	for (uint32_t i = 0; i < MAX_ENTITY_COUNT - 1; i++) {
-		entDescs[i].id = CREATE_ENTITY(i + 1, 0);
-		entDescs[i].arch = NULL;
-		entDescs[i].slot = -1;
+		w->entDescs[i].id = CREATE_ENTITY(i + 1, 0);
+		w->entDescs[i].arch = NULL;
+		w->entDescs[i].slot = -1;
+		w->entDescs[i].sparseMask = 0;
 	}
 
-	entDescs[MAX_ENTITY_COUNT - 1].id =
+	w->entDescs[MAX_ENTITY_COUNT - 1].id =
 		CREATE_ENTITY(UINT32_MAX, 0);
-	nextFreeEntity = 0;
-	entCount = 0;
-	dirtyCount = 0;
+	w->nextFreeEntity = 0;
+	w->entCount = 0;
+	for (int i = 0; i < MAX_THREAD_COUNT; i++) {
+		w->cmdBuffers[i] = (CmdBuffer){0};
+		w->cmdBuffers[i].storage =
+			zon_arenaCreate(malloc(65536), 65536);
+	}
+	atomic_flag_clear(&w->entityLock);
+	atomic_flag_clear(&w->snapLock);
+	w->currentTick = 1;
 
-	ecsStorage = zon_arenaCreate(malloc(65536), 65536);
-	cmdStorage = zon_arenaCreate(malloc(65536), 65536);
-	emptyArch = ecs_registerArchetype(NULL, 0);
+	w->idleTicks = DEFAULT_IDLE_TICKS;
+	w->emptyArch = ecs_registerArchetype(w, NULL, 0);
+
+	EcsMask sparse = sparseComps;
+	while (sparse) makeSparseSet(w, popLowestBit(&sparse));
+
+	return w;
+}
+
+static void releaseChunk(SnapChunk *);
+static void releaseFrame(RollbackFrame *);
+
+void ecs_destroyWorld(EcsWorld *w)
+{
+	for (int i = 0; i < w->storageChunks.count; i++)
+		free(w->storageChunks.items[i]);
+	free(w->storageChunks.items);
+	free(w->unusedArchs.items);
+	for (int i = 0; i < MAX_THREAD_COUNT; i++) {
+		free(w->cmdBuffers[i].buckets);
+		free(w->cmdBuffers[i].lookup);
+		free(zon_arenaUnlock(&w->cmdBuffers[i].storage));
+	}
+	free(w->spawns);
+
+	for (int i = 0; i < MAX_COMPONENT_COUNT; i++) {
+		if (!w->sparseSets[i]) continue;
+		free(w->sparseSets[i]->data);
+		free(w->sparseSets[i]);
+	}
+	for (int i = 0; i < w->queryCount; i++) {
+		free(w->queries[i].matches);
+		free(w->queries[i].groups);
+	}
+	for (int i = 0; i < MAX_COMPONENT_COUNT; i++) {
+		free(w->compArchs[i].items);
+		free(w->compQueries[i].items);
+	}
+	free(w->looseQueries.items);
+	free(w->changes);
+	free(w->mergedFrom);
+	free(w->mergedTo);
+
+	//readers may still hold it
+	if (w->snapshot) ecs_releaseSnapshot(w->snapshot);
+	for (int i = 0; i < w->archCount; i++) {
+		releaseChunk(w->archetypes[i].snapCache.chunk);
+		releaseChunk(w->archetypes[i].rollCache.chunk);
+	}
+	for (int i = 0; i < w->rollbackDepth; i++) {
+		releaseFrame(&w->frames[i]);
+		free(w->frames[i].descs);
+		free(w->frames[i].singletons);
+		free(w->frames[i].shared);
+	}
+	free(w->frames);
+
+	free(w);
 }
 
-void ecs_shutdown(void)
+void ecs_setThreadIndex(int index)
 {
-	free(zon_arenaUnlock(&ecsStorage));
-	free(zon_arenaUnlock(&cmdStorage));
+	if (index < 0 || index >= MAX_THREAD_COUNT) {
+		fprintf(stderr, "ecs_setThreadIndex: invalid index (max %d)\n", MAX_THREAD_COUNT);
+		exit(1);
+	}
+	threadIndex = index;
 }
 
 EcsComponent ecs_registerComponent(size_t size, size_t alignment)
+{
+	return ecs_registerComponentEx(size, alignment, ECS_STORAGE_TABLE);
+}
+
+EcsComponent ecs_registerComponentEx(size_t size, size_t alignment,
+				     EcsStorage storage)
 {
 	ComponentDesc *desc = &compDescs[compCount];
 	desc->size = size;
 	desc->alignment = alignment;
+	desc->storage = storage;
+	if (size == 0) tagComps |= COMP_BIT(compCount);
+	else if (storage == ECS_STORAGE_SHARED) sharedComps |= COMP_BIT(compCount);
+
+	if (storage == ECS_STORAGE_SPARSE) sparseComps |= COMP_BIT(compCount);
+
 	return compCount++;
 }
 
-static int comparComponent(const void *a, const void *b)
+size_t ecs_componentSize(EcsComponent comp)
 {
-    EcsComponent ca = *(const EcsComponent *)a;
-    EcsComponent cb = *(const EcsComponent *)b;
-    if (ca < cb) return -1;
-    if (ca > cb) return 1;
-    return 0;
+	return compDescs[comp].size;
 }
 
-Archetype *ecs_registerArchetype(EcsComponent *components, size_t count)
+void ecs_registerEntityField(EcsComponent comp, size_t offset)
 {
-	//sort components for faster iteration
-	if (count > 0 && components != NULL)
-		qsort(components, count, sizeof(EcsComponent), comparComponent);
+	if (entityFieldCount[comp] == MAX_ENTITY_FIELDS) {
+		fprintf(stderr, "ecs_registerEntityField: too many fields (max %d)\n", MAX_ENTITY_FIELDS);
+		exit(1);
+	}
+	entityFields[comp][entityFieldCount[comp]++] = offset;
+}
 
-	Archetype *arch = &archetypes[archCount++];
-	arch->mask = 0;
+/*
+  stamps a column as written in this tick. Anything handing out a mutable
+  pointer or moving rows counts as a write. Threads in deferred mode may
+  stamp the same column at once, they all store the same tick
+ */
+static void stampColumn(EcsWorld *w, Archetype *arch, int cidx)
+{
+	atomic_store_explicit(&arch->colVersion[cidx], w->currentTick,
+			      memory_order_relaxed);
+}
 
-	//write every index cache to -1 to signify it's absence
-	for (int i = 0; i < MAX_COMPONENT_COUNT; ++i)
-		arch->compIndexCache[i] = -1;
+static void stampSparse(EcsWorld *w, SparseSet *set)
+{
+	atomic_store_explicit(&set->version, w->currentTick,
+			      memory_order_relaxed);
+}
 
-	for (int i = 0; i < count; i++) {
-		EcsComponent comp = components[i];
-		const ComponentDesc desc = compDescs[comp];
-		arch->componentIds[i] = comp;
-		arch->mask |= COMP_BIT(comp);
-		arch->storage[i] =
-			zon_arenaAlloc(&ecsStorage,
-				       MAX_ARCH_ENTITY * desc.size,
-				       desc.alignment);
-		arch->compIndexCache[comp] = i;
-	}
-	arch->compCount = count;
-	arch->entCount = 0;
+/* the sparse set of the component in the world, made if missing */
+static SparseSet *makeSparseSet(EcsWorld *w, EcsComponent comp)
+{
+	SparseSet *set = w->sparseSets[comp];
+	if (set) return set;
 
-	for (int i = 0; i < queryCount; i++) {
-		EcsQuery *q = &queries[i];
-		if ((arch->mask & q->include) == q->include &&
-		    (arch->mask & q->exclude) == 0) {
-			q->matches[q->matchCount++] = arch;
-		}
+	size_t size = compDescs[comp].size;
+	set = malloc(sizeof(SparseSet));
+	void *data = size ? malloc(MAX_ENTITY_COUNT * size) : NULL;
+	if (!set || (size && !data)) {
+		fprintf(stderr, "sparseSet: out of memory\n");
+		exit(1);
 	}
+	set->data = data;
+	set->count = 0;
+	stampSparse(w, set);
+	w->sparseSets[comp] = set;
 
-	return arch;
+	return set;
 }
 
-bool ecs_isValid(Entity ent)
+/* the sparse set of a component some entity or query already uses */
+static SparseSet *sparseSet(EcsWorld *w, EcsComponent comp)
 {
-	return entDescs[ECS_ENTITY_INDEX(ent)].id == ent;
+	return w->sparseSets[comp];
 }
 
-Archetype *ecs_getEntityArch(Entity ent)
+static void *sparseGet(EcsWorld *w, EcsComponent comp, uint32_t index)
 {
-	return entDescs[ECS_ENTITY_INDEX(ent)].arch;
+	SparseSet *set = sparseSet(w, comp);
+	if (!set->data) return NULL; //tag
+	return (uint8_t*)set->data + set->sparse[index] * compDescs[comp].size;
 }
 
-Entity ecs_newEntity(void)
+/* adds a zeroed component, returns the existing one if present */
+static void *sparseAdd(EcsWorld *w, EcsComponent comp, uint32_t index)
 {
-	return ecs_newEntityInArch(emptyArch);
-}
+	SparseSet *set = makeSparseSet(w, comp);
+	EntityDesc *desc = &w->entDescs[index];
+	stampSparse(w, set);
+	if (desc->sparseMask & COMP_BIT(comp)) return sparseGet(w, comp, index);
 
+	size_t size = compDescs[comp].size;
+	uint32_t pos = set->count++;
+	set->sparse[index] = pos;
+	set->dense[pos] = index;
+	desc->sparseMask |= COMP_BIT(comp);
+	if (!set->data) return NULL; //tag
+
+	void *ptr = (uint8_t*)set->data + pos * size;
+	memset(ptr, 0, size);
+	return ptr;
+}
 
-Entity ecs_newEntityInArch(Archetype *arch)
+static void sparseRemove(EcsWorld *w, EcsComponent comp, uint32_t index)
 {
-	// Ensure the free-list head is valid
-	if (nextFreeEntity == UINT32_MAX) {
-		fprintf(stderr, "ecs_newEntityInArch: out of entity slots\n");
-		exit(1);
-	}
-	
-	uint32_t currentFree = nextFreeEntity;
-	EntityDesc *desc = &entDescs[currentFree];
-	nextFreeEntity = ECS_ENTITY_INDEX(desc->id);
-
-	uint32_t generation = ECS_ENTITY_GENERATION(desc->id);
-	desc->id = CREATE_ENTITY(currentFree, generation + 1);
+	EntityDesc *desc = &w->entDescs[index];
+	if (!(desc->sparseMask & COMP_BIT(comp))) return;
+	SparseSet *set = sparseSet(w, comp);
 
-	if (arch->entCount >= MAX_ARCH_ENTITY) {
-		fprintf(stderr, "ecs_newEntityInArch: archetype full (max %d)\n", MAX_ARCH_ENTITY);
-		exit(1);
+	size_t size = compDescs[comp].size;
+	uint32_t pos = set->sparse[index];
+	uint32_t last = --set->count;
+	if (pos != last) {
+		uint32_t lastIndex = set->dense[last];
+		set->dense[pos] = lastIndex;
+		set->sparse[lastIndex] = pos;
+		if (set->data)
+			memcpy((uint8_t*)set->data + pos * size,
+			       (uint8_t*)set->data + last * size, size);
 	}
-	entCount++;
-
-	int slot = arch->entCount;
-	arch->entities[slot] = desc->id;
-	desc->arch = arch;
-	desc->slot = slot;
-	arch->entCount++;
 
-	return desc->id;
+	desc->sparseMask &= ~COMP_BIT(comp);
+	stampSparse(w, set);
 }
 
-static void markBucketDirty(uint32_t entIndex)
+static void pushPtr(PtrList *list, void *item)
 {
-	CmdBucket *buck = &cmdBuckets[entIndex];
-	if (!buck->active) {
-		buck->active = true;
-		dirties[dirtyCount++] = entIndex;
+	if (list->count == list->cap) {
+		int cap = list->cap ? list->cap * 2 : 8;
+		void **items = realloc(list->items, cap * sizeof(void*));
+		if (!items) {
+			fprintf(stderr, "pushPtr: out of memory\n");
+			exit(1);
+		}
+		list->items = items;
+		list->cap = cap;
 	}
+	list->items[list->count++] = item;
 }
 
-static void ecs_destroyImmediate(Entity ent)
+/* removes the item keeping the order of the others */
+static void removePtr(PtrList *list, void *item)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	uint32_t gen = ECS_ENTITY_GENERATION(ent);
-	EntityDesc *desc = &entDescs[index];
-
-	Archetype *arch = desc->arch;
-	int slot = desc->slot;
-	int last = --arch->entCount;
-
-	if (slot != last) {
-		Entity lastEnt = arch->entities[last];
-		arch->entities[slot] = lastEnt;
-
-		for (int i = 0; i < arch->compCount; i++) {
-			size_t size = compDescs[arch->componentIds[i]].size;
-			memcpy((uint8_t*)arch->storage[i] + slot * size,
-			       (uint8_t*)arch->storage[i] + last * size, size);
-		}
+	for (int i = 0; i < list->count; i++) {
+		if (list->items[i] != item) continue;
+		memmove(list->items + i, list->items + i + 1,
+			(list->count - i - 1) * sizeof(void*));
+		list->count--;
+		return;
+	}
+}
 
-		entDescs[ECS_ENTITY_INDEX(lastEnt)].slot = slot;
+/* allocates from the storage chunks, adding a chunk if the current is full */
+static void *storageAlloc(EcsWorld *w, size_t size, size_t alignment)
+{
+	void *ptr = w->storageChunks.count ?
+		zon_arenaAlloc(&w->ecsStorage, size, alignment) : NULL;
+	if (ptr) return ptr;
+
+	size_t chunkSize = STORAGE_CHUNK_SIZE;
+	if (chunkSize < size + alignment) chunkSize = size + alignment;
+	void *chunk = malloc(chunkSize);
+	if (!chunk) {
+		fprintf(stderr, "storageAlloc: out of memory\n");
+		exit(1);
 	}
+	pushPtr(&w->storageChunks, chunk);
+	w->ecsStorage = zon_arenaCreate(chunk, chunkSize);
 
-	desc->arch = NULL;
-	desc->id = CREATE_ENTITY(nextFreeEntity, gen+1);
-	desc->slot = -1;
-	nextFreeEntity = index;
+	return zon_arenaAlloc(&w->ecsStorage, size, alignment);
+}
 
-	entCount--;
+static int blockClass(size_t size)
+{
+	int c = 0;
+	while ((size_t)COLUMN_ALIGN << c < size) c++;
+	return c;
 }
 
-static void ecs_destroyDeferred(Entity ent)
+/* takes a block of at least size bytes from the pool */
+static void *allocBlock(EcsWorld *w, size_t size)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	CmdBucket *buck = &cmdBuckets[index];
+	int c = blockClass(size);
+	if (c >= COLUMN_CLASS_COUNT) {
+		fprintf(stderr, "allocBlock: block too large\n");
+		exit(1);
+	}
 
-	//ignore if already schduled to destroy
-	if (buck->destroy) return;
+	FreeBlock *block = w->freeBlocks[c];
+	if (block) {
+		w->freeBlocks[c] = block->next;
+		return block;
+	}
+	return storageAlloc(w, (size_t)COLUMN_ALIGN << c, COLUMN_ALIGN);
+}
 
-	buck->destroy = true;
-	buck->addMask = 0;
-	buck->remMask = 0;
+static void freeBlock(EcsWorld *w, void *ptr, size_t size)
+{
+	int c = blockClass(size);
+	FreeBlock *block = ptr;
+	block->next = w->freeBlocks[c];
+	w->freeBlocks[c] = block;
+}
 
-	markBucketDirty(index);
+/*
+  the archetype list of the component of mask with the fewest archetypes.
+  A query is indexed by it when made and only scans it, and a new
+  archetype is only checked against the queries indexed by one of its
+  components (and the ones including nothing)
+ */
+static PtrList *rarestArchList(EcsWorld *w, EcsMask mask)
+{
+	PtrList *rarest = NULL;
+	while (mask) {
+		PtrList *list = &w->compArchs[popLowestBit(&mask)];
+		if (!rarest || list->count < rarest->count) rarest = list;
+	}
+	return rarest;
 }
 
-void ecs_destroy(Entity ent)
+static bool queryMatches(const EcsQuery *q, const Archetype *arch)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	if (entDescs[index].id != ent) return;
+	return (arch->mask & q->include) == q->include &&
+	       (arch->mask & q->exclude) == 0;
+}
 
-	if (inDeferred) ecs_destroyDeferred(ent);
-	else ecs_destroyImmediate(ent);
+static void addMatch(EcsQuery *q, Archetype *arch)
+{
+	if (q->matchCount == q->matchCap) {
+		int cap = q->matchCap ? q->matchCap * 2 : 8;
+		Archetype **matches = realloc(q->matches,
+					      cap * sizeof(Archetype*));
+		if (!matches) {
+			fprintf(stderr, "addMatch: out of memory\n");
+			exit(1);
+		}
+		q->matches = matches;
+
+		if (q->groupSize) {
+			GroupIndex *groups = realloc(q->groups,
+						     cap * sizeof(GroupIndex));
+			if (!groups) {
+				fprintf(stderr, "addMatch: out of memory\n");
+				exit(1);
+			}
+			memset(groups + q->matchCap, 0,
+			       (cap - q->matchCap) * sizeof(GroupIndex));
+			q->groups = groups;
+		}
+		q->matchCap = cap;
+	}
+	q->matches[q->matchCount++] = arch;
 }
 
-static void *ecs_addComponentImmediate(Entity ent, EcsComponent comp)
+static int comparComponent(const void *a, const void *b)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	Archetype *oldArch = entDescs[index].arch;
-	int oldCount = oldArch->compCount;
+    EcsComponent ca = *(const EcsComponent *)a;
+    EcsComponent cb = *(const EcsComponent *)b;
+    if (ca < cb) return -1;
+    if (ca > cb) return 1;
+    return 0;
+}
 
-	// check if the component is already present
-	int insertPos = oldArch->compIndexCache[comp];
-	if (insertPos >= 0) {
-		size_t size = compDescs[comp].size;
-		return (uint8_t*)oldArch->storage[insertPos] +
-		       entDescs[index].slot * size;
-	}
-
-	insertPos = 0;
-	while (insertPos < oldCount &&
-	       oldArch->componentIds[insertPos] < comp) insertPos++;
-
-	int newCount = oldCount + 1;
-	EcsMask mask = oldArch->mask | COMP_BIT(comp);
-
-	//find or create archetype
-	Archetype *newArch = NULL;
-	for (int i = 0; i < archCount; i++) {
-		Archetype *arch = &archetypes[i];
-		if (arch->mask == mask) {
-			newArch = arch;
-			break;
-		}
-	}
-	if (!newArch) {
-		size_t marker = zon_arenaMarker(&ecsStorage);
-		EcsComponent *ids = zon_arenaMalloc(&ecsStorage, newCount * sizeof(EcsComponent));
-		//copy before insertPos
-		if (insertPos > 0)
-			memcpy(ids, oldArch->componentIds,
-			       insertPos * sizeof(EcsComponent));
-		ids[insertPos] = comp;
-		if (oldCount - insertPos > 0)
-			memcpy(ids + insertPos + 1,
-			       oldArch->componentIds + insertPos,
-			       (oldCount - insertPos) * sizeof(EcsComponent));
-		newArch = ecs_registerArchetype(ids, newCount);
-		zon_arenaRewind(&ecsStorage, marker);
-	}
-
-	//copy data from old to new archetype
-	int oldSlot = entDescs[index].slot;
-	int newSlot = newArch->entCount++;
+/* makes an archetype which may be collected once unused */
+static Archetype *createArchetype(EcsWorld *w, EcsComponent *components,
+				  size_t count)
+{
+	//sort components for faster iteration
+	if (count > 0 && components != NULL)
+		qsort(components, count, sizeof(EcsComponent), comparComponent);
 
-	//--- before insertPos
-	for (int i = 0; i < insertPos; i++) {
-		size_t size = compDescs[oldArch->componentIds[i]].size;
-		memcpy((uint8_t*)newArch->storage[i] + newSlot * size,
-		       (uint8_t*)oldArch->storage[i] + oldSlot * size, size);
+	Archetype *arch;
+	if (w->unusedArchs.count) {
+		arch = w->unusedArchs.items[--w->unusedArchs.count];
+	} else if (w->archCount < MAX_ARCHETYPE_COUNT) {
+		arch = &w->archetypes[w->archCount++];
+	} else {
+		fprintf(stderr, "ecs_registerArchetype: too many archetypes (max %d)\n", MAX_ARCHETYPE_COUNT);
+		exit(1);
 	}
+	arch->mask = 0;
+	arch->pinned = false;
+	arch->unused = false;
+	arch->emptySince = w->currentTick;
+	arch->planCount = 0;
+	arch->nextPlan = 0;
+	arch->snapCache.chunk = NULL;
+	arch->rollCache.chunk = NULL;
+	arch->hashCache.mask = 0;
 
-	//--- after insertPos
-	for (int i = insertPos; i < oldCount; i++) {
-		size_t size = compDescs[oldArch->componentIds[i]].size;
-		memcpy((uint8_t*)newArch->storage[i+1] + newSlot * size,
-		       (uint8_t*)oldArch->storage[i] + oldSlot * size, size);
+	//write every index cache to -1 to signify it's absence
+	for (int i = 0; i < MAX_COMPONENT_COUNT; ++i) {
+		arch->compIndexCache[i] = -1;
+		arch->shared[i] = NULL;
 	}
 
-	//init new component in new archetype
-	size_t newSize = compDescs[comp].size;
-	uint8_t* newCompPtr = (uint8_t*)newArch->storage[insertPos] + newSlot * newSize;
-	memset(newCompPtr, 0, newSize);
+	int n = 0;
+	for (size_t i = 0; i < count; i++) {
+		EcsComponent comp = components[i];
+		const ComponentDesc desc = compDescs[comp];
+		//sparse components live outside archetypes
+		if (desc.storage == ECS_STORAGE_SPARSE) continue;
 
-	//remove entity index from old archetype
-	int last = --oldArch->entCount;
-	if (oldSlot != last) {
-		Entity lastEnt = oldArch->entities[last];
-		oldArch->entities[oldSlot] = lastEnt;
+		//tags are only a bit in the mask
+		arch->mask |= COMP_BIT(comp);
+		if (desc.size == 0) continue;
 
-		for (int i = 0; i < oldArch->compCount; i++) {
-			size_t sz = compDescs[oldArch->componentIds[i]].size;
-			memcpy((uint8_t*)oldArch->storage[i] + oldSlot * sz,
-			       (uint8_t*)oldArch->storage[i] + last * sz, sz);
+		if (desc.alignment > COLUMN_ALIGN) {
+			fprintf(stderr, "ecs_registerArchetype: alignment too large (max %d)\n", COLUMN_ALIGN);
+			exit(1);
 		}
 
-		entDescs[ECS_ENTITY_INDEX(lastEnt)].slot = oldSlot;
-	}
-
-	//update entity metadata
-	newArch->entities[newSlot] = ent;
-	entDescs[index].arch = newArch;
-	entDescs[index].slot = newSlot;
-
-	return (void*)newCompPtr;
-}
-
-static void *ecs_addComponentDeferred(Entity ent, EcsComponent comp)
-{
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	CmdBucket *buck = &cmdBuckets[index];
-
-	// ignore if scheduled to be destroyed
-	if (buck->destroy) return NULL;
+		if (sharedComps & COMP_BIT(comp)) {
+			arch->shared[comp] = allocBlock(w, desc.size);
+			memset(arch->shared[comp], 0, desc.size);
+			continue;
+		}
 
-	/* if currently has the component and not scheduled
-	   to be removed, return it */
-	Archetype *arch = entDescs[index].arch;
-	int cidx = arch->compIndexCache[comp];
-	if (cidx >= 0) {
-		//has the component
-		//check if not scheduled to be removed
-		if ((buck->remMask & COMP_BIT(comp)) == 0) {
-			size_t sz = compDescs[comp].size;
-			return (uint8_t*)arch->storage[cidx] +
-			       entDescs[index].slot * sz;
+		if (n == MAX_ARCH_COMPONENT) {
+			fprintf(stderr, "ecs_registerArchetype: too many components (max %d)\n", MAX_ARCH_COMPONENT);
+			exit(1);
 		}
+		arch->componentIds[n] = comp;
+		arch->colSize[n] = desc.size;
+		arch->storage[n] = allocBlock(w, MAX_ARCH_ENTITY * desc.size);
+		arch->compIndexCache[comp] = n;
+		stampColumn(w, arch, n);
+		n++;
 	}
+	arch->compCount = n;
+	arch->entCount = 0;
+	memset(arch->disabled, 0, sizeof(arch->disabled));
+	arch->disabledCount = 0;
 
-	//if ADD already staged, return pointer to storage
-	if (buck->addMask & COMP_BIT(comp)) {
-		return buck->data[comp];
+	//every query is indexed by a single component, so none is seen twice
+	for (int i = 0; i < w->looseQueries.count; i++) {
+		EcsQuery *q = w->looseQueries.items[i];
+		if (queryMatches(q, arch)) addMatch(q, arch);
 	}
 
-	//Not staged yet. Stage it.
-	size_t sz = compDescs[comp].size;
-	void *buf = zon_arenaMalloc(&cmdStorage, sz);
-	if (!buf) return NULL;
-	buck->data[comp] = buf;
-	buck->addMask |= COMP_BIT(comp);
-	buck->remMask &= ~COMP_BIT(comp);
+	EcsMask bits = arch->mask;
+	while (bits) {
+		EcsComponent comp = popLowestBit(&bits);
+		PtrList *queries = &w->compQueries[comp];
+		for (int i = 0; i < queries->count; i++) {
+			EcsQuery *q = queries->items[i];
+			if (queryMatches(q, arch)) addMatch(q, arch);
+		}
+		pushPtr(&w->compArchs[comp], arch);
+	}
 
-	markBucketDirty(index);
-	return buf;
+	return arch;
 }
 
-void *ecs_addComponent(Entity ent, EcsComponent comp)
+Archetype *ecs_registerArchetype(EcsWorld *w, EcsComponent *components,
+				  size_t count)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	if (entDescs[index].id != ent) return NULL;
+	Archetype *arch = createArchetype(w, components, count);
+	arch->pinned = true; //the user keeps it
 
-	if (inDeferred) return ecs_addComponentDeferred(ent, comp);
-	else return ecs_addComponentImmediate(ent, comp);
+	return arch;
 }
 
-static void ecs_removeComponentImmediate(Entity ent, EcsComponent comp)
+bool ecs_isValid(EcsWorld *w, Entity ent)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	Archetype *oldArch = entDescs[index].arch;
-	int oldCount = oldArch->compCount;
+	return w->entDescs[ECS_ENTITY_INDEX(ent)].id == ent;
+}
 
-	// check if the component is present
-	int remPos = oldArch->compIndexCache[comp];
-	if (remPos < 0) return;
-
-	remPos = 0;
-	while (remPos < oldCount &&
-	       oldArch->componentIds[remPos] < comp) remPos++;
-
-	int newCount = oldCount - 1;
-	EcsMask mask = oldArch->mask & ~COMP_BIT(comp);
-
-	//find or create archetype
-	Archetype *newArch = NULL;
-	for (int i = 0; i < archCount; i++) {
-		Archetype *arch = &archetypes[i];
-		if (arch->mask == mask) {
-			newArch = arch;
-			break;
-		}
-	}
-	if (!newArch) {
-		size_t marker = zon_arenaMarker(&ecsStorage);
-		EcsComponent *ids = zon_arenaMalloc(&ecsStorage, newCount * sizeof(EcsComponent));
-		//copy before remPos
-		if (remPos > 0)
-			memcpy(ids, oldArch->componentIds,
-			       remPos * sizeof(EcsComponent));
-		if (oldCount - remPos - 1 > 0)
-			memcpy(ids + remPos,
-			       oldArch->componentIds + remPos + 1,
-			       (oldCount - remPos - 1) * sizeof(EcsComponent));
-		newArch = ecs_registerArchetype(ids, newCount);
-		zon_arenaRewind(&ecsStorage, marker);
-	}
-
-	//copy data from old to new archetype
-	int oldSlot = entDescs[index].slot;
-	int newSlot = newArch->entCount++;
+Archetype *ecs_getEntityArch(EcsWorld *w, Entity ent)
+{
+	return w->entDescs[ECS_ENTITY_INDEX(ent)].arch;
+}
 
-	//--- before remPos
-	for (int i = 0; i < remPos; i++) {
-		size_t size = compDescs[oldArch->componentIds[i]].size;
-		memcpy((uint8_t*)newArch->storage[i] + newSlot * size,
-		       (uint8_t*)oldArch->storage[i] + oldSlot * size, size);
-	}
+Entity ecs_newEntity(EcsWorld *w)
+{
+	return ecs_newEntityInArch(w, w->emptyArch);
+}
 
-	//--- after remPos
-	for (int i = remPos + 1; i < oldCount; i++) {
-		size_t size = compDescs[oldArch->componentIds[i]].size;
-		memcpy((uint8_t*)newArch->storage[i-1] + newSlot * size,
-		       (uint8_t*)oldArch->storage[i] + oldSlot * size, size);
-	}
 
-	//remove entity index from old archetype
-	int last = --oldArch->entCount;
-	if (oldSlot != last) {
-		Entity lastEnt = oldArch->entities[last];
-		oldArch->entities[oldSlot] = lastEnt;
+static size_t lookupSlot(const CmdBuffer *cmd, uint32_t entIndex)
+{
+	return (entIndex * 2654435761u) & (cmd->lookupCap - 1);
+}
 
-		for (int i = 0; i < oldArch->compCount; i++) {
-			size_t sz = compDescs[oldArch->componentIds[i]].size;
-			memcpy((uint8_t*)oldArch->storage[i] + oldSlot * sz,
-			       (uint8_t*)oldArch->storage[i] + last * sz, sz);
-		}
+static void insertLookup(CmdBuffer *cmd, size_t bucket)
+{
+	size_t mask = cmd->lookupCap - 1;
+	size_t i = lookupSlot(cmd, cmd->buckets[bucket].entIndex);
+	while (cmd->lookup[i]) i = (i + 1) & mask;
+	cmd->lookup[i] = bucket + 1;
+}
 
-		entDescs[ECS_ENTITY_INDEX(lastEnt)].slot = oldSlot;
+/* returns the bucket of the entity or NULL if not touched */
+static CmdBucket *findBucket(CmdBuffer *cmd, uint32_t entIndex)
+{
+	if (cmd->bucketCount == 0) return NULL;
+
+	size_t mask = cmd->lookupCap - 1;
+	for (size_t i = lookupSlot(cmd, entIndex);; i = (i + 1) & mask) {
+		uint32_t b = cmd->lookup[i];
+		if (b == 0) return NULL;
+		if (cmd->buckets[b - 1].entIndex == entIndex)
+			return &cmd->buckets[b - 1];
 	}
-
-	//update entity metadata
-	newArch->entities[newSlot] = ent;
-	entDescs[index].arch = newArch;
-	entDescs[index].slot = newSlot;
 }
 
-static void ecs_removeComponentDeferred(Entity ent, EcsComponent comp)
+/* returns the bucket of the entity, appends a clean one if missing */
+static CmdBucket *touchBucket(CmdBuffer *cmd, uint32_t entIndex)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	CmdBucket *buck = &cmdBuckets[index];
-
-	//ignore if entity is scheduled to be destroyed
-	if (buck->destroy) return;
+	CmdBucket *buck = findBucket(cmd, entIndex);
+	if (buck) return buck;
+
+	if (cmd->bucketCount == cmd->bucketCap) {
+		size_t cap = cmd->bucketCap ? cmd->bucketCap * 2 : 64;
+		CmdBucket *buckets = realloc(cmd->buckets,
+					     cap * sizeof(CmdBucket));
+		uint32_t *lookup = realloc(cmd->lookup,
+					   cap * 2 * sizeof(uint32_t));
+		if (!buckets || !lookup) {
+			fprintf(stderr, "touchBucket: out of memory\n");
+			exit(1);
+		}
 
-	//ignore if component is neither in the arch or staged
-	Archetype *arch = entDescs[index].arch;
-	if (arch->compIndexCache[comp] < 0 &&
-	    !(buck->addMask & COMP_BIT(comp))) return;
+		cmd->buckets = buckets;
+		cmd->bucketCap = cap;
+		cmd->lookup = lookup;
+		cmd->lookupCap = cap * 2;
+		memset(lookup, 0, cmd->lookupCap * sizeof(uint32_t));
+		for (size_t i = 0; i < cmd->bucketCount; i++)
+			insertLookup(cmd, i);
+	}
 
-	//mark removal and disable ADD command
-	buck->remMask |= COMP_BIT(comp);
-	buck->addMask &= ~COMP_BIT(comp);
-	//disabling add does not delete staged component data
+	buck = &cmd->buckets[cmd->bucketCount];
+	*buck = (CmdBucket){ .entIndex = entIndex };
+	insertLookup(cmd, cmd->bucketCount++);
 
-	markBucketDirty(index);
+	return buck;
 }
 
-void ecs_removeComponent(Entity ent, EcsComponent comp)
+/* forgets every bucket, only the used lookup slots get cleared */
+static void resetBuffer(CmdBuffer *cmd)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	if (entDescs[index].id != ent) return;
+	size_t mask = cmd->lookupCap - 1;
+	for (size_t b = 0; b < cmd->bucketCount; b++) {
+		size_t i = lookupSlot(cmd, cmd->buckets[b].entIndex);
+		while (cmd->lookup[i] != b + 1) i = (i + 1) & mask;
+		cmd->lookup[i] = 0;
+	}
 
-	if (inDeferred) ecs_removeComponentDeferred(ent, comp);
-	else ecs_removeComponentImmediate(ent, comp);
+	cmd->bucketCount = 0;
+	zon_arenaRewind(&cmd->storage, 0);
 }
 
-void *ecs_getComponent(Entity ent, EcsComponent comp)
+static StagedComp *findStaged(CmdBucket *buck, EcsComponent comp)
 {
-	uint32_t index = ECS_ENTITY_INDEX(ent);
-	if (entDescs[index].id != ent) return NULL;
+	StagedComp *st = buck->staged;
+	while (st && st->comp != comp) st = st->next;
+	return st;
+}
+
+/* takes a handle from the free list without placing it anywhere */
+static EntityDesc *reserveEntity(EcsWorld *w)
+{
+	// Ensure the free-list head is valid
+	if (w->nextFreeEntity == UINT32_MAX) {
+		fprintf(stderr, "ecs_newEntityInArch: out of entity slots\n");
+		exit(1);
+	}
+
+	uint32_t currentFree = w->nextFreeEntity;
+	EntityDesc *desc = &w->entDescs[currentFree];
+	w->nextFreeEntity = ECS_ENTITY_INDEX(desc->id);
+
+	uint32_t generation = ECS_ENTITY_GENERATION(desc->id);
+	desc->id = CREATE_ENTITY(currentFree, generation + 1);
+	desc->arch = NULL;
+	desc->slot = -1;
+	w->entCount++;
+
+	return desc;
+}
+
+/* gives the handle back to the free list */
+static void releaseEntity(EcsWorld *w, uint32_t index)
+{
+	EntityDesc *desc = &w->entDescs[index];
+	uint32_t gen = ECS_ENTITY_GENERATION(desc->id);
+
+	EcsMask sparseMask = desc->sparseMask;
+	while (sparseMask) sparseRemove(w, popLowestBit(&sparseMask), index);
+
+	desc->arch = NULL;
+	desc->id = CREATE_ENTITY(w->nextFreeEntity, gen+1);
+	desc->slot = -1;
+	w->nextFreeEntity = index;
+
+	w->entCount--;
+}
+
+static Entity ecs_newEntityDeferred(EcsWorld *w, Archetype *arch,
+				    const EcsPrefab *prefab)
+{
+	while (atomic_flag_test_and_set_explicit(&w->entityLock,
+						 memory_order_acquire));
+	EntityDesc *desc = reserveEntity(w);
+	Entity ent = desc->id;
+	atomic_flag_clear_explicit(&w->entityLock, memory_order_release);
+
+	CmdBucket *buck = touchBucket(&w->cmdBuffers[threadIndex],
+				      ECS_ENTITY_INDEX(ent));
+	buck->create = true;
+	buck->arch = arch;
+	buck->prefab = prefab;
+	buck->addMask = arch->mask;
+
+	return ent;
+}
+
+Entity ecs_newEntityInArch(EcsWorld *w, Archetype *arch)
+{
+	if (w->inDeferred) return ecs_newEntityDeferred(w, arch, NULL);
+
+	if (arch->entCount >= MAX_ARCH_ENTITY) {
+		fprintf(stderr, "ecs_newEntityInArch: archetype full (max %d)\n", MAX_ARCH_ENTITY);
+		exit(1);
+	}
+
+	EntityDesc *desc = reserveEntity(w);
+	int slot = arch->entCount;
+	arch->entities[slot] = desc->id;
+	desc->arch = arch;
+	desc->slot = slot;
+	arch->entCount++;
+
+	return desc->id;
+}
+
+/* returns the archetype with the exact mask, creates it if missing */
+static Archetype *findArchetype(EcsWorld *w, EcsMask mask)
+{
+	PtrList *list = rarestArchList(w, mask);
+	if (!list) return w->emptyArch;
+
+	for (int i = 0; i < list->count; i++) {
+		Archetype *arch = list->items[i];
+		if (arch->mask == mask) return arch;
+	}
+
+	//bits are popped in ascending order, so ids are already sorted
+	EcsComponent ids[MAX_COMPONENT_COUNT];
+	size_t count = 0;
+	while (mask) ids[count++] = popLowestBit(&mask);
+
+	return createArchetype(w, ids, count);
+}
+
+/* checks the shared value of the archetype (NULL value means zeroed) */
+static bool sharedEquals(Archetype *arch, EcsComponent comp,
+			 const void *value)
+{
+	size_t size = compDescs[comp].size;
+	const uint8_t *cur = arch->shared[comp];
+	if (value) return memcmp(cur, value, size) == 0;
+
+	for (size_t i = 0; i < size; i++)
+		if (cur[i]) return false;
+	return true;
+}
+
+/* shared value wanted for comp: staged one, the one of src or zeroed */
+static const void *wantedShared(Archetype *src, StagedComp *staged,
+				EcsMask stagedMask, EcsComponent comp)
+{
+	if (stagedMask & COMP_BIT(comp)) {
+		while (staged && staged->comp != comp) staged = staged->next;
+		if (staged) return staged->data;
+	}
+	if (src && (src->mask & COMP_BIT(comp))) return src->shared[comp];
+	return NULL;
+}
+
+/*
+  Archetypes with the same mask may differ only by their shared values
+  (groups). Moves keep the shared values of the old one, newly added
+  shared components are zeroed
+
+  returns the archetype with the exact mask and the shared values of src,
+  overridden by the staged ones in stagedMask (NULL if missing)
+ */
+static Archetype *lookupGroup(EcsWorld *w, Archetype *src, EcsMask mask,
+			      StagedComp *staged, EcsMask stagedMask)
+{
+	EcsMask shared = mask & sharedComps;
+	stagedMask &= shared;
+	if (src && src->mask == mask && !stagedMask) return src;
+
+	PtrList *list = rarestArchList(w, mask);
+	if (!list) return w->emptyArch;
+
+	for (int i = 0; i < list->count; i++) {
+		Archetype *arch = list->items[i];
+		if (arch->mask != mask) continue;
+
+		bool same = true;
+		EcsMask bits = shared;
+		while (bits && same) {
+			EcsComponent comp = popLowestBit(&bits);
+			same = sharedEquals(arch, comp, wantedShared(src, staged,
+					    stagedMask, comp));
+		}
+		if (same) return arch;
+	}
+	return NULL;
+}
+
+/* same as lookupGroup, creates the archetype if missing */
+static Archetype *findGroup(EcsWorld *w, Archetype *src, EcsMask mask,
+			    StagedComp *staged, EcsMask stagedMask)
+{
+	Archetype *arch = lookupGroup(w, src, mask, staged, stagedMask);
+	if (arch) return arch;
+
+	EcsMask shared = mask & sharedComps;
+	if (!shared) return findArchetype(w, mask);
+
+	EcsComponent ids[MAX_COMPONENT_COUNT];
+	size_t count = 0;
+	EcsMask bits = mask;
+	while (bits) ids[count++] = popLowestBit(&bits);
+	arch = createArchetype(w, ids, count);
+
+	while (shared) {
+		EcsComponent comp = popLowestBit(&shared);
+		const void *value = wantedShared(src, staged, stagedMask, comp);
+		if (value)
+			memcpy(arch->shared[comp], value, compDescs[comp].size);
+	}
+
+	return arch;
+}
+
+/*
+  disabling an entity only flips its bit, which follows the row on moves.
+  Queries skip disabled rows a mask word at a time
+ */
+static bool rowDisabled(const Archetype *arch, int slot)
+{
+	return (arch->disabled[slot >> 6] >> (slot & 63)) & 1;
+}
+
+static void setRowDisabled(Archetype *arch, int slot, bool disabled)
+{
+	uint64_t *word = &arch->disabled[slot >> 6];
+	uint64_t bit = 1ULL << (slot & 63);
+	if (((*word & bit) != 0) == disabled) return;
+
+	*word ^= bit;
+	arch->disabledCount += disabled ? 1 : -1;
+}
+
+/* first enabled row at or after slot (entCount if none) */
+static int nextEnabled(const Archetype *arch, int slot)
+{
+	int words = (arch->entCount + 63) >> 6;
+	int w = slot >> 6;
+	if (w >= words) return arch->entCount;
+
+	uint64_t bits = ~arch->disabled[w] & (~0ULL << (slot & 63));
+	while (!bits) {
+		if (++w == words) return arch->entCount;
+		bits = ~arch->disabled[w];
+	}
+
+	int next = (w << 6) + lowestBit(bits);
+	return next < arch->entCount ? next : arch->entCount;
+}
+
+/* marks every column of the archetype as written in this tick */
+static void touchColumns(EcsWorld *w, Archetype *arch)
+{
+	for (int i = 0; i < arch->compCount; i++)
+		stampColumn(w, arch, i);
+}
+
+/* copies one value, common sizes get a constant size copy */
+static inline void copyValue(void *dst, const void *src, size_t size)
+{
+	switch (size) {
+	case 4: memcpy(dst, src, 4); break;
+	case 8: memcpy(dst, src, 8); break;
+	case 12: memcpy(dst, src, 12); break;
+	case 16: memcpy(dst, src, 16); break;
+	default: memcpy(dst, src, size); break;
+	}
+}
+
+/* the cached plan to move rows from src to dst, built on first use */
+static MovePlan *getMovePlan(Archetype *src, Archetype *dst)
+{
+	for (int i = 0; i < src->planCount; i++) {
+		MovePlan *plan = &src->plans[i];
+		if (plan->dst == dst && plan->dstGeneration == dst->generation)
+			return plan;
+	}
+
+	MovePlan *plan;
+	if (src->planCount < MAX_MOVE_PLANS) {
+		plan = &src->plans[src->planCount++];
+	} else {
+		plan = &src->plans[src->nextPlan];
+		src->nextPlan = (src->nextPlan + 1) % MAX_MOVE_PLANS;
+	}
+	plan->dst = dst;
+	plan->dstGeneration = dst->generation;
+
+	int copies = 0;
+	for (int i = 0; i < dst->compCount; i++) {
+		int srcIdx = src->compIndexCache[dst->componentIds[i]];
+		if (srcIdx < 0) continue;
+		plan->srcCol[copies] = srcIdx;
+		plan->dstCol[copies] = i;
+		plan->size[copies] = dst->colSize[i];
+		copies++;
+	}
+	plan->copyCount = copies;
+
+	int n = copies;
+	for (int i = 0; i < dst->compCount; i++) {
+		if (src->compIndexCache[dst->componentIds[i]] >= 0) continue;
+		plan->dstCol[n] = i;
+		plan->size[n] = dst->colSize[i];
+		n++;
+	}
+	plan->zeroCount = n - copies;
+
+	return plan;
+}
+
+/* swap-removes the row at slot, the last row takes its place */
+static void removeRow(EcsWorld *w, Archetype *arch, int slot)
+{
+	int last = --arch->entCount;
+	arch->rowsVersion++;
+	if (last == 0) arch->emptySince = w->currentTick;
+	bool lastDisabled = rowDisabled(arch, last);
+	setRowDisabled(arch, last, false);
+	if (slot == last) return;
+
+	setRowDisabled(arch, slot, lastDisabled);
+	Entity lastEnt = arch->entities[last];
+	arch->entities[slot] = lastEnt;
+
+	for (int i = 0; i < arch->compCount; i++) {
+		size_t size = arch->colSize[i];
+		uint8_t *col = arch->storage[i];
+		copyValue(col + slot * size, col + last * size, size);
+		stampColumn(w, arch, i);
+	}
+
+	w->entDescs[ECS_ENTITY_INDEX(lastEnt)].slot = slot;
+}
+
+/*
+  moves the entity to the new archetype in a single step. Components in
+  both archetypes are copied, the ones only in the new archetype are
+  zeroed and the rest are dropped. Returns the new slot
+ */
+static int moveEntity(EcsWorld *w, uint32_t index, Archetype *newArch)
+{
+	EntityDesc *desc = &w->entDescs[index];
+	Archetype *oldArch = desc->arch;
+	int oldSlot = desc->slot;
+	if (oldArch == newArch) return oldSlot;
+
+	if (newArch->entCount >= MAX_ARCH_ENTITY) {
+		fprintf(stderr, "moveEntity: archetype full (max %d)\n", MAX_ARCH_ENTITY);
+		exit(1);
+	}
+	int newSlot = newArch->entCount++;
+
+	MovePlan *plan = getMovePlan(oldArch, newArch);
+	int i = 0;
+	for (; i < plan->copyCount; i++) {
+		size_t size = plan->size[i];
+		copyValue((uint8_t*)newArch->storage[plan->dstCol[i]] +
+			  newSlot * size,
+			  (uint8_t*)oldArch->storage[plan->srcCol[i]] +
+			  oldSlot * size, size);
+	}
+	for (; i < plan->copyCount + plan->zeroCount; i++) {
+		size_t size = plan->size[i];
+		memset((uint8_t*)newArch->storage[plan->dstCol[i]] +
+		       newSlot * size, 0, size);
+	}
+	touchColumns(w, newArch);
+
+	bool disabled = rowDisabled(oldArch, oldSlot);
+	removeRow(w, oldArch, oldSlot);
+	setRowDisabled(newArch, newSlot, disabled);
+
+	newArch->entities[newSlot] = desc->id;
+	desc->arch = newArch;
+	desc->slot = newSlot;
+
+	return newSlot;
+}
+
+static void ecs_destroyImmediate(EcsWorld *w, Entity ent)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	EntityDesc *desc = &w->entDescs[index];
+
+	removeRow(w, desc->arch, desc->slot);
+	releaseEntity(w, index);
+}
+
+static void ecs_destroyDeferred(EcsWorld *w, Entity ent)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	CmdBucket *buck = touchBucket(&w->cmdBuffers[threadIndex], index);
+
+	//ignore if already schduled to destroy
+	if (buck->destroy) return;
+
+	buck->destroy = true;
+	buck->addMask = 0;
+	buck->remMask = 0;
+	buck->sparseAddMask = 0;
+	buck->sparseRemMask = 0;
+}
+
+void ecs_destroy(EcsWorld *w, Entity ent)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	if (w->entDescs[index].id != ent) return;
+
+	if (w->inDeferred) ecs_destroyDeferred(w, ent);
+	else ecs_destroyImmediate(w, ent);
+}
+
+static void *ecs_addComponentImmediate(EcsWorld *w, Entity ent,
+				       EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	Archetype *arch = w->entDescs[index].arch;
+	int slot = w->entDescs[index].slot;
+
+	// move only if the component is not already present
+	if (!(arch->mask & COMP_BIT(comp))) {
+		arch = findGroup(w, arch, arch->mask | COMP_BIT(comp), NULL, 0);
+		slot = moveEntity(w, index, arch);
+	}
+
+	int cidx = arch->compIndexCache[comp];
+	if (cidx < 0) return arch->shared[comp]; //tag or shared
+
+	stampColumn(w, arch, cidx);
+	return (uint8_t*)arch->storage[cidx] + slot * compDescs[comp].size;
+}
+
+/* default value of a column component, NULL if not in the prefab */
+static const void *prefabDefault(const EcsPrefab *prefab, EcsComponent comp)
+{
+	int cidx = prefab->arch->compIndexCache[comp];
+	return cidx >= 0 ? prefab->defaults[cidx] : NULL;
+}
+
+static void *stageComponent(CmdBuffer *, CmdBucket *, EcsComponent);
+
+static void *ecs_addComponentDeferred(EcsWorld *w, Entity ent,
+				      EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	CmdBuffer *cmd = &w->cmdBuffers[threadIndex];
+	CmdBucket *buck = findBucket(cmd, index);
+
+	// ignore if scheduled to be destroyed
+	if (buck && buck->destroy) return NULL;
+
+	//added again after a removal, the staged value wins at flush
+	StagedComp *st = buck && (buck->addMask & COMP_BIT(comp)) ?
+		findStaged(buck, comp) : NULL;
+	if (st) return st->data;
+
+	/* if currently has the component and not scheduled
+	   to be removed, return it */
+	Archetype *arch = w->entDescs[index].arch;
+	if (arch && (arch->mask & COMP_BIT(comp))) {
+		//has the component
+		//check if not scheduled to be removed
+		if (!buck || (buck->remMask & COMP_BIT(comp)) == 0) {
+			int cidx = arch->compIndexCache[comp];
+			if (cidx < 0) return arch->shared[comp]; //tag or shared
+
+			size_t sz = compDescs[comp].size;
+			stampColumn(w, arch, cidx);
+			return (uint8_t*)arch->storage[cidx] +
+			       w->entDescs[index].slot * sz;
+		}
+	}
+
+	if (!buck) buck = touchBucket(cmd, index);
+
+	//tags have nothing to stage
+	if (tagComps & COMP_BIT(comp)) {
+		buck->addMask |= COMP_BIT(comp);
+		buck->remMask &= ~COMP_BIT(comp);
+		return NULL;
+	}
+
+	return stageComponent(cmd, buck, comp);
+}
+
+/* stages a zeroed component, returns the staged data if already added */
+static void *stageComponent(CmdBuffer *cmd, CmdBucket *buck, EcsComponent comp)
+{
+	bool sparse = sparseComps & COMP_BIT(comp);
+	EcsMask *addMask = sparse ? &buck->sparseAddMask : &buck->addMask;
+	EcsMask *remMask = sparse ? &buck->sparseRemMask : &buck->remMask;
+
+	//if ADD already staged, return pointer to storage
+	StagedComp *st = findStaged(buck, comp);
+	if (st && (*addMask & COMP_BIT(comp))) return st->data;
+
+	//Not staged yet (or add was disabled). Stage it.
+	size_t sz = compDescs[comp].size;
+	if (!st) {
+		st = zon_arenaMalloc(&cmd->storage, sizeof(StagedComp));
+		if (!st) return NULL;
+		st->data = zon_arenaAlloc(&cmd->storage, sz,
+					  compDescs[comp].alignment);
+		if (!st->data) return NULL;
+		st->comp = comp;
+		st->next = buck->staged;
+		buck->staged = st;
+	}
+	//same as an immediate add, instances start from the prefab
+	const void *def = buck->prefab ? prefabDefault(buck->prefab, comp) : NULL;
+	//and created entities from the group they were created in
+	if (!def && buck->create && (sharedComps & COMP_BIT(comp)) &&
+	    (buck->arch->mask & COMP_BIT(comp)))
+		def = buck->arch->shared[comp];
+	if (def) memcpy(st->data, def, sz);
+	else memset(st->data, 0, sz);
+	*addMask |= COMP_BIT(comp);
+	*remMask &= ~COMP_BIT(comp);
+
+	return st->data;
+}
+
+static void *sparseAddDeferred(EcsWorld *w, uint32_t index, EcsComponent comp)
+{
+	CmdBuffer *cmd = &w->cmdBuffers[threadIndex];
+	CmdBucket *buck = findBucket(cmd, index);
+	EcsMask bit = COMP_BIT(comp);
+
+	// ignore if scheduled to be destroyed
+	if (buck && buck->destroy) return NULL;
+
+	StagedComp *st = buck && (buck->sparseAddMask & bit) ?
+		findStaged(buck, comp) : NULL;
+	if (st) return st->data;
+
+	//present and not scheduled to be removed
+	if ((w->entDescs[index].sparseMask & bit) &&
+	    !(buck && (buck->sparseRemMask & bit))) {
+		stampSparse(w, sparseSet(w, comp));
+		return sparseGet(w, comp, index);
+	}
+
+	if (!buck) buck = touchBucket(cmd, index);
+
+	if (tagComps & bit) {
+		buck->sparseAddMask |= bit;
+		buck->sparseRemMask &= ~bit;
+		return NULL;
+	}
+
+	return stageComponent(cmd, buck, comp);
+}
+
+static void sparseRemoveDeferred(EcsWorld *w, uint32_t index,
+				 EcsComponent comp)
+{
+	CmdBuffer *cmd = &w->cmdBuffers[threadIndex];
+	CmdBucket *buck = findBucket(cmd, index);
+	EcsMask bit = COMP_BIT(comp);
+
+	if (buck && buck->destroy) return;
+	if (!(w->entDescs[index].sparseMask & bit) &&
+	    !(buck && (buck->sparseAddMask & bit))) return;
+
+	if (!buck) buck = touchBucket(cmd, index);
+	buck->sparseRemMask |= bit;
+	buck->sparseAddMask &= ~bit;
+}
+
+void *ecs_addComponent(EcsWorld *w, Entity ent, EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	if (w->entDescs[index].id != ent) return NULL;
+
+	if (sparseComps & COMP_BIT(comp)) {
+		if (w->inDeferred) return sparseAddDeferred(w, index, comp);
+		return sparseAdd(w, comp, index);
+	}
+	if (w->inDeferred) return ecs_addComponentDeferred(w, ent, comp);
+	else return ecs_addComponentImmediate(w, ent, comp);
+}
+
+static void ecs_removeComponentImmediate(EcsWorld *w, Entity ent,
+					 EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	Archetype *oldArch = w->entDescs[index].arch;
+
+	// check if the component is present
+	if (!(oldArch->mask & COMP_BIT(comp))) return;
+
+	moveEntity(w, index, findGroup(w, oldArch, oldArch->mask & ~COMP_BIT(comp),
+				    NULL, 0));
+}
+
+static void ecs_removeComponentDeferred(EcsWorld *w, Entity ent,
+					EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	CmdBuffer *cmd = &w->cmdBuffers[threadIndex];
+	CmdBucket *buck = findBucket(cmd, index);
+
+	//ignore if entity is scheduled to be destroyed
+	if (buck && buck->destroy) return;
+
+	//ignore if component is neither in the arch or staged
+	Archetype *arch = w->entDescs[index].arch;
+	if ((!arch || !(arch->mask & COMP_BIT(comp))) &&
+	    !(buck && (buck->addMask & COMP_BIT(comp)))) return;
+
+	if (!buck) buck = touchBucket(cmd, index);
+
+	//mark removal and disable ADD command
+	buck->remMask |= COMP_BIT(comp);
+	buck->addMask &= ~COMP_BIT(comp);
+	//disabling add does not delete staged component data
+}
+
+void ecs_removeComponent(EcsWorld *w, Entity ent, EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	if (w->entDescs[index].id != ent) return;
+
+	if (sparseComps & COMP_BIT(comp)) {
+		if (w->inDeferred) sparseRemoveDeferred(w, index, comp);
+		else sparseRemove(w, comp, index);
+	} else if (w->inDeferred) ecs_removeComponentDeferred(w, ent, comp);
+	else ecs_removeComponentImmediate(w, ent, comp);
+}
+
+void *ecs_getComponent(EcsWorld *w, Entity ent, EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	if (w->entDescs[index].id != ent) return NULL;
+
+	if (sparseComps & COMP_BIT(comp)) {
+		CmdBucket *buck = w->inDeferred ?
+			findBucket(&w->cmdBuffers[threadIndex], index) : NULL;
+		if (buck) {
+			if (buck->destroy) return NULL;
+			else if (buck->sparseRemMask & COMP_BIT(comp)) return NULL;
+			else if (buck->sparseAddMask & COMP_BIT(comp)) {
+				StagedComp *st = findStaged(buck, comp);
+				return st ? st->data : NULL;
+			}
+		}
+
+		if (!(w->entDescs[index].sparseMask & COMP_BIT(comp))) return NULL;
+		stampSparse(w, sparseSet(w, comp));
+		return sparseGet(w, comp, index);
+	}
+
+	if (!w->inDeferred) {
+		Archetype *arch = w->entDescs[index].arch;
+		int slot = w->entDescs[index].slot;
+
+		int cidx = arch->compIndexCache[comp];
+		if (cidx < 0) return arch->shared[comp]; //not in arch or shared
+
+		size_t size = compDescs[comp].size;
+		stampColumn(w, arch, cidx);
+		return (uint8_t*)arch->storage[cidx] + slot * size;
+	}
+
+	CmdBucket *buck = findBucket(&w->cmdBuffers[threadIndex], index);
+
+	if (buck) {
+		//ignore if schduled to destroy
+		if (buck->destroy) return NULL;
+		else if (buck->remMask & COMP_BIT(comp)) return NULL;
+		else if (buck->addMask & COMP_BIT(comp)) {
+			//the staged value wins over the row at flush
+			StagedComp *st = findStaged(buck, comp);
+			if (st) return st->data;
+			if (buck->create && !(tagComps & COMP_BIT(comp)))
+				return stageComponent(&w->cmdBuffers[threadIndex],
+						      buck, comp);
+		}
+	}
+
+	//check inside the current archetype
+	Archetype *arch = w->entDescs[index].arch;
+	if (!arch) return NULL; //created in deferred mode
+	int slot = w->entDescs[index].slot;
+	int cidx = arch->compIndexCache[comp];
+	if (cidx < 0) return arch->shared[comp];
+	size_t size = compDescs[comp].size;
+	stampColumn(w, arch, cidx);
+	return (uint8_t*)arch->storage[cidx] + slot * size;
+}
+
+void ecs_setShared(EcsWorld *w, Entity ent, EcsComponent comp,
+		   const void *value)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	if (w->entDescs[index].id != ent || !(sharedComps & COMP_BIT(comp)))
+		return;
+
+	if (w->inDeferred) {
+		CmdBuffer *cmd = &w->cmdBuffers[threadIndex];
+		CmdBucket *buck = touchBucket(cmd, index);
+		if (buck->destroy) return;
+
+		void *data = stageComponent(cmd, buck, comp);
+		if (data) memcpy(data, value, compDescs[comp].size);
+		return;
+	}
+
+	Archetype *arch = w->entDescs[index].arch;
+	StagedComp st = { .comp = comp, .data = (void*)value };
+	moveEntity(w, index, findGroup(w, arch, arch->mask | COMP_BIT(comp),
+				    &st, COMP_BIT(comp)));
+}
+
+void *ecs_getSharedInArch(Archetype *arch, EcsComponent comp)
+{
+	return arch->shared[comp];
+}
+
+void *ecs_singleton(EcsWorld *w, EcsComponent comp)
+{
+	if (!w->singletons[comp] && compDescs[comp].size) {
+		size_t size = compDescs[comp].size;
+		w->singletons[comp] = storageAlloc(w, size,
+						  compDescs[comp].alignment);
+		memset(w->singletons[comp], 0, size);
+	}
+
+	return w->singletons[comp];
+}
+
+static int comparSpawn(const void *a, const void *b)
+{
+	Archetype *aa = ((const Spawn *)a)->arch;
+	Archetype *ab = ((const Spawn *)b)->arch;
+	if (aa < ab) return -1;
+	if (aa > ab) return 1;
+	return 0;
+}
+
+EcsRef ecs_makeRef(EcsWorld *w, Entity ent, EcsComponent comp)
+{
+	(void)w;
+	return (EcsRef){ .entity = ent, .comp = comp };
+}
+
+/* finds where the component is and caches it if it's in an archetype */
+static void *resolveRef(EcsWorld *w, EcsRef *ref)
+{
+	ref->arch = NULL;
+	void *ptr = ecs_getComponent(w, ref->entity, ref->comp);
+	//staged and sparse values are not cached
+	if (!ptr || w->inDeferred || (sparseComps & COMP_BIT(ref->comp)))
+		return ptr;
+
+	EntityDesc *desc = &w->entDescs[ECS_ENTITY_INDEX(ref->entity)];
+	ref->arch = desc->arch;
+	ref->column = desc->arch->compIndexCache[ref->comp];
+	ref->stamp = desc->arch->rowsVersion;
+	ref->ptr = ptr;
+
+	return ptr;
+}
+
+/*
+  rows only change place when a row leaves their archetype, which bumps
+  its rows version, so the cached address is good while it is the same
+ */
+void *ecs_refGet(EcsWorld *w, EcsRef *ref)
+{
+	Archetype *arch = ref->arch;
+	if (!arch || arch->rowsVersion != ref->stamp || w->inDeferred)
+		return resolveRef(w, ref);
+
+	if (ref->column >= 0) stampColumn(w, arch, ref->column);
+	return ref->ptr;
+}
+
+/* address of the component of a live entity in an archetype or NULL */
+static void *rowAddress(EcsWorld *w, Entity ent, EcsComponent comp)
+{
+	EntityDesc *desc = &w->entDescs[ECS_ENTITY_INDEX(ent)];
+	if (desc->id != ent || !desc->arch) return NULL;
+
+	Archetype *arch = desc->arch;
+	int cidx = arch->compIndexCache[comp];
+	if (cidx < 0) return arch->shared[comp];
+	return (uint8_t*)arch->storage[cidx] + desc->slot * arch->colSize[cidx];
+}
+
+/*
+  prefetches for the entity at i of the list: the descriptor a few
+  entities ahead, then the row once its descriptor is in cache, so the
+  loads of different entities overlap
+ */
+static void prefetchAhead(EcsWorld *w, const Entity *ents, int n, int i,
+			  EcsComponent comp)
+{
+	if (i + DESC_PREFETCH_AHEAD < n)
+		PREFETCH(&w->entDescs[ECS_ENTITY_INDEX(ents[i + DESC_PREFETCH_AHEAD])]);
+	if (i + ROW_PREFETCH_AHEAD < n) {
+		void *row = rowAddress(w, ents[i + ROW_PREFETCH_AHEAD], comp);
+		if (row) PREFETCH(row);
+	}
+}
+
+/* staged and sparse components go through the regular lookups */
+static bool slowAccess(EcsWorld *w, EcsComponent comp)
+{
+	return w->inDeferred || (sparseComps & COMP_BIT(comp));
+}
+
+int ecs_gatherComponent(EcsWorld *w, const Entity *ents, int n,
+			EcsComponent comp, void *out)
+{
+	size_t size = compDescs[comp].size;
+	uint8_t *dst = out;
+	bool slow = slowAccess(w, comp);
+	int found = 0;
+
+	for (int i = 0; i < n; i++) {
+		void *src;
+		if (slow) {
+			src = ecs_getComponent(w, ents[i], comp);
+		} else {
+			prefetchAhead(w, ents, n, i, comp);
+			src = rowAddress(w, ents[i], comp);
+		}
+
+		if (src) {
+			copyValue(dst + i * size, src, size);
+			found++;
+		} else {
+			memset(dst + i * size, 0, size);
+		}
+	}
+
+	return found;
+}
+
+int ecs_scatterComponent(EcsWorld *w, const Entity *ents, int n,
+			 EcsComponent comp, const void *in)
+{
+	size_t size = compDescs[comp].size;
+	const uint8_t *src = in;
+	bool slow = slowAccess(w, comp);
+	int found = 0;
+
+	for (int i = 0; i < n; i++) {
+		void *dst;
+		if (slow) {
+			dst = ecs_getComponent(w, ents[i], comp);
+		} else {
+			prefetchAhead(w, ents, n, i, comp);
+			dst = rowAddress(w, ents[i], comp);
+			if (dst) {
+				Archetype *arch = w->entDescs[ECS_ENTITY_INDEX(ents[i])].arch;
+				int cidx = arch->compIndexCache[comp];
+				if (cidx >= 0) stampColumn(w, arch, cidx);
+			}
+		}
+		if (!dst) continue;
+
+		copyValue(dst, src + i * size, size);
+		found++;
+	}
+
+	return found;
+}
+
+typedef struct {
+	uint64_t key; //archetype then slot
+	Entity ent;
+} EntityKey;
+
+static int comparEntityKey(const void *a, const void *b)
+{
+	uint64_t ka = ((const EntityKey *)a)->key;
+	uint64_t kb = ((const EntityKey *)b)->key;
+	if (ka < kb) return -1;
+	if (ka > kb) return 1;
+	return 0;
+}
+
+void ecs_sortEntities(EcsWorld *w, Entity *ents, int n)
+{
+	if (n < 2) return;
+
+	EntityKey *keys = malloc(n * sizeof(EntityKey));
+	if (!keys) {
+		fprintf(stderr, "ecs_sortEntities: out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < n; i++) {
+		EntityDesc *desc = &w->entDescs[ECS_ENTITY_INDEX(ents[i])];
+		//dead and unflushed entities go last
+		uint64_t key = UINT64_MAX;
+		if (desc->id == ents[i] && desc->arch)
+			key = (uint64_t)(desc->arch - w->archetypes) << 32 |
+				(uint32_t)desc->slot;
+		keys[i] = (EntityKey){ key, ents[i] };
+	}
+
+	qsort(keys, n, sizeof(EntityKey), comparEntityKey);
+	for (int i = 0; i < n; i++) ents[i] = keys[i].ent;
+	free(keys);
+}
+
+bool ecs_hasComponent(EcsWorld *w, Entity ent, EcsComponent comp)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	if (w->entDescs[index].id != ent) return false;
+
+	if (w->inDeferred) {
+		CmdBucket *buck = findBucket(&w->cmdBuffers[threadIndex], index);
+		if (buck) {
+			EcsMask rem = buck->remMask | buck->sparseRemMask;
+			EcsMask add = buck->addMask | buck->sparseAddMask;
+			if (buck->destroy) return false;
+			else if (rem & COMP_BIT(comp)) return false;
+			else if (add & COMP_BIT(comp)) return true;
+		}
+	}
+
+	if (sparseComps & COMP_BIT(comp))
+		return w->entDescs[index].sparseMask & COMP_BIT(comp);
+
+	Archetype *arch = w->entDescs[index].arch;
+	return arch && (arch->mask & COMP_BIT(comp));
+}
+
+EcsPrefab *ecs_makePrefab(EcsWorld *w, Archetype *arch)
+{
+	if (w->prefabCount == MAX_PREFAB_COUNT) {
+		fprintf(stderr, "ecs_makePrefab: too many prefabs (max %d)\n", MAX_PREFAB_COUNT);
+		exit(1);
+	}
+
+	EcsPrefab *prefab = &w->prefabs[w->prefabCount++];
+	prefab->arch = arch;
+	arch->pinned = true;
+	for (int i = 0; i < arch->compCount; i++) {
+		const ComponentDesc desc = compDescs[arch->componentIds[i]];
+		prefab->defaults[i] = storageAlloc(w, desc.size,
+						     desc.alignment);
+		memset(prefab->defaults[i], 0, desc.size);
+	}
+
+	return prefab;
+}
+
+void *ecs_getPrefabComponent(EcsPrefab *prefab, EcsComponent comp)
+{
+	int cidx = prefab->arch->compIndexCache[comp];
+	if (cidx < 0) return prefab->arch->shared[comp]; //tag or shared
+	return prefab->defaults[cidx];
+}
+
+/*
+  replicates the value into n rows. The filled block doubles each step so
+  the bulk of the work is done by a few large copies
+ */
+static void fillRows(uint8_t *dst, const void *value, size_t size, int n)
+{
+	size_t total = n * size;
+	size_t filled = size;
+	memcpy(dst, value, size);
+
+	while (filled < total) {
+		size_t len = filled < total - filled ? filled : total - filled;
+		memcpy(dst + filled, dst, len);
+		filled += len;
+	}
+}
+
+void ecs_instantiate(EcsWorld *w, EcsPrefab *prefab, int count,
+		     Entity *outEntities)
+{
+	Archetype *arch = prefab->arch;
+	if (count <= 0) return;
+
+	if (w->inDeferred) {
+		for (int r = 0; r < count; r++) {
+			Entity ent = ecs_newEntityDeferred(w, arch, prefab);
+			if (outEntities) outEntities[r] = ent;
+		}
+		return;
+	}
+
+	int base = arch->entCount;
+	if (base + count > MAX_ARCH_ENTITY) {
+		fprintf(stderr, "ecs_instantiate: archetype full (max %d)\n", MAX_ARCH_ENTITY);
+		exit(1);
+	}
+
+	for (int r = 0; r < count; r++) {
+		EntityDesc *desc = reserveEntity(w);
+		desc->arch = arch;
+		desc->slot = base + r;
+		arch->entities[base + r] = desc->id;
+		if (outEntities) outEntities[r] = desc->id;
+	}
+
+	for (int i = 0; i < arch->compCount; i++) {
+		size_t size = compDescs[arch->componentIds[i]].size;
+		fillRows((uint8_t*)arch->storage[i] + base * size,
+			 prefab->defaults[i], size, count);
+	}
+	arch->entCount += count;
+	touchColumns(w, arch);
+}
+
+void ecs_newEntities(EcsWorld *w, const EcsComponent *comps, int compCount,
+		     int count, Entity *outEntities)
+{
+	if (count <= 0) return;
+
+	EcsMask mask = 0;
+	EcsMask sparse = 0;
+	for (int i = 0; i < compCount; i++) {
+		if (sparseComps & COMP_BIT(comps[i])) sparse |= COMP_BIT(comps[i]);
+		else mask |= COMP_BIT(comps[i]);
+	}
+	Archetype *arch = findGroup(w, NULL, mask, NULL, 0);
+
+	if (w->inDeferred) {
+		for (int r = 0; r < count; r++)
+			outEntities[r] = ecs_newEntityDeferred(w, arch, NULL);
+	} else {
+		int base = arch->entCount;
+		if (base + count > MAX_ARCH_ENTITY) {
+			fprintf(stderr, "ecs_newEntities: archetype full (max %d)\n", MAX_ARCH_ENTITY);
+			exit(1);
+		}
+
+		for (int r = 0; r < count; r++) {
+			EntityDesc *desc = reserveEntity(w);
+			desc->arch = arch;
+			desc->slot = base + r;
+			arch->entities[base + r] = desc->id;
+			outEntities[r] = desc->id;
+		}
+
+		for (int i = 0; i < arch->compCount; i++) {
+			size_t size = arch->colSize[i];
+			memset((uint8_t*)arch->storage[i] + base * size, 0,
+			       count * size);
+		}
+		arch->entCount += count;
+		touchColumns(w, arch);
+	}
+
+	for (int r = 0; r < count; r++) {
+		EcsMask bits = sparse;
+		while (bits) ecs_addComponent(w, outEntities[r], popLowestBit(&bits));
+	}
+}
+
+void ecs_setEnabled(EcsWorld *w, Entity ent, bool enabled)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	EntityDesc *desc = &w->entDescs[index];
+	if (desc->id != ent) return;
+
+	//applied at flush, the row may be iterated meanwhile
+	if (w->inDeferred) {
+		CmdBucket *buck = touchBucket(&w->cmdBuffers[threadIndex], index);
+		buck->toggled = true;
+		buck->disabled = !enabled;
+		return;
+	}
+
+	setRowDisabled(desc->arch, desc->slot, !enabled);
+}
+
+bool ecs_isEnabled(EcsWorld *w, Entity ent)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	EntityDesc *desc = &w->entDescs[index];
+	if (desc->id != ent) return false;
+
+	if (w->inDeferred) {
+		CmdBucket *buck = findBucket(&w->cmdBuffers[threadIndex], index);
+		if (buck && buck->toggled) return !buck->disabled;
+	}
+	if (!desc->arch) return true;
+
+	return !rowDisabled(desc->arch, desc->slot);
+}
+
+static void recordChange(EcsWorld *w, EcsEvent event, Archetype *arch,
+			 Entity ent, EcsMask mask)
+{
+	if (!mask || !w->observerCount) return;
+
+	if (w->changeCount == w->changeCap) {
+		int cap = w->changeCap ? w->changeCap * 2 : 64;
+		Change *p = realloc(w->changes, cap * sizeof(Change));
+		if (!p) {
+			fprintf(stderr, "recordChange: out of memory\n");
+			exit(1);
+		}
+		w->changes = p;
+		w->changeCap = cap;
+	}
+
+	w->changes[w->changeCount] = (Change){
+		.event = event,
+		.arch = arch,
+		.seq = w->changeCount,
+		.ent = ent,
+		.mask = mask,
+	};
+	w->changeCount++;
+}
+
+/* the components with data written from the staged values */
+static EcsMask stagedMask(const CmdBucket *buck, const Archetype *arch)
+{
+	EcsMask mask = 0;
+	for (StagedComp *st = buck->staged; st; st = st->next) {
+		if ((buck->addMask & COMP_BIT(st->comp)) &&
+		    arch->compIndexCache[st->comp] >= 0)
+			mask |= COMP_BIT(st->comp);
+	}
+	return mask;
+}
+
+/* applies the staged sparse removals and additions of the entity */
+static void flushSparse(EcsWorld *w, CmdBucket *buck)
+{
+	EntityDesc *desc = &w->entDescs[buck->entIndex];
+	EcsMask had = desc->sparseMask;
+
+	EcsMask rem = buck->sparseRemMask & had;
+	while (rem) sparseRemove(w, popLowestBit(&rem), buck->entIndex);
+
+	EcsMask add = buck->sparseAddMask;
+	while (add) {
+		EcsComponent comp = popLowestBit(&add);
+		void *data = sparseAdd(w, comp, buck->entIndex);
+		StagedComp *st = findStaged(buck, comp);
+		if (data && st) memcpy(data, st->data, compDescs[comp].size);
+	}
+
+	recordChange(w, ECS_ON_REMOVE, desc->arch, desc->id,
+		     buck->sparseRemMask & had);
+	recordChange(w, ECS_ON_ADD, desc->arch, desc->id,
+		     buck->sparseAddMask & ~had);
+	recordChange(w, ECS_ON_SET, desc->arch, desc->id,
+		     buck->sparseAddMask & ~tagComps);
+}
+
+/*
+  inserts the entities created in deferred mode. They are sorted into
+  groups by their target archetype, then every group is appended to its
+  archetype one column at a time
+ */
+static void flushSpawns(EcsWorld *w, size_t spawnCount)
+{
+	if (spawnCount == 0) return;
+
+	for (size_t i = 0; i < spawnCount; i++) {
+		CmdBucket *buck = w->spawns[i].buck;
+		w->spawns[i].arch = findGroup(w, buck->arch, buck->addMask,
+					   buck->staged, buck->addMask);
+	}
+	qsort(w->spawns, spawnCount, sizeof(Spawn), comparSpawn);
+
+	size_t first = 0;
+	while (first < spawnCount) {
+		Archetype *arch = w->spawns[first].arch;
+		size_t end = first + 1;
+		while (end < spawnCount && w->spawns[end].arch == arch) end++;
+
+		int n = end - first;
+		int base = arch->entCount;
+		if (base + n > MAX_ARCH_ENTITY) {
+			fprintf(stderr, "flushSpawns: archetype full (max %d)\n", MAX_ARCH_ENTITY);
+			exit(1);
+		}
+
+		for (int r = 0; r < n; r++) {
+			CmdBucket *buck = w->spawns[first + r].buck;
+			EntityDesc *desc = &w->entDescs[buck->entIndex];
+			desc->arch = arch;
+			desc->slot = base + r;
+			arch->entities[base + r] = desc->id;
+			if (buck->disabled)
+				setRowDisabled(arch, base + r, true);
+
+			recordChange(w, ECS_ON_ADD, arch, desc->id, arch->mask);
+			recordChange(w, ECS_ON_SET, arch, desc->id,
+				     stagedMask(buck, arch));
+		}
+
+		for (int i = 0; i < arch->compCount; i++) {
+			EcsComponent comp = arch->componentIds[i];
+			size_t size = compDescs[comp].size;
+			uint8_t *dst = (uint8_t*)arch->storage[i] + base * size;
+
+			for (int r = 0; r < n; r++, dst += size) {
+				CmdBucket *buck = w->spawns[first + r].buck;
+				StagedComp *st = findStaged(buck, comp);
+				const void *def = buck->prefab ?
+					prefabDefault(buck->prefab, comp) : NULL;
+				if (st) memcpy(dst, st->data, size);
+				else if (def) memcpy(dst, def, size);
+				else memset(dst, 0, size);
+			}
+		}
+		arch->entCount += n;
+		touchColumns(w, arch);
+
+		for (int r = 0; r < n; r++)
+			flushSparse(w, w->spawns[first + r].buck);
+
+		first = end;
+	}
+}
+
+/* folds the bucket of a later thread into the one of the first buffer */
+static void mergeBucket(CmdBuffer *first, CmdBucket *src)
+{
+	CmdBucket *dst = touchBucket(first, src->entIndex);
+	if (src->create) {
+		dst->create = true;
+		dst->arch = src->arch;
+		dst->prefab = src->prefab;
+	}
+	if (src->toggled) {
+		dst->toggled = true;
+		dst->disabled = src->disabled;
+	}
+
+	if (src->destroy) {
+		dst->destroy = true;
+		dst->addMask = 0;
+		dst->remMask = 0;
+		dst->sparseAddMask = 0;
+		dst->sparseRemMask = 0;
+	} else if (!dst->destroy) {
+		dst->addMask &= ~src->remMask;
+		dst->remMask |= src->remMask;
+		dst->sparseAddMask &= ~src->sparseRemMask;
+		dst->sparseRemMask |= src->sparseRemMask;
+
+		//later staged data replaces the earlier one
+		StagedComp *st = src->staged;
+		while (st) {
+			StagedComp *next = st->next;
+			EcsMask added = src->addMask | src->sparseAddMask;
+			if (added & COMP_BIT(st->comp)) {
+				StagedComp *old = findStaged(dst, st->comp);
+				if (old) {
+					old->data = st->data;
+				} else {
+					st->next = dst->staged;
+					dst->staged = st;
+				}
+			}
+			st = next;
+		}
+
+		dst->addMask |= src->addMask;
+		dst->remMask &= ~src->addMask;
+		dst->sparseAddMask |= src->sparseAddMask;
+		dst->sparseRemMask &= ~src->sparseAddMask;
+	}
+}
+
+/* merges the other buffers into the first one, in thread order */
+static void mergeBuffers(EcsWorld *w)
+{
+	CmdBuffer *first = &w->cmdBuffers[0];
+
+	for (int t = 1; t < MAX_THREAD_COUNT; t++) {
+		CmdBuffer *cmd = &w->cmdBuffers[t];
+		for (size_t i = 0; i < cmd->bucketCount; i++)
+			mergeBucket(first, &cmd->buckets[i]);
+	}
+}
+
+static void flushCommands(EcsWorld *w)
+{
+	if (!w->inDeferred) return;
+
+	mergeBuffers(w);
+
+	CmdBuffer *cmd = &w->cmdBuffers[0];
+	size_t spawnCount = 0;
+
+	if (w->spawnCap < cmd->bucketCount) {
+		Spawn *p = realloc(w->spawns, cmd->bucketCount * sizeof(Spawn));
+		if (!p) {
+			fprintf(stderr, "flushCommands: out of memory\n");
+			exit(1);
+		}
+		w->spawns = p;
+		w->spawnCap = cmd->bucketCount;
+	}
+
+	for (size_t i = 0; i < cmd->bucketCount; i++) {
+		CmdBucket *buck = &cmd->buckets[i];
+		uint32_t entIndex = buck->entIndex;
+
+		//created entities get inserted after everything else
+		if (buck->create) {
+			if (buck->destroy) releaseEntity(w, entIndex);
+			else w->spawns[spawnCount++].buck = buck;
+			continue;
+		}
+
+		//check if bucket is empty
+		if (!buck->destroy && !buck->addMask && !buck->remMask &&
+		    !buck->sparseAddMask && !buck->sparseRemMask &&
+		    !buck->toggled)
+			continue;
+
+		//check entity validity
+		Entity ent = w->entDescs[entIndex].id;
+		if (ECS_ENTITY_INDEX(ent) != entIndex) continue;
+
+		//check for destroy flag
+		Archetype *oldArch = w->entDescs[entIndex].arch;
+		if (buck->destroy) {
+			recordChange(w, ECS_ON_REMOVE, oldArch, ent,
+				     oldArch->mask | w->entDescs[entIndex].sparseMask);
+			ecs_destroyImmediate(w, ent);
+			continue;
+		}
+
+		//the bit follows the row if it moves
+		if (buck->toggled)
+			setRowDisabled(oldArch, w->entDescs[entIndex].slot,
+				       buck->disabled);
+
+		if (!buck->addMask && !buck->remMask) {
+			flushSparse(w, buck);
+			continue;
+		}
+
+		/* compute the final archetype once and move the entity
+		   there directly instead of one move per component */
+		EcsMask mask = (oldArch->mask & ~buck->remMask) | buck->addMask;
+		Archetype *arch = findGroup(w, oldArch, mask, buck->staged,
+					    buck->addMask);
+		int slot = moveEntity(w, entIndex, arch);
+
+		recordChange(w, ECS_ON_REMOVE, oldArch, ent,
+			     oldArch->mask & ~arch->mask);
+		recordChange(w, ECS_ON_ADD, arch, ent, arch->mask & ~oldArch->mask);
+		recordChange(w, ECS_ON_SET, arch, ent, stagedMask(buck, arch));
+
+		for (StagedComp *st = buck->staged; st; st = st->next) {
+			if (!(buck->addMask & COMP_BIT(st->comp))) continue;
+			size_t sz = compDescs[st->comp].size;
+			int cidx = arch->compIndexCache[st->comp];
+			if (cidx < 0) continue; //shared, picked the group
+			memcpy((uint8_t*)arch->storage[cidx] + slot * sz,
+			       st->data, sz);
+		}
+		flushSparse(w, buck);
+	}
+
+	flushSpawns(w, spawnCount);
+}
+
+void ecs_deferBegin(EcsWorld *w)
+{
+	//buffers are already clean since the last ecs_deferEnd
+	w->inDeferred = true;
+}
+
+static int comparChange(const void *a, const void *b)
+{
+	const Change *ca = a;
+	const Change *cb = b;
+	if (ca->event != cb->event) return ca->event < cb->event ? -1 : 1;
+	if (ca->arch != cb->arch) return ca->arch < cb->arch ? -1 : 1;
+	if (ca->seq != cb->seq) return ca->seq < cb->seq ? -1 : 1;
+	return 0;
+}
+
+/* hands the recorded changes to the observers, one batch per archetype */
+static void notifyObservers(EcsWorld *w)
+{
+	if (!w->changeCount) return;
+
+	//observers may flush again, they get a list of their own
+	Change *changes = w->changes;
+	int count = w->changeCount;
+	int cap = w->changeCap;
+	w->changes = NULL;
+	w->changeCount = 0;
+	w->changeCap = 0;
+
+	qsort(changes, count, sizeof(Change), comparChange);
+	Entity *batch = malloc(count * sizeof(Entity));
+	if (!batch) {
+		fprintf(stderr, "notifyObservers: out of memory\n");
+		exit(1);
+	}
+
+	for (int o = 0; o < w->observerCount; o++) {
+		EcsObserverDesc obs = w->observers[o];
+		EcsMask bit = COMP_BIT(obs.comp);
+
+		int first = 0;
+		while (first < count) {
+			Archetype *arch = changes[first].arch;
+			EcsEvent event = changes[first].event;
+			int end = first + 1;
+			while (end < count && changes[end].arch == arch &&
+			       changes[end].event == event)
+				end++;
+
+			bool wanted = event == obs.event &&
+				(!obs.query || queryMatches(obs.query, arch));
+			int n = 0;
+			for (int i = first; wanted && i < end; i++)
+				if (changes[i].mask & bit)
+					batch[n++] = changes[i].ent;
+			if (n) obs.callback(w, arch, batch, n, obs.ctx);
+
+			first = end;
+		}
+	}
+
+	free(batch);
+	if (w->changes) {
+		free(changes);
+	} else {
+		w->changes = changes;
+		w->changeCap = cap;
+	}
+}
+
+void ecs_deferEnd(EcsWorld *w)
+{
+	if (!w->inDeferred) return;
+	flushCommands(w);
+	for (int i = 0; i < MAX_THREAD_COUNT; i++)
+		resetBuffer(&w->cmdBuffers[i]);
+	w->inDeferred = false;
+
+	notifyObservers(w);
+}
+
+void ecs_observe(EcsWorld *w, EcsObserverDesc desc)
+{
+	if (w->observerCount == MAX_OBSERVER_COUNT) {
+		fprintf(stderr, "ecs_observe: too many observers (max %d)\n", MAX_OBSERVER_COUNT);
+		exit(1);
+	}
+	w->observers[w->observerCount++] = desc;
+}
+
+EcsQuery *ecs_makeQuery(EcsWorld *w, EcsQueryDesc desc)
+{
+	if (w->queryCount == MAX_QUERY_COUNT) {
+		fprintf(stderr, "ecs_makeQuery: too many queries (max %d)\n", MAX_QUERY_COUNT);
+		exit(1);
+	}
+	if (desc.groupSize) {
+		size_t size = desc.groupSize;
+		if (size != 1 && size != 2 && size != 4 && size != 8) {
+			fprintf(stderr, "ecs_makeQuery: group size must be 1, 2, 4 or 8\n");
+			exit(1);
+		}
+		if (compDescs[desc.groupBy].storage == ECS_STORAGE_SPARSE ||
+		    desc.groupOffset + size > compDescs[desc.groupBy].size) {
+			fprintf(stderr, "ecs_makeQuery: group field out of the component\n");
+			exit(1);
+		}
+	}
+	EcsQuery *q = &w->queries[w->queryCount++];
+	q->include = 0;
+	q->exclude = 0;
+	q->sparseInclude = 0;
+	q->sparseExclude = 0;
+	q->write = 0;
+	q->watch = 0;
+	q->withDisabled = desc.includeDisabled;
+	q->groupBy = desc.groupBy;
+	q->groupOffset = desc.groupOffset;
+	q->groupSize = desc.groupSize;
+	q->groups = NULL;
+	q->matches = NULL;
+	q->matchCount = 0;
+	q->matchCap = 0;
+	q->includeCount = desc.includeCount;
+
+	for (int i = 0; i < desc.includeCount; i++) {
+		q->include |= COMP_BIT(desc.include[i]);
+		q->includeList[i] = desc.include[i];
+	}
+	for (int i = 0; i < desc.excludeCount; i++)
+		q->exclude |= COMP_BIT(desc.exclude[i]);
+	for (int i = 0; i < desc.writeCount; i++)
+		q->write |= COMP_BIT(desc.write[i]);
+	for (int i = 0; i < desc.changedCount; i++)
+		q->watch |= COMP_BIT(desc.changed[i]);
+
+	//written and grouping components must be part of the archetype too
+	q->include |= q->write;
+	if (q->groupSize) q->include |= COMP_BIT(q->groupBy);
+	if (!q->watch) q->watch = q->include;
+
+	q->sparseInclude = q->include & sparseComps;
+	q->sparseExclude = q->exclude & sparseComps;
+	EcsMask sparse = (q->include | q->exclude | q->watch) & sparseComps;
+	while (sparse) makeSparseSet(w, popLowestBit(&sparse));
+	q->include &= ~sparseComps;
+	q->exclude &= ~sparseComps;
+
+	//only the archetypes of the rarest included component can match
+	PtrList *list = rarestArchList(w, q->include);
+	if (!list) {
+		pushPtr(&w->looseQueries, q);
+		for (int i = 0; i < w->archCount; i++) {
+			Archetype *arch = &w->archetypes[i];
+			if (!arch->unused && queryMatches(q, arch))
+				addMatch(q, arch);
+		}
+		return q;
+	}
+
+	pushPtr(&w->compQueries[list - w->compArchs], q);
+	for (int i = 0; i < list->count; i++) {
+		Archetype *arch = list->items[i];
+		if (queryMatches(q, arch)) addMatch(q, arch);
+	}
+
+	return q;
+}
+
+EcsIter ecs_queryIter(EcsWorld *w, EcsQuery *q)
+{
+	EcsIter it = {
+		.world = w,
+		.query = q,
+		.archIndex = 0,
+		.slot = -1,
+	};
+
+	return it;
+}
+
+EcsIter ecs_queryIterChangedSince(EcsWorld *w, EcsQuery *q, uint32_t tick)
+{
+	EcsIter it = ecs_queryIter(w, q);
+	it.changedOnly = true;
+	it.since = tick;
+
+	return it;
+}
+
+/*
+  called before the first row of an archetype. Returns false if the
+  archetype must be skipped by a change filtered iterator, otherwise the
+  written columns get the current tick
+ */
+static bool enterArchetype(EcsIter *it, Archetype *arch)
+{
+	EcsWorld *w = it->world;
+	EcsQuery *q = it->query;
+
+	if (it->changedOnly) {
+		bool changed = false;
+		EcsMask watch = q->watch;
+		while (watch && !changed) {
+			EcsComponent comp = popLowestBit(&watch);
+			if (sparseComps & COMP_BIT(comp)) {
+				changed = sparseSet(w, comp)->version >= it->since;
+				continue;
+			}
+			int cidx = arch->compIndexCache[comp];
+			changed = cidx >= 0 && arch->colVersion[cidx] >= it->since;
+		}
+		if (!changed) return false;
+	}
+
+	EcsMask write = q->write;
+	while (write) {
+		EcsComponent comp = popLowestBit(&write);
+		if (sparseComps & COMP_BIT(comp)) {
+			stampSparse(w, sparseSet(w, comp));
+			continue;
+		}
+		int cidx = arch->compIndexCache[comp];
+		if (cidx >= 0) stampColumn(w, arch, cidx);
+	}
+
+	return true;
+}
+
+/*
+  loads the row at it->slot into the iterator. Returns false if the row is
+  filtered out by the sparse components
+ */
+static bool loadRow(EcsIter *it, Archetype *arch)
+{
+	EcsWorld *w = it->world;
+	EcsQuery *q = it->query;
+	it->entity = arch->entities[it->slot];
+	uint32_t index = ECS_ENTITY_INDEX(it->entity);
+	if (q->sparseInclude || q->sparseExclude) {
+		EcsMask has = w->entDescs[index].sparseMask;
+		if ((has & q->sparseInclude) != q->sparseInclude ||
+		    (has & q->sparseExclude))
+			return false;
+	}
+
+	for (int i = 0; i < q->includeCount; i++) {
+		EcsComponent comp = q->includeList[i];
+		if (sparseComps & COMP_BIT(comp)) {
+			it->includes[i] = sparseGet(w, comp, index);
+			continue;
+		}
+		int cidx = arch->compIndexCache[comp];
+		if (cidx < 0) {
+			it->includes[i] = arch->shared[comp]; //tag or shared
+			continue;
+		}
+		size_t size = compDescs[comp].size;
+		it->includes[i] = (uint8_t*)arch->storage[cidx] +
+				  it->slot * size;
+	}
+
+	return true;
+}
+
+static bool groupIterNext(EcsIter *);
+
+bool ecs_iterNext(EcsIter *it)
+{
+	if (!it->query) return false;
+	EcsQuery *q = it->query;
+	if (it->grouped) return groupIterNext(it);
+
+	while (it->archIndex < q->matchCount) {
+		Archetype *arch = q->matches[it->archIndex];
+		it->slot++;
+		if (it->slot == 0 && arch->entCount > 0 &&
+		    !enterArchetype(it, arch))
+			it->slot = arch->entCount;
+		if (arch->disabledCount && !q->withDisabled)
+			it->slot = nextEnabled(arch, it->slot);
+		if (it->slot >= arch->entCount) {
+			it->archIndex++;
+			it->slot = -1;
+			continue;
+		}
+
+		if (!loadRow(it, arch)) continue;
+		return true;
+	}
+
+	return false;
+}
+
+/* group key of a row, fields compare as unsigned integers */
+static uint64_t groupKey(EcsQuery *q, Archetype *arch, int slot)
+{
+	int cidx = arch->compIndexCache[q->groupBy];
+	const uint8_t *p = cidx >= 0 ?
+		(uint8_t*)arch->storage[cidx] +
+		slot * compDescs[q->groupBy].size :
+		arch->shared[q->groupBy];
+	p += q->groupOffset;
+
+	switch (q->groupSize) {
+	case 1: return *p;
+	case 2: { uint16_t v; memcpy(&v, p, 2); return v; }
+	case 4: { uint32_t v; memcpy(&v, p, 4); return v; }
+	default: { uint64_t v; memcpy(&v, p, 8); return v; }
+	}
+}
+
+/*
+  brings the order of the match up to date. Rows past the end are
+  dropped from the previous order and the new ones are appended, then the
+  order is fixed by an insertion sort which is linear if nothing moved
+ */
+static GroupIndex *updateGroup(EcsWorld *w, EcsQuery *q, int match)
+{
+	Archetype *arch = q->matches[match];
+	GroupIndex *g = &q->groups[match];
+	int cidx = arch->compIndexCache[q->groupBy];
+	int n = arch->entCount;
+
+	if (cidx >= 0 && g->count == n && g->checkedAt &&
+	    arch->colVersion[cidx] < g->checkedAt)
+		return g;
+	g->checkedAt = w->currentTick;
+
+	int kept = 0;
+	for (int i = 0; i < g->count; i++)
+		if (g->rows[i] < n) g->rows[kept++] = g->rows[i];
+	for (int r = g->count; r < n; r++) g->rows[kept++] = r;
+	g->count = n;
+
+	for (int i = 0; i < n; i++) {
+		uint16_t row = g->rows[i];
+		uint64_t key = groupKey(q, arch, row);
+
+		int j = i;
+		while (j > 0 && g->keys[j - 1] > key) {
+			g->keys[j] = g->keys[j - 1];
+			g->rows[j] = g->rows[j - 1];
+			j--;
+		}
+		g->keys[j] = key;
+		g->rows[j] = row;
+	}
+
+	return g;
+}
+
+/* first position in the order with a key not less than the given one */
+static int lowerBound(const GroupIndex *g, uint64_t key)
+{
+	int lo = 0, hi = g->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (g->keys[mid] < key) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static bool groupIterNext(EcsIter *it)
+{
+	EcsWorld *w = it->world;
+	EcsQuery *q = it->query;
+
+	while (it->archIndex < q->matchCount) {
+		Archetype *arch = q->matches[it->archIndex];
+
+		if (it->slot < 0) {
+			GroupIndex *g = updateGroup(w, q, it->archIndex);
+			it->row = lowerBound(g, it->group);
+			it->rowEnd = it->row;
+			while (it->rowEnd < g->count &&
+			       g->keys[it->rowEnd] == it->group)
+				it->rowEnd++;
+			if (it->row < it->rowEnd) enterArchetype(it, arch);
+		}
+
+		if (it->row >= it->rowEnd) {
+			it->archIndex++;
+			it->slot = -1;
+			continue;
+		}
+
+		it->slot = q->groups[it->archIndex].rows[it->row++];
+		if (!q->withDisabled && rowDisabled(arch, it->slot)) continue;
+		if (!loadRow(it, arch)) continue;
+		return true;
+	}
+
+	return false;
+}
+
+EcsIter ecs_queryIterGroup(EcsWorld *w, EcsQuery *q, uint64_t key)
+{
+	EcsIter it = ecs_queryIter(w, q);
+	if (!q->groupSize) {
+		it.query = NULL; //not grouped, nothing to iterate
+		return it;
+	}
+
+	it.grouped = true;
+	it.group = key;
+
+	return it;
+}
+
+int ecs_queryGroupKeys(EcsWorld *w, EcsQuery *q, uint64_t *keys, int max)
+{
+	if (!q->groupSize) return 0;
+
+	//merges the distinct keys of every match, in ascending order
+	int count = 0;
+	for (int m = 0; m < q->matchCount; m++) {
+		GroupIndex *g = updateGroup(w, q, m);
+		for (int i = 0; i < g->count; i++) {
+			uint64_t key = g->keys[i];
+			if (i > 0 && g->keys[i - 1] == key) continue;
+
+			int lo = 0, hi = count;
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (keys[mid] < key) lo = mid + 1;
+				else hi = mid;
+			}
+			if (lo < count && keys[lo] == key) continue;
+			if (lo == max) continue; //larger than every kept key
+
+			//the largest key falls off when full
+			int last = count < max ? count : max - 1;
+			for (int j = last; j > lo; j--) keys[j] = keys[j - 1];
+			keys[lo] = key;
+			if (count < max) count++;
+		}
+	}
+
+	return count;
+}
+
+/*
+  moves every row of src to the end of dst with one copy per column,
+  the components missing in src are zeroed. The changes are recorded for
+  the observers like a flush would
+ */
+static void moveAllRows(EcsWorld *w, Archetype *src, Archetype *dst)
+{
+	int n = src->entCount;
+	int base = dst->entCount;
+	if (base + n > MAX_ARCH_ENTITY) {
+		fprintf(stderr, "moveAllRows: archetype full (max %d)\n", MAX_ARCH_ENTITY);
+		exit(1);
+	}
+
+	MovePlan *plan = getMovePlan(src, dst);
+	int i = 0;
+	for (; i < plan->copyCount; i++) {
+		size_t size = plan->size[i];
+		memcpy((uint8_t*)dst->storage[plan->dstCol[i]] + base * size,
+		       src->storage[plan->srcCol[i]], n * size);
+	}
+	for (; i < plan->copyCount + plan->zeroCount; i++) {
+		size_t size = plan->size[i];
+		memset((uint8_t*)dst->storage[plan->dstCol[i]] + base * size,
+		       0, n * size);
+	}
+
+	touchColumns(w, dst);
+	touchColumns(w, src);
+
+	memcpy(dst->entities + base, src->entities, n * sizeof(Entity));
+	for (int r = 0; r < n; r++) {
+		EntityDesc *desc = &w->entDescs[ECS_ENTITY_INDEX(src->entities[r])];
+		desc->arch = dst;
+		desc->slot = base + r;
+		if (src->disabledCount && rowDisabled(src, r))
+			setRowDisabled(dst, base + r, true);
+	}
+	memset(src->disabled, 0, sizeof(src->disabled));
+	src->disabledCount = 0;
+
+	EcsMask added = dst->mask & ~src->mask;
+	EcsMask written = 0;
+	for (EcsMask bits = added; bits;) {
+		EcsComponent comp = popLowestBit(&bits);
+		if (dst->compIndexCache[comp] >= 0) written |= COMP_BIT(comp);
+	}
+	for (int r = 0; r < n && w->observerCount; r++) {
+		Entity ent = dst->entities[base + r];
+		recordChange(w, ECS_ON_REMOVE, src, ent, src->mask & ~dst->mask);
+		recordChange(w, ECS_ON_ADD, dst, ent, added);
+		recordChange(w, ECS_ON_SET, dst, ent, written);
+	}
+
+	dst->entCount += n;
+	src->entCount = 0;
+	src->rowsVersion++;
+	src->emptySince = w->currentTick;
+}
+
+/* checks if some rows of the matched archetypes are skipped by the query */
+static bool filtersRows(EcsQuery *q)
+{
+	if (q->sparseInclude || q->sparseExclude) return true;
+	if (q->withDisabled) return false;
+
+	for (int i = 0; i < q->matchCount; i++)
+		if (q->matches[i]->disabledCount) return true;
+	return false;
+}
+
+/* whole archetypes can't be moved if the query skips some rows */
+static bool needsRowByRow(EcsWorld *w, EcsQuery *q, EcsComponent comp)
+{
+	return w->inDeferred || (sparseComps & COMP_BIT(comp)) || filtersRows(q);
+}
+
+void ecs_addComponentToQuery(EcsWorld *w, EcsQuery *q, EcsComponent comp)
+{
+	if (needsRowByRow(w, q, comp)) {
+		bool wasDeferred = w->inDeferred;
+		ecs_deferBegin(w);
+		EcsIter it = ecs_queryIter(w, q);
+		while (ecs_iterNext(&it)) ecs_addComponent(w, it.entity, comp);
+		if (!wasDeferred) ecs_deferEnd(w);
+		return;
+	}
+
+	//archetypes created by the moves are appended, they're skipped
+	int matchCount = q->matchCount;
+	for (int i = 0; i < matchCount; i++) {
+		Archetype *arch = q->matches[i];
+		if (arch->entCount == 0 || (arch->mask & COMP_BIT(comp)))
+			continue;
+
+		moveAllRows(w, arch, findGroup(w, arch, arch->mask | COMP_BIT(comp),
+					    NULL, 0));
+	}
+	notifyObservers(w);
+}
+
+void ecs_removeComponentFromQuery(EcsWorld *w, EcsQuery *q, EcsComponent comp)
+{
+	if (needsRowByRow(w, q, comp)) {
+		bool wasDeferred = w->inDeferred;
+		ecs_deferBegin(w);
+		EcsIter it = ecs_queryIter(w, q);
+		while (ecs_iterNext(&it)) ecs_removeComponent(w, it.entity, comp);
+		if (!wasDeferred) ecs_deferEnd(w);
+		return;
+	}
 
-	if (!inDeferred) {
-		Archetype *arch = entDescs[index].arch;
-		int slot = entDescs[index].slot;
+	int matchCount = q->matchCount;
+	for (int i = 0; i < matchCount; i++) {
+		Archetype *arch = q->matches[i];
+		if (arch->entCount == 0 || !(arch->mask & COMP_BIT(comp)))
+			continue;
 
-		int cidx = arch->compIndexCache[comp];
-		if (cidx < 0) return NULL; //component not in arch
+		moveAllRows(w, arch, findGroup(w, arch, arch->mask & ~COMP_BIT(comp),
+					    NULL, 0));
+	}
+	notifyObservers(w);
+}
 
-		size_t size = compDescs[comp].size;
-		return (uint8_t*)arch->storage[cidx] + slot * size;
+void ecs_destroyQuery(EcsWorld *w, EcsQuery *q)
+{
+	if (w->inDeferred || filtersRows(q)) {
+		bool wasDeferred = w->inDeferred;
+		ecs_deferBegin(w);
+		EcsIter it = ecs_queryIter(w, q);
+		while (ecs_iterNext(&it)) ecs_destroy(w, it.entity);
+		if (!wasDeferred) ecs_deferEnd(w);
+		return;
 	}
 
-	CmdBucket *buck = &cmdBuckets[index];
+	//nothing to copy, the archetypes just get truncated
+	for (int i = 0; i < q->matchCount; i++) {
+		Archetype *arch = q->matches[i];
+		for (int r = 0; r < arch->entCount; r++) {
+			uint32_t index = ECS_ENTITY_INDEX(arch->entities[r]);
+			recordChange(w, ECS_ON_REMOVE, arch, arch->entities[r],
+				     arch->mask | w->entDescs[index].sparseMask);
+			releaseEntity(w, index);
+		}
+		arch->entCount = 0;
+		arch->rowsVersion++;
+		arch->emptySince = w->currentTick;
+		memset(arch->disabled, 0, sizeof(arch->disabled));
+		arch->disabledCount = 0;
+	}
+	notifyObservers(w);
+}
 
-	//ignore if schduled to destroy
-	if (buck->destroy) return NULL;
-	else if (buck->remMask & COMP_BIT(comp)) return NULL;
-	else if (buck->addMask & COMP_BIT(comp))
-		return buck->data[comp];
+uint32_t ecs_getTick(EcsWorld *w)
+{
+	return w->currentTick;
+}
 
-	//check inside the current archetype
-	Archetype *arch = entDescs[index].arch;
-	int slot = entDescs[index].slot;
-	int cidx = arch->compIndexCache[comp];
-	if (cidx < 0) return NULL;
-	size_t size = compDescs[comp].size;
-	return (uint8_t*)arch->storage[cidx] + slot * size;
+static void releaseChunk(SnapChunk *chunk)
+{
+	if (chunk && atomic_fetch_sub(&chunk->refs, 1) == 1) free(chunk);
 }
 
-static void flushCommands()
+static size_t alignSnap(size_t size)
 {
-	if (!inDeferred) return;
+	return (size + SNAP_ALIGN - 1) & ~(size_t)(SNAP_ALIGN - 1);
+}
 
-	for (int i = 0; i < dirtyCount; i++) {
-		uint32_t entIndex = dirties[i];
-		CmdBucket *buck = &cmdBuckets[entIndex];
+/* copies the columns of the components of mask in a new chunk */
+static SnapChunk *copyChunk(Archetype *arch, EcsMask mask)
+{
+	int n = arch->entCount;
+	size_t bytes = alignSnap(sizeof(SnapChunk)) +
+		alignSnap(n * sizeof(Entity));
+	for (int i = 0; i < arch->compCount; i++)
+		if (mask & COMP_BIT(arch->componentIds[i]))
+			bytes += alignSnap(n * arch->colSize[i]);
+
+	SnapChunk *chunk = malloc(bytes);
+	if (!chunk) {
+		fprintf(stderr, "copyChunk: out of memory\n");
+		exit(1);
+	}
+	uint8_t *next = (uint8_t*)chunk + alignSnap(sizeof(SnapChunk));
+
+	atomic_init(&chunk->refs, 1);
+	chunk->mask = arch->mask & mask;
+	chunk->count = n;
+	memcpy(chunk->disabled, arch->disabled, sizeof(arch->disabled));
+	chunk->disabledCount = arch->disabledCount;
+	chunk->entities = (Entity*)next;
+	memcpy(chunk->entities, arch->entities, n * sizeof(Entity));
+	next += alignSnap(n * sizeof(Entity));
+
+	int c = 0;
+	for (int i = 0; i < arch->compCount; i++) {
+		if (!(mask & COMP_BIT(arch->componentIds[i]))) continue;
+		size_t size = n * arch->colSize[i];
+		chunk->comps[c] = arch->componentIds[i];
+		chunk->columns[c] = next;
+		memcpy(next, arch->storage[i], size);
+		next += alignSnap(size);
+		c++;
+	}
+	chunk->compCount = c;
 
-		//check if bucket is empty
-		if (!buck->destroy &&
-		    !buck->addMask &&
-		    !buck->remMask) continue;
+	return chunk;
+}
 
-		//check entity validity
-		Entity ent = entDescs[entIndex].id;
-		if (ECS_ENTITY_INDEX(ent) != entIndex) continue;
+/* checks if the data of the archetype changed since the cached copy */
+static bool chunkStale(Archetype *arch, const ChunkCache *cache,
+		       EcsMask mask)
+{
+	SnapChunk *chunk = cache->chunk;
+	if (!chunk) return true;
+	if (chunk->count != arch->entCount || cache->rows != arch->rowsVersion)
+		return true;
+	if (chunk->mask != (arch->mask & mask)) return true;
+	if (memcmp(chunk->disabled, arch->disabled, sizeof(arch->disabled)))
+		return true;
 
-		//check for destroy flag
-		if (buck->destroy) {
-			ecs_destroyImmediate(ent);
+	for (int i = 0; i < arch->compCount; i++) {
+		if (!(mask & COMP_BIT(arch->componentIds[i]))) continue;
+		if (arch->colVersion[i] >= cache->tick) return true;
+	}
+	return false;
+}
+
+/* the chunk of the archetype at this tick, a new reference is returned */
+static SnapChunk *cachedChunk(EcsWorld *w, Archetype *arch,
+			      ChunkCache *cache, EcsMask mask)
+{
+	if (chunkStale(arch, cache, mask)) {
+		releaseChunk(cache->chunk);
+		cache->chunk = copyChunk(arch, mask);
+		cache->rows = arch->rowsVersion;
+	}
+	//writes from the next tick on make the copy stale
+	cache->tick = w->currentTick + 1;
+
+	atomic_fetch_add(&cache->chunk->refs, 1);
+	return cache->chunk;
+}
+
+static void dropCache(ChunkCache *cache)
+{
+	releaseChunk(cache->chunk);
+	cache->chunk = NULL;
+}
+
+/* makes a snapshot of the current tick and publishes it to the readers */
+static void publishSnapshot(EcsWorld *w)
+{
+	EcsSnapshot *snap = malloc(sizeof(EcsSnapshot));
+	if (!snap) {
+		fprintf(stderr, "publishSnapshot: out of memory\n");
+		exit(1);
+	}
+	atomic_init(&snap->refs, 1);
+	snap->tick = w->currentTick;
+	snap->chunkCount = 0;
+
+	for (int i = 0; i < w->archCount; i++) {
+		Archetype *arch = &w->archetypes[i];
+		if (arch->unused || !(arch->mask & w->snapMask)) continue;
+
+		if (!arch->entCount) {
+			dropCache(&arch->snapCache);
 			continue;
 		}
 
-		uint64_t remMask = buck->remMask;
-		while (remMask) {
-			uint64_t bits = remMask;
-			uint64_t comp = 0;
+		snap->chunks[snap->chunkCount++] =
+			cachedChunk(w, arch, &arch->snapCache, w->snapMask);
+	}
 
-			while (!(bits & 01)) {
-				++comp;
-				bits>>=1;
-			}
-			remMask &= remMask - 1;
+	while (atomic_flag_test_and_set_explicit(&w->snapLock,
+						 memory_order_acquire));
+	EcsSnapshot *old = w->snapshot;
+	w->snapshot = snap;
+	atomic_flag_clear_explicit(&w->snapLock, memory_order_release);
+
+	if (old) ecs_releaseSnapshot(old);
+}
+
+static void releaseFrame(RollbackFrame *frame)
+{
+	for (int i = 0; i < frame->chunkCount; i++)
+		releaseChunk(frame->chunks[i]);
+	frame->chunkCount = 0;
+	frame->tick = 0;
+}
+
+/* grows a buffer of the frame to hold at least bytes */
+static void reserveFrameBytes(uint8_t **data, size_t *cap, size_t bytes)
+{
+	if (*cap >= bytes) return;
+
+	free(*data);
+	*data = malloc(bytes);
+	if (!*data) {
+		fprintf(stderr, "saveFrame: out of memory\n");
+		exit(1);
+	}
+	*cap = bytes;
+}
 
-			ecs_removeComponentImmediate(ent, (EcsComponent)comp);
+/*
+  records the state of the current tick in the next frame of the ring.
+  Shared values are not stamped when written, so the ones of the
+  archetypes in the frame are copied every time
+ */
+static void saveFrame(EcsWorld *w)
+{
+	RollbackFrame *frame = &w->frames[w->nextFrame];
+	w->nextFrame = (w->nextFrame + 1) % w->rollbackDepth;
+	releaseFrame(frame);
+
+	frame->tick = w->currentTick;
+	frame->entCount = w->entCount;
+	frame->nextFreeEntity = w->nextFreeEntity;
+	memcpy(frame->descs, w->entDescs, sizeof(w->entDescs));
+
+	for (int i = 0; i < w->archCount; i++) {
+		Archetype *arch = &w->archetypes[i];
+		if (arch->unused) continue;
+		if (!arch->entCount) {
+			dropCache(&arch->rollCache);
+			continue;
 		}
 
-		uint64_t addMask = buck->addMask;
-		while (addMask) {
-			uint64_t bits = addMask;
-			uint64_t comp = 0;
+		frame->archs[frame->chunkCount] = arch;
+		frame->chunks[frame->chunkCount++] =
+			cachedChunk(w, arch, &arch->rollCache, ~(EcsMask)0);
+	}
 
-			while (!(bits & 01)) {
-				++comp;
-				bits>>=1;
-			}
-			addMask &= addMask - 1;
+	size_t bytes = 0;
+	frame->singletonMask = 0;
+	for (EcsComponent comp = 0; comp < (EcsComponent)compCount; comp++) {
+		if (!w->singletons[comp]) continue;
+		frame->singletonMask |= COMP_BIT(comp);
+		bytes += compDescs[comp].size;
+	}
+	reserveFrameBytes(&frame->singletons, &frame->singletonCap, bytes);
+
+	uint8_t *next = frame->singletons;
+	EcsMask bits = frame->singletonMask;
+	while (bits) {
+		EcsComponent comp = popLowestBit(&bits);
+		memcpy(next, w->singletons[comp], compDescs[comp].size);
+		next += compDescs[comp].size;
+	}
 
-			void *dst = ecs_addComponentImmediate(ent, (EcsComponent)comp);
-			if (dst && buck->data[comp]) {
-				size_t sz = compDescs[comp].size;
-				memcpy(dst, buck->data[comp], sz);
-			}
+	bytes = 0;
+	for (int i = 0; i < frame->chunkCount; i++) {
+		bits = frame->archs[i]->mask & sharedComps;
+		while (bits) bytes += compDescs[popLowestBit(&bits)].size;
+	}
+	reserveFrameBytes(&frame->shared, &frame->sharedCap, bytes);
+
+	next = frame->shared;
+	for (int i = 0; i < frame->chunkCount; i++) {
+		Archetype *arch = frame->archs[i];
+		bits = arch->mask & sharedComps;
+		while (bits) {
+			EcsComponent comp = popLowestBit(&bits);
+			memcpy(next, arch->shared[comp], compDescs[comp].size);
+			next += compDescs[comp].size;
 		}
 	}
 }
 
-void ecs_deferBegin(void)
+/* copies the rows of the chunk back to the archetype */
+static void restoreChunk(Archetype *arch, SnapChunk *chunk)
 {
-	if (inDeferred) return;
-
-	dirtyCount = 0;
-	memset(dirties, 0, sizeof(dirties));
-	inDeferred = true;
+	int n = chunk->count;
+	memcpy(arch->entities, chunk->entities, n * sizeof(Entity));
+	for (int i = 0; i < chunk->compCount; i++) {
+		int cidx = arch->compIndexCache[chunk->comps[i]];
+		memcpy(arch->storage[cidx], chunk->columns[i],
+		       n * arch->colSize[cidx]);
+	}
+	memcpy(arch->disabled, chunk->disabled, sizeof(arch->disabled));
+	arch->disabledCount = chunk->disabledCount;
+	arch->entCount = n;
 }
 
-void ecs_deferEnd(void)
+void ecs_enableRollback(EcsWorld *w, int depth)
 {
-	if (!inDeferred) return;
-	flushCommands();
-	zon_arenaRewind(&cmdStorage, 0);
-	inDeferred = false;
+	if (depth < 1 || depth > MAX_ROLLBACK_DEPTH) {
+		fprintf(stderr, "ecs_enableRollback: depth must be in 1..%d\n", MAX_ROLLBACK_DEPTH);
+		exit(1);
+	}
+	if (w->frames) return;
+
+	w->frames = calloc(depth, sizeof(RollbackFrame));
+	if (!w->frames) {
+		fprintf(stderr, "ecs_enableRollback: out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < depth; i++) {
+		w->frames[i].descs = malloc(sizeof(w->entDescs));
+		if (!w->frames[i].descs) {
+			fprintf(stderr, "ecs_enableRollback: out of memory\n");
+			exit(1);
+		}
+	}
+	w->rollbackDepth = depth;
+	w->nextFrame = 0;
 }
 
-EcsQuery *ecs_makeQuery(EcsQueryDesc desc)
+bool ecs_rollbackTo(EcsWorld *w, uint32_t tick)
 {
-	EcsQuery *q = &queries[queryCount++];
-	q->include = 0;
-	q->exclude = 0;
-	q->matchCount = 0;
-	q->includeCount = desc.includeCount;
+	if (!w->frames || w->inDeferred || tick == 0) return false;
+
+	int f = 0;
+	while (f < w->rollbackDepth && w->frames[f].tick != tick) f++;
+	if (f == w->rollbackDepth) return false;
+	RollbackFrame *frame = &w->frames[f];
+
+	w->currentTick = tick + 1;
+
+	/* every row may have moved and ticks went back, so every column
+	   counts as written and the cached chunks are made again */
+	for (int i = 0; i < w->archCount; i++) {
+		Archetype *arch = &w->archetypes[i];
+		if (arch->unused) continue;
+		arch->entCount = 0;
+		memset(arch->disabled, 0, sizeof(arch->disabled));
+		arch->disabledCount = 0;
+		arch->rowsVersion++;
+		arch->emptySince = w->currentTick;
+		touchColumns(w, arch);
+		dropCache(&arch->snapCache);
+		dropCache(&arch->rollCache);
+		arch->hashCache.mask = 0;
+	}
+	for (int i = 0; i < frame->chunkCount; i++)
+		restoreChunk(frame->archs[i], frame->chunks[i]);
+
+	const uint8_t *next = frame->shared;
+	for (int i = 0; i < frame->chunkCount; i++) {
+		Archetype *arch = frame->archs[i];
+		EcsMask bits = arch->mask & sharedComps;
+		while (bits) {
+			EcsComponent comp = popLowestBit(&bits);
+			memcpy(arch->shared[comp], next, compDescs[comp].size);
+			next += compDescs[comp].size;
+		}
+	}
 
-	for (int i = 0; i < desc.includeCount; i++) {
-		q->include |= COMP_BIT(desc.include[i]);
-		q->includeList[i] = desc.include[i];
+	for (int i = 0; i < w->queryCount; i++) {
+		EcsQuery *q = &w->queries[i];
+		for (int m = 0; q->groups && m < q->matchCount; m++)
+			q->groups[m].checkedAt = 0;
 	}
-	for (int i = 0; i < desc.excludeCount; i++)
-		q->exclude |= COMP_BIT(desc.exclude[i]);
 
-	for (int i = 0; i < archCount; i++) {
-		Archetype *arch = &archetypes[i];
-		if ((arch->mask & q->include) == q->include &&
-		    (arch->mask & q->exclude) == 0) {
-			q->matches[q->matchCount++] = arch;
+	/* sparse components are not rolled back. They stay on the entities
+	   alive in the frame too and leave the ones which were not */
+	for (uint32_t i = 0; i < MAX_ENTITY_COUNT; i++) {
+		if (w->entDescs[i].id != frame->descs[i].id ||
+		    ECS_ENTITY_INDEX(frame->descs[i].id) != i) {
+			EcsMask sparse = w->entDescs[i].sparseMask;
+			while (sparse) sparseRemove(w, popLowestBit(&sparse), i);
 		}
+		EcsMask sparse = w->entDescs[i].sparseMask;
+		w->entDescs[i] = frame->descs[i];
+		w->entDescs[i].sparseMask = sparse;
+	}
+	w->entCount = frame->entCount;
+	w->nextFreeEntity = frame->nextFreeEntity;
+
+	next = frame->singletons;
+	EcsMask bits = frame->singletonMask;
+	while (bits) {
+		EcsComponent comp = popLowestBit(&bits);
+		memcpy(w->singletons[comp], next, compDescs[comp].size);
+		next += compDescs[comp].size;
 	}
 
-	return q;
+	//the later frames are in the discarded future
+	for (int i = 0; i < w->rollbackDepth; i++)
+		if (w->frames[i].tick > tick) releaseFrame(&w->frames[i]);
+	w->nextFrame = (f + 1) % w->rollbackDepth;
+
+	return true;
 }
 
-EcsIter ecs_queryIter(EcsQuery *q)
+#define HASH_K1 0x9E3779B97F4A7C15ULL
+#define HASH_K2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t hashFinal(uint64_t x)
 {
-	EcsIter it = {
-		.query = q,
-		.archIndex = 0,
-		.slot = -1,
-	};
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+	return x;
+}
 
-	return it;
+static inline uint64_t hashWord(uint64_t h, uint64_t word)
+{
+	h ^= word * HASH_K1;
+	h = (h << 31) | (h >> 33);
+	return h * HASH_K2;
 }
 
-bool ecs_iterNext(EcsIter *it)
+/* folds the bytes of a value in the hash, 8 at a time */
+static uint64_t hashBytes(uint64_t h, const uint8_t *data, size_t size)
 {
-	if (!it->query) return false;
-	EcsQuery *q = it->query;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		h = hashWord(h, word);
+	}
+	if (i < size) {
+		uint64_t word = 0;
+		memcpy(&word, data + i, size - i);
+		h = hashWord(h, word);
+	}
+	return h;
+}
 
-	while (it->archIndex < q->matchCount) {
-		Archetype *arch = q->matches[it->archIndex];
-		it->slot++;
-		if (it->slot >= arch->entCount) {
-			it->archIndex++;
-			it->slot = -1;
+/* sum of the row hashes of the archetype over the components of mask */
+static uint64_t hashArchetype(Archetype *arch, EcsMask mask)
+{
+	uint64_t rows[MAX_ARCH_ENTITY];
+	int n = arch->entCount;
+	for (int r = 0; r < n; r++)
+		rows[r] = hashWord(HASH_K2, arch->entities[r]);
+
+	//components in id order, the same on every peer
+	EcsMask bits = arch->mask & mask;
+	while (bits) {
+		EcsComponent comp = popLowestBit(&bits);
+		uint64_t tag = hashWord(HASH_K1, comp);
+		int cidx = arch->compIndexCache[comp];
+
+		if (cidx >= 0) {
+			size_t size = arch->colSize[cidx];
+			const uint8_t *col = arch->storage[cidx];
+			for (int r = 0; r < n; r++)
+				rows[r] = hashBytes(rows[r] ^ tag,
+						    col + r * size, size);
 			continue;
 		}
 
-		it->entity = arch->entities[it->slot];
-		for (int i = 0; i < q->includeCount; i++) {
-			EcsComponent comp = q->includeList[i];
-			int cidx = arch->compIndexCache[comp];
-			size_t size = compDescs[comp].size;
-			it->includes[i] = (uint8_t*)arch->storage[cidx] +
-					  it->slot * size;
-		}
+		//tags hash their presence, shared values the same value per row
+		if (arch->shared[comp])
+			tag = hashBytes(tag, arch->shared[comp],
+					compDescs[comp].size);
+		for (int r = 0; r < n; r++) rows[r] = hashWord(rows[r], tag);
+	}
 
-		return true;
+	uint64_t sum = 0;
+	for (int r = 0; r < n; r++) sum += hashFinal(rows[r]);
+	return sum;
+}
+
+/* digest of the hashed shared values of the archetype */
+static uint64_t sharedDigest(Archetype *arch, EcsMask mask)
+{
+	uint64_t h = HASH_K1;
+	EcsMask bits = arch->mask & mask & sharedComps;
+	while (bits) {
+		EcsComponent comp = popLowestBit(&bits);
+		h = hashBytes(h, arch->shared[comp], compDescs[comp].size);
 	}
+	return h;
+}
+
+static bool hashStale(Archetype *arch, EcsMask mask, uint64_t shared)
+{
+	HashCache *cache = &arch->hashCache;
+	if (cache->mask != mask || cache->count != arch->entCount ||
+	    cache->rows != arch->rowsVersion || cache->shared != shared)
+		return true;
 
+	for (int i = 0; i < arch->compCount; i++) {
+		if (!(mask & COMP_BIT(arch->componentIds[i]))) continue;
+		if (arch->colVersion[i] >= cache->tick) return true;
+	}
 	return false;
 }
+
+//rows of an archetype of src and where they go in dst
+typedef struct {
+	Archetype *src;
+	Archetype *target; //NULL until made if dst has no such group
+	uint8_t *shared; //remapped shared values of src, by component
+	size_t sharedSize;
+	int base; //first row in target
+	int count;
+} MergedRange;
+
+/* points the entity fields of a value of comp to the merged handles */
+static void remapValue(EcsWorld *src, EcsComponent comp, uint8_t *value)
+{
+	for (int f = 0; f < entityFieldCount[comp]; f++) {
+		Entity ent;
+		memcpy(&ent, value + entityFields[comp][f], sizeof(Entity));
+		//handles out of the merged world are meaningless here
+		ent = ecs_mergedEntity(src, ent);
+		memcpy(value + entityFields[comp][f], &ent, sizeof(Entity));
+	}
+}
+
+/*
+  records the handle every entity of src gets in dst, before anything
+  moves, so shared values can be remapped before their group is picked.
+  mergeRows reserves the handles in the same order
+ */
+static void planHandles(EcsWorld *dst, EcsWorld *src)
+{
+	uint32_t next = dst->nextFreeEntity;
+	for (int i = 0; i < src->archCount; i++) {
+		Archetype *arch = &src->archetypes[i];
+		if (arch->unused) continue;
+
+		for (int r = 0; r < arch->entCount && next != UINT32_MAX; r++) {
+			Entity id = dst->entDescs[next].id;
+			uint32_t index = ECS_ENTITY_INDEX(arch->entities[r]);
+			src->mergedFrom[index] = arch->entities[r];
+			src->mergedTo[index] = CREATE_ENTITY(next,
+						ECS_ENTITY_GENERATION(id) + 1);
+			next = ECS_ENTITY_INDEX(id);
+		}
+	}
+}
+
+/* the shared values of the source archetype with their fields remapped */
+static void remapShared(EcsWorld *src, MergedRange *range)
+{
+	EcsMask bits = range->src->mask & sharedComps;
+	while (bits) range->sharedSize += compDescs[popLowestBit(&bits)].size;
+
+	range->shared = malloc(range->sharedSize + 1);
+	if (!range->shared) {
+		fprintf(stderr, "ecs_merge: out of memory\n");
+		exit(1);
+	}
+
+	uint8_t *value = range->shared;
+	bits = range->src->mask & sharedComps;
+	while (bits) {
+		EcsComponent comp = popLowestBit(&bits);
+		memcpy(value, range->src->shared[comp], compDescs[comp].size);
+		remapValue(src, comp, value);
+		value += compDescs[comp].size;
+	}
+}
+
+/* the group of dst with the mask and remapped shared values of the range
+   (made if create is set, NULL otherwise if missing) */
+static Archetype *mergeTarget(EcsWorld *dst, const MergedRange *range,
+			      bool create)
+{
+	//shared values are passed as staged so src is never picked itself
+	StagedComp staged[MAX_COMPONENT_COUNT];
+	StagedComp *list = NULL;
+	uint8_t *value = range->shared;
+	EcsMask shared = range->src->mask & sharedComps;
+	EcsMask bits = shared;
+	for (int n = 0; bits; n++) {
+		EcsComponent comp = popLowestBit(&bits);
+		staged[n] = (StagedComp){ list, comp, value };
+		list = &staged[n];
+		value += compDescs[comp].size;
+	}
+
+	if (create) return findGroup(dst, NULL, range->src->mask, list, shared);
+	return lookupGroup(dst, NULL, range->src->mask, list, shared);
+}
+
+static bool sameTarget(const MergedRange *a, const MergedRange *b)
+{
+	if (a->target || b->target) return a->target == b->target;
+	return a->src->mask == b->src->mask &&
+	       memcmp(a->shared, b->shared, a->sharedSize) == 0;
+}
+
+/*
+  checks that dst has room for the whole merge before anything moves:
+  entity slots, rows in every target and slots for the missing targets.
+  Ranges may share a target when their remapped shared values are equal
+ */
+static bool mergeFits(EcsWorld *dst, EcsWorld *src, const MergedRange *ranges,
+		      int rangeCount)
+{
+	if (src->entCount > MAX_ENTITY_COUNT - dst->entCount) return false;
+
+	int freeArchs = MAX_ARCHETYPE_COUNT - dst->archCount +
+		dst->unusedArchs.count;
+	for (int i = 0; i < rangeCount; i++) {
+		bool counted = false;
+		for (int j = 0; j < i && !counted; j++)
+			counted = sameTarget(&ranges[i], &ranges[j]);
+		if (counted) continue;
+
+		int rows = 0;
+		for (int j = i; j < rangeCount; j++)
+			if (sameTarget(&ranges[i], &ranges[j]))
+				rows += ranges[j].count;
+
+		const Archetype *target = ranges[i].target;
+		if (target) rows += target->entCount;
+		else if (--freeArchs < 0) return false;
+		if (rows > MAX_ARCH_ENTITY) return false;
+	}
+	return true;
+}
+
+/* appends the rows of the range to its target archetype in dst */
+static void mergeRows(EcsWorld *dst, MergedRange *range)
+{
+	Archetype *arch = range->src;
+	Archetype *target = mergeTarget(dst, range, true);
+	int n = range->count;
+	int base = target->entCount;
+
+	//same components, so the columns are in the same order
+	for (int i = 0; i < arch->compCount; i++) {
+		size_t size = arch->colSize[i];
+		memcpy((uint8_t*)target->storage[i] + base * size,
+		       arch->storage[i], n * size);
+	}
+
+	for (int r = 0; r < n; r++) {
+		EntityDesc *desc = reserveEntity(dst);
+		desc->arch = target;
+		desc->slot = base + r;
+		target->entities[base + r] = desc->id;
+		if (rowDisabled(arch, r)) setRowDisabled(target, base + r, true);
+	}
+	target->entCount += n;
+	touchColumns(dst, target);
+
+	range->target = target;
+	range->base = base;
+}
+
+/* points the entity fields of the merged rows to the new handles */
+static void remapFields(EcsWorld *src, const MergedRange *range)
+{
+	Archetype *arch = range->target;
+	for (int i = 0; i < arch->compCount; i++) {
+		EcsComponent comp = arch->componentIds[i];
+		size_t size = arch->colSize[i];
+		if (!entityFieldCount[comp]) continue;
+
+		uint8_t *row = (uint8_t*)arch->storage[i] + range->base * size;
+		for (int r = 0; r < range->count; r++, row += size)
+			remapValue(src, comp, row);
+	}
+}
+
+/*
+  moves every row of src to the archetypes of dst with the same components
+  and shared values, one copy per column. src keeps where each of its
+  entities went until its next merge, for the loader and the entity fields
+ */
+bool ecs_merge(EcsWorld *dst, EcsWorld *src)
+{
+	if (dst == src || dst->inDeferred || src->inDeferred) return false;
+
+	if (!src->mergedFrom) {
+		src->mergedFrom = calloc(MAX_ENTITY_COUNT, sizeof(Entity));
+		src->mergedTo = calloc(MAX_ENTITY_COUNT, sizeof(Entity));
+		if (!src->mergedFrom || !src->mergedTo) {
+			fprintf(stderr, "ecs_merge: out of memory\n");
+			exit(1);
+		}
+	} else {
+		memset(src->mergedFrom, 0, MAX_ENTITY_COUNT * sizeof(Entity));
+	}
+
+	planHandles(dst, src);
+
+	MergedRange ranges[MAX_ARCHETYPE_COUNT];
+	int rangeCount = 0;
+	for (int i = 0; i < src->archCount; i++) {
+		Archetype *arch = &src->archetypes[i];
+		if (arch->unused || !arch->entCount) continue;
+
+		MergedRange *range = &ranges[rangeCount++];
+		*range = (MergedRange){ .src = arch, .count = arch->entCount };
+		remapShared(src, range);
+		range->target = mergeTarget(dst, range, false);
+	}
+
+	bool fits = mergeFits(dst, src, ranges, rangeCount);
+	if (fits) {
+		for (int i = 0; i < rangeCount; i++) mergeRows(dst, &ranges[i]);
+		for (int i = 0; i < rangeCount; i++) remapFields(src, &ranges[i]);
+	} else {
+		memset(src->mergedFrom, 0, MAX_ENTITY_COUNT * sizeof(Entity));
+	}
+	for (int i = 0; i < rangeCount; i++) free(ranges[i].shared);
+	if (!fits) return false;
+
+	//sparse components move one by one, then the entities leave src
+	for (int i = 0; i < src->archCount; i++) {
+		Archetype *arch = &src->archetypes[i];
+		if (arch->unused || !arch->entCount) continue;
+
+		for (int r = 0; r < arch->entCount; r++) {
+			uint32_t index = ECS_ENTITY_INDEX(arch->entities[r]);
+			EcsMask sparse = src->entDescs[index].sparseMask;
+			while (sparse) {
+				EcsComponent comp = popLowestBit(&sparse);
+				void *value = ecs_addComponent(dst, src->mergedTo[index],
+							       comp);
+				if (!value || !compDescs[comp].size) continue;
+				memcpy(value, sparseGet(src, comp, index),
+				       compDescs[comp].size);
+				remapValue(src, comp, value);
+			}
+			releaseEntity(src, index);
+		}
+
+		arch->entCount = 0;
+		arch->rowsVersion++;
+		arch->emptySince = src->currentTick;
+		memset(arch->disabled, 0, sizeof(arch->disabled));
+		arch->disabledCount = 0;
+		touchColumns(src, arch);
+	}
+
+	return true;
+}
+
+Entity ecs_mergedEntity(EcsWorld *src, Entity ent)
+{
+	uint32_t index = ECS_ENTITY_INDEX(ent);
+	if (!ent || !src->mergedFrom || index >= MAX_ENTITY_COUNT ||
+	    src->mergedFrom[index] != ent)
+		return 0;
+	return src->mergedTo[index];
+}
+
+uint64_t ecs_hashState(EcsWorld *w, const EcsComponent *comps, int count)
+{
+	EcsMask mask = 0;
+	for (int i = 0; i < count; i++)
+		if (!(sparseComps & COMP_BIT(comps[i])))
+			mask |= COMP_BIT(comps[i]);
+
+	uint64_t sum = 0;
+	for (int i = 0; i < w->archCount; i++) {
+		Archetype *arch = &w->archetypes[i];
+		if (arch->unused || !arch->entCount || !(arch->mask & mask))
+			continue;
+
+		HashCache *cache = &arch->hashCache;
+		uint64_t shared = sharedDigest(arch, mask);
+		if (hashStale(arch, mask, shared)) {
+			cache->hash = hashArchetype(arch, mask);
+			cache->mask = mask;
+			cache->count = arch->entCount;
+			cache->rows = arch->rowsVersion;
+			cache->shared = shared;
+		} else {
+			//a write the stamps missed would hide a desync
+			assert(cache->hash == hashArchetype(arch, mask) &&
+			       "column written through an unstamped pointer");
+		}
+		//later writes in this tick are stamped with it
+		cache->tick = w->currentTick;
+		sum += cache->hash;
+	}
+
+	return hashFinal(sum ^ mask);
+}
+
+void ecs_enableSnapshot(EcsWorld *w, EcsComponent comp)
+{
+	ComponentDesc desc = compDescs[comp];
+	if (desc.storage != ECS_STORAGE_TABLE || desc.size == 0) {
+		fprintf(stderr, "ecs_enableSnapshot: only table components with data\n");
+		exit(1);
+	}
+	w->snapMask |= COMP_BIT(comp);
+}
+
+const EcsSnapshot *ecs_acquireSnapshot(EcsWorld *w)
+{
+	while (atomic_flag_test_and_set_explicit(&w->snapLock,
+						 memory_order_acquire));
+	EcsSnapshot *snap = w->snapshot;
+	if (snap) atomic_fetch_add(&snap->refs, 1);
+	atomic_flag_clear_explicit(&w->snapLock, memory_order_release);
+
+	return snap;
+}
+
+void ecs_releaseSnapshot(const EcsSnapshot *snapshot)
+{
+	EcsSnapshot *snap = (EcsSnapshot*)snapshot;
+	if (atomic_fetch_sub(&snap->refs, 1) != 1) return;
+
+	for (int i = 0; i < snap->chunkCount; i++)
+		releaseChunk(snap->chunks[i]);
+	free(snap);
+}
+
+void ecs_retainSnapshot(const EcsSnapshot *snapshot)
+{
+	atomic_fetch_add(&((EcsSnapshot*)snapshot)->refs, 1);
+}
+
+uint32_t ecs_snapshotTick(const EcsSnapshot *snap)
+{
+	return snap->tick;
+}
+
+int ecs_snapshotChunkCount(const EcsSnapshot *snap)
+{
+	return snap->chunkCount;
+}
+
+const void *ecs_snapshotColumn(const EcsSnapshot *snap, int chunkIndex,
+			       EcsComponent comp, const Entity **entities,
+			       int *count)
+{
+	const SnapChunk *chunk = snap->chunks[chunkIndex];
+	if (entities) *entities = chunk->entities;
+	if (count) *count = chunk->count;
+
+	for (int i = 0; i < chunk->compCount; i++)
+		if (chunk->comps[i] == comp) return chunk->columns[i];
+	return NULL;
+}
+
+/* gives the storage of the archetype back and makes its slot reusable */
+static void collectArchetype(EcsWorld *w, Archetype *arch)
+{
+	for (int i = 0; i < arch->compCount; i++)
+		freeBlock(w, arch->storage[i], MAX_ARCH_ENTITY * arch->colSize[i]);
+
+	EcsMask bits = arch->mask;
+	while (bits) {
+		EcsComponent comp = popLowestBit(&bits);
+		if (arch->shared[comp])
+			freeBlock(w, arch->shared[comp], compDescs[comp].size);
+		removePtr(&w->compArchs[comp], arch);
+	}
+
+	for (int i = 0; i < w->queryCount; i++) {
+		EcsQuery *q = &w->queries[i];
+		if (!queryMatches(q, arch)) continue;
+
+		int m = 0;
+		while (q->matches[m] != arch) m++;
+		int tail = q->matchCount - m - 1;
+		memmove(q->matches + m, q->matches + m + 1,
+			tail * sizeof(Archetype*));
+		if (q->groups)
+			memmove(q->groups + m, q->groups + m + 1,
+				tail * sizeof(GroupIndex));
+		q->matchCount--;
+	}
+
+	dropCache(&arch->snapCache);
+	dropCache(&arch->rollCache);
+	arch->unused = true;
+	arch->generation++;
+	arch->mask = 0;
+	arch->compCount = 0;
+	pushPtr(&w->unusedArchs, arch);
+}
+
+void ecs_collectArchetypes(EcsWorld *w)
+{
+	//buckets may still point to archetypes in deferred mode
+	if (w->inDeferred) return;
+
+	//rollback frames may still have rows in it
+	uint32_t idle = w->idleTicks;
+	if (w->frames && idle <= (uint32_t)w->rollbackDepth)
+		idle = w->rollbackDepth + 1;
+
+	for (int i = 0; i < w->archCount; i++) {
+		Archetype *arch = &w->archetypes[i];
+		if (arch->unused || arch->pinned || arch->entCount) continue;
+		if (w->currentTick - arch->emptySince < idle) continue;
+
+		collectArchetype(w, arch);
+	}
+}
+
+void ecs_setArchetypeIdleTicks(EcsWorld *w, uint32_t ticks)
+{
+	w->idleTicks = ticks;
+}
+
+void ecs_progressTick(EcsWorld *w)
+{
+	if (w->snapMask) publishSnapshot(w);
+	if (w->frames) saveFrame(w);
+	w->currentTick++;
+	if (w->idleTicks) ecs_collectArchetypes(w);
+}
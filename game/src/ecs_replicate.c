@@ -0,0 +1,729 @@
+#include <ecs_replicate.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  A state is the list of the replicated entities of a tick sorted by
+  their server handle, with a bit per component they have and a slot of
+  stride bytes holding the values. Components are padded to 32-bit words
+  in the slot so values are diffed word by word
+
+Packet layout, every field bit-packed:
+  tick (32), baseline tick (32, 0 for none)
+  records in handle order, each one starting with
+    kind (2), index delta from the previous record (var)
+  REMOVED: nothing more
+  CREATED: generation (32), component bits, words of the present values
+  CHANGED: component bits, then for each present component either its
+    words (new component) or per word a changed bit and the XOR (var)
+  END
+
+Var values are a 6-bit count of significant bits followed by the bits
+ */
+
+#define MAX_REPL_COMPONENTS 32
+#define REPL_HISTORY 32 //states kept by each side
+
+enum {
+	RECORD_REMOVED,
+	RECORD_CREATED,
+	RECORD_CHANGED,
+	RECORD_END,
+};
+
+//an entity of the decoded state whose values the world lacks
+typedef struct {
+	int index; //in the decoded state
+	bool created;
+	uint32_t had; //components the world has, 0 if created
+	uint32_t present; //components it must have
+	uint32_t written; //components with new values
+} ReplChange;
+
+typedef struct {
+	uint32_t tick; //0 if unused
+	int count;
+	int cap;
+	Entity *ents; //server handles, sorted
+	uint32_t *present; //component bits by entity
+	uint8_t *values; //stride bytes by entity
+} ReplState;
+
+struct EcsReplicator {
+	int compCount;
+	EcsComponent comps[MAX_REPL_COMPONENTS];
+	size_t sizes[MAX_REPL_COMPONENTS];
+	size_t offsets[MAX_REPL_COMPONENTS]; //in the value slot
+	size_t stride;
+
+	ReplState states[REPL_HISTORY];
+	int nextState;
+
+	//encoder only
+	const EcsSnapshot *snapshot; //the last captured one, retained
+	ReplState *current; //its state, shared by the encodes of every client
+	ReplState captured; //snapshot values before sorting
+
+	//decoder only
+	uint32_t lastTick;
+	ReplState applied; //what the world holds
+	ReplChange *changes; //of the last packet, against applied
+	int changeCount;
+	int changeCap;
+	Entity *removed; //server handles of the last packet
+	int removedCount;
+	int removedCap;
+	Entity *remap; //client entity by server index
+	uint32_t remapCap;
+	Entity *batch; //scratch for the bulk writes
+	uint8_t *batchValues;
+	int batchCap;
+};
+
+typedef struct {
+	uint8_t *data;
+	size_t cap; //in bytes
+	size_t bit;
+	bool overflow;
+} BitWriter;
+
+typedef struct {
+	const uint8_t *data;
+	size_t size; //in bytes
+	size_t bit;
+	bool overflow;
+} BitReader;
+
+static void putBits(BitWriter *bw, uint32_t value, int count)
+{
+	if (bw->bit + count > bw->cap * 8) {
+		bw->overflow = true;
+		return;
+	}
+
+	for (int i = 0; i < count; i++, bw->bit++) {
+		uint8_t *byte = &bw->data[bw->bit >> 3];
+		if (!(bw->bit & 7)) *byte = 0;
+		*byte |= ((value >> i) & 1) << (bw->bit & 7);
+	}
+}
+
+static uint32_t getBits(BitReader *br, int count)
+{
+	if (br->bit + count > br->size * 8) {
+		br->overflow = true;
+		return 0;
+	}
+
+	uint32_t value = 0;
+	for (int i = 0; i < count; i++, br->bit++)
+		value |= (uint32_t)((br->data[br->bit >> 3] >> (br->bit & 7)) & 1) << i;
+	return value;
+}
+
+static void putVar(BitWriter *bw, uint32_t value)
+{
+	int bits = 0;
+	while (bits < 32 && (value >> bits)) bits++;
+	putBits(bw, bits, 6);
+	putBits(bw, value, bits);
+}
+
+static uint32_t getVar(BitReader *br)
+{
+	int bits = getBits(br, 6);
+	if (bits > 32) {
+		br->overflow = true;
+		return 0;
+	}
+	return getBits(br, bits);
+}
+
+static void *growArray(void *array, size_t size)
+{
+	void *p = realloc(array, size);
+	if (!p) {
+		fprintf(stderr, "ecs_replicate: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static void reserveState(EcsReplicator *rep, ReplState *state, int count)
+{
+	if (state->cap >= count) return;
+
+	int cap = state->cap ? state->cap : 64;
+	while (cap < count) cap *= 2;
+	state->ents = growArray(state->ents, cap * sizeof(Entity));
+	state->present = growArray(state->present, cap * sizeof(uint32_t));
+	state->values = growArray(state->values, cap * rep->stride);
+	state->cap = cap;
+}
+
+/* appends an entity with zeroed values, returns its position */
+static int pushEntity(EcsReplicator *rep, ReplState *state, Entity ent,
+		      uint32_t present)
+{
+	reserveState(rep, state, state->count + 1);
+	int i = state->count++;
+	state->ents[i] = ent;
+	state->present[i] = present;
+	memset(state->values + i * rep->stride, 0, rep->stride);
+	return i;
+}
+
+static void copyEntity(EcsReplicator *rep, ReplState *dst,
+		       const ReplState *src, int i)
+{
+	int d = pushEntity(rep, dst, src->ents[i], src->present[i]);
+	memcpy(dst->values + d * rep->stride, src->values + i * rep->stride,
+	       rep->stride);
+}
+
+static void freeState(ReplState *state)
+{
+	free(state->ents);
+	free(state->present);
+	free(state->values);
+}
+
+static ReplState *findState(EcsReplicator *rep, uint32_t tick)
+{
+	if (tick == 0) return NULL;
+	for (int i = 0; i < REPL_HISTORY; i++)
+		if (rep->states[i].tick == tick) return &rep->states[i];
+	return NULL;
+}
+
+/* the next state of the ring, never the baseline in use */
+static ReplState *nextState(EcsReplicator *rep, const ReplState *keep)
+{
+	ReplState *state = &rep->states[rep->nextState];
+	rep->nextState = (rep->nextState + 1) % REPL_HISTORY;
+	if (state == keep) return nextState(rep, keep);
+
+	state->count = 0;
+	return state;
+}
+
+EcsReplicator *ecs_createReplicator(const EcsComponent *comps, int count)
+{
+	if (count > MAX_REPL_COMPONENTS) {
+		fprintf(stderr, "ecs_createReplicator: too many components (max %d)\n", MAX_REPL_COMPONENTS);
+		exit(1);
+	}
+
+	EcsReplicator *rep = calloc(1, sizeof(EcsReplicator));
+	if (!rep) {
+		fprintf(stderr, "ecs_createReplicator: out of memory\n");
+		exit(1);
+	}
+	rep->compCount = count;
+	for (int i = 0; i < count; i++) {
+		rep->comps[i] = comps[i];
+		rep->sizes[i] = ecs_componentSize(comps[i]);
+		rep->offsets[i] = rep->stride;
+		rep->stride += (rep->sizes[i] + 3) & ~(size_t)3;
+	}
+
+	return rep;
+}
+
+void ecs_destroyReplicator(EcsReplicator *rep)
+{
+	for (int i = 0; i < REPL_HISTORY; i++) freeState(&rep->states[i]);
+	freeState(&rep->applied);
+	freeState(&rep->captured);
+	if (rep->snapshot) ecs_releaseSnapshot(rep->snapshot);
+	free(rep->changes);
+	free(rep->removed);
+	free(rep->remap);
+	free(rep->batch);
+	free(rep->batchValues);
+	free(rep);
+}
+
+typedef struct {
+	Entity ent;
+	int index; //in the captured state
+} SortKey;
+
+static int comparSortKey(const void *a, const void *b)
+{
+	Entity ea = ((const SortKey *)a)->ent;
+	Entity eb = ((const SortKey *)b)->ent;
+	if (ea < eb) return -1;
+	if (ea > eb) return 1;
+	return 0;
+}
+
+/*
+  gathers the replicated values of the snapshot, sorted by handle, once
+  per snapshot. States of its tick or later are from before a rollback
+  and are dropped
+ */
+static ReplState *captureState(EcsReplicator *rep, const EcsSnapshot *snap)
+{
+	if (snap == rep->snapshot) return rep->current;
+
+	uint32_t tick = ecs_snapshotTick(snap);
+	for (int i = 0; i < REPL_HISTORY; i++)
+		if (rep->states[i].tick >= tick) rep->states[i].tick = 0;
+
+	ecs_retainSnapshot(snap);
+	if (rep->snapshot) ecs_releaseSnapshot(rep->snapshot);
+	rep->snapshot = snap;
+	ReplState *state = rep->current = nextState(rep, NULL);
+
+	ReplState *captured = &rep->captured;
+	captured->count = 0;
+
+	for (int c = 0; c < ecs_snapshotChunkCount(snap); c++) {
+		const void *columns[MAX_REPL_COMPONENTS];
+		const Entity *ents = NULL;
+		int count = 0;
+		uint32_t present = 0;
+		for (int i = 0; i < rep->compCount; i++) {
+			columns[i] = ecs_snapshotColumn(snap, c, rep->comps[i],
+							&ents, &count);
+			if (columns[i]) present |= 1u << i;
+		}
+		if (!present) continue;
+
+		for (int r = 0; r < count; r++) {
+			int e = pushEntity(rep, captured, ents[r], present);
+			uint8_t *slot = captured->values + e * rep->stride;
+			for (int i = 0; i < rep->compCount; i++) {
+				if (!columns[i]) continue;
+				memcpy(slot + rep->offsets[i],
+				       (const uint8_t*)columns[i] + r * rep->sizes[i],
+				       rep->sizes[i]);
+			}
+		}
+	}
+
+	SortKey *keys = growArray(NULL, (captured->count + 1) * sizeof(SortKey));
+	for (int i = 0; i < captured->count; i++)
+		keys[i] = (SortKey){ captured->ents[i], i };
+	qsort(keys, captured->count, sizeof(SortKey), comparSortKey);
+
+	state->tick = tick;
+	reserveState(rep, state, captured->count);
+	for (int i = 0; i < captured->count; i++)
+		copyEntity(rep, state, captured, keys[i].index);
+	free(keys);
+	return state;
+}
+
+static void putWords(BitWriter *bw, const uint8_t *value, size_t size)
+{
+	for (size_t w = 0; w < size; w += 4) {
+		uint32_t word;
+		memcpy(&word, value + w, 4);
+		putVar(bw, word);
+	}
+}
+
+static void getWords(BitReader *br, uint8_t *value, size_t size)
+{
+	for (size_t w = 0; w < size; w += 4) {
+		uint32_t word = getVar(br);
+		memcpy(value + w, &word, 4);
+	}
+}
+
+static size_t paddedSize(const EcsReplicator *rep, int comp)
+{
+	return (rep->sizes[comp] + 3) & ~(size_t)3;
+}
+
+static void putRecord(BitWriter *bw, int kind, uint32_t *prevIndex,
+		      Entity ent)
+{
+	putBits(bw, kind, 2);
+	putVar(bw, ECS_ENTITY_INDEX(ent) - *prevIndex);
+	*prevIndex = ECS_ENTITY_INDEX(ent);
+}
+
+static void encodeCreated(EcsReplicator *rep, BitWriter *bw,
+			  const ReplState *cur, int c)
+{
+	putBits(bw, ECS_ENTITY_GENERATION(cur->ents[c]), 32);
+	putBits(bw, cur->present[c], rep->compCount);
+
+	const uint8_t *slot = cur->values + c * rep->stride;
+	for (int i = 0; i < rep->compCount; i++)
+		if (cur->present[c] & (1u << i))
+			putWords(bw, slot + rep->offsets[i], paddedSize(rep, i));
+}
+
+static void encodeChanged(EcsReplicator *rep, BitWriter *bw,
+			  const ReplState *base, int b,
+			  const ReplState *cur, int c)
+{
+	putBits(bw, cur->present[c], rep->compCount);
+
+	const uint8_t *old = base->values + b * rep->stride;
+	const uint8_t *now = cur->values + c * rep->stride;
+	for (int i = 0; i < rep->compCount; i++) {
+		if (!(cur->present[c] & (1u << i))) continue;
+		size_t off = rep->offsets[i];
+		size_t size = paddedSize(rep, i);
+
+		if (!(base->present[b] & (1u << i))) {
+			putWords(bw, now + off, size);
+			continue;
+		}
+
+		for (size_t w = 0; w < size; w += 4) {
+			uint32_t a, n;
+			memcpy(&a, old + off + w, 4);
+			memcpy(&n, now + off + w, 4);
+			putBits(bw, a != n, 1);
+			if (a != n) putVar(bw, a ^ n);
+		}
+	}
+}
+
+size_t ecs_replicateEncode(EcsReplicator *rep, const EcsSnapshot *snap,
+			   uint32_t acked, uint8_t *out, size_t cap)
+{
+	static const ReplState empty;
+	ReplState *cur = captureState(rep, snap);
+	ReplState *base = findState(rep, acked);
+	if (!base) base = (ReplState*)&empty;
+
+	BitWriter bw = { out, cap, 0, false };
+	putBits(&bw, cur->tick, 32);
+	putBits(&bw, base->tick, 32);
+
+	//both states are sorted, walk them together
+	uint32_t prevIndex = 0;
+	int b = 0, c = 0;
+	while (b < base->count || c < cur->count) {
+		Entity eb = b < base->count ? base->ents[b] : UINT64_MAX;
+		Entity ec = c < cur->count ? cur->ents[c] : UINT64_MAX;
+
+		if (eb < ec) {
+			putRecord(&bw, RECORD_REMOVED, &prevIndex, eb);
+			b++;
+		} else if (ec < eb) {
+			putRecord(&bw, RECORD_CREATED, &prevIndex, ec);
+			encodeCreated(rep, &bw, cur, c);
+			c++;
+		} else {
+			if (base->present[b] != cur->present[c] ||
+			    memcmp(base->values + b * rep->stride,
+				   cur->values + c * rep->stride, rep->stride)) {
+				putRecord(&bw, RECORD_CHANGED, &prevIndex, ec);
+				encodeChanged(rep, &bw, base, b, cur, c);
+			}
+			b++;
+			c++;
+		}
+	}
+	putBits(&bw, RECORD_END, 2);
+
+	return bw.overflow ? 0 : (bw.bit + 7) / 8;
+}
+
+static void pushChange(EcsReplicator *rep, ReplChange change)
+{
+	if (rep->changeCount == rep->changeCap) {
+		rep->changeCap = rep->changeCap ? rep->changeCap * 2 : 64;
+		rep->changes = growArray(rep->changes,
+					 rep->changeCap * sizeof(ReplChange));
+	}
+	rep->changes[rep->changeCount++] = change;
+}
+
+static void pushRemoved(EcsReplicator *rep, Entity ent)
+{
+	if (rep->removedCount == rep->removedCap) {
+		rep->removedCap = rep->removedCap ? rep->removedCap * 2 : 64;
+		rep->removed = growArray(rep->removed,
+					 rep->removedCap * sizeof(Entity));
+	}
+	rep->removed[rep->removedCount++] = ent;
+}
+
+/*
+  rebuilds the state of the packet from its baseline and records the
+  entities removed, created and changed by the packet
+ */
+static bool decodeState(EcsReplicator *rep, BitReader *br,
+			const ReplState *base, ReplState *state)
+{
+	uint32_t index = 0;
+	int b = 0;
+	rep->changeCount = 0;
+	rep->removedCount = 0;
+
+	for (;;) {
+		int kind = getBits(br, 2);
+		if (br->overflow) return false;
+		if (kind == RECORD_END) break;
+		index += getVar(br);
+
+		//untouched entities before this one
+		while (b < base->count && ECS_ENTITY_INDEX(base->ents[b]) < index)
+			copyEntity(rep, state, base, b++);
+
+		bool inBase = b < base->count &&
+			ECS_ENTITY_INDEX(base->ents[b]) == index;
+
+		if (kind == RECORD_REMOVED) {
+			if (!inBase) return false;
+			pushRemoved(rep, base->ents[b++]);
+			continue;
+		}
+
+		if (kind == RECORD_CREATED) {
+			uint32_t gen = getBits(br, 32);
+			Entity ent = ((uint64_t)index << 32) | gen;
+			//the old entity of the index dies first
+			if (inBase && base->ents[b] < ent) return false;
+			int e = pushEntity(rep, state, ent,
+					   getBits(br, rep->compCount));
+			uint8_t *slot = state->values + e * rep->stride;
+			for (int i = 0; i < rep->compCount; i++)
+				if (state->present[e] & (1u << i))
+					getWords(br, slot + rep->offsets[i],
+						 paddedSize(rep, i));
+			pushChange(rep, (ReplChange){
+				.index = e,
+				.created = true,
+				.present = state->present[e],
+				.written = state->present[e],
+			});
+			continue;
+		}
+
+		if (!inBase) return false;
+		uint32_t oldPresent = base->present[b];
+		copyEntity(rep, state, base, b++);
+		int e = state->count - 1;
+		state->present[e] = getBits(br, rep->compCount);
+		uint8_t *slot = state->values + e * rep->stride;
+		uint32_t written = 0;
+
+		for (int i = 0; i < rep->compCount; i++) {
+			if (!(state->present[e] & (1u << i))) continue;
+			size_t off = rep->offsets[i];
+			size_t size = paddedSize(rep, i);
+
+			if (!(oldPresent & (1u << i))) {
+				getWords(br, slot + off, size);
+				written |= 1u << i;
+				continue;
+			}
+
+			for (size_t w = 0; w < size; w += 4) {
+				if (!getBits(br, 1)) continue;
+				uint32_t word;
+				memcpy(&word, slot + off + w, 4);
+				word ^= getVar(br);
+				memcpy(slot + off + w, &word, 4);
+				written |= 1u << i;
+			}
+		}
+
+		pushChange(rep, (ReplChange){
+			.index = e,
+			.had = oldPresent,
+			.present = state->present[e],
+			.written = written,
+		});
+	}
+
+	while (b < base->count) copyEntity(rep, state, base, b++);
+	return !br->overflow;
+}
+
+static Entity *remapped(EcsReplicator *rep, Entity serverEnt)
+{
+	uint32_t index = ECS_ENTITY_INDEX(serverEnt);
+	if (index >= rep->remapCap) {
+		uint32_t cap = rep->remapCap ? rep->remapCap : 64;
+		while (cap <= index) cap *= 2;
+		rep->remap = growArray(rep->remap, cap * sizeof(Entity));
+		memset(rep->remap + rep->remapCap, 0,
+		       (cap - rep->remapCap) * sizeof(Entity));
+		rep->remapCap = cap;
+	}
+	return &rep->remap[index];
+}
+
+/*
+  records the state against what the world holds, for packets encoded
+  against another baseline (the world may be ahead of it)
+ */
+static void diffApplied(EcsReplicator *rep, const ReplState *state)
+{
+	const ReplState *old = &rep->applied;
+	rep->changeCount = 0;
+	rep->removedCount = 0;
+
+	int o = 0;
+	for (int s = 0; s < state->count; s++) {
+		Entity ent = state->ents[s];
+		for (; o < old->count && old->ents[o] < ent; o++)
+			pushRemoved(rep, old->ents[o]);
+
+		uint32_t present = state->present[s];
+		if (o == old->count || old->ents[o] != ent) {
+			pushChange(rep, (ReplChange){
+				.index = s,
+				.created = true,
+				.present = present,
+				.written = present,
+			});
+			continue;
+		}
+
+		uint32_t had = old->present[o];
+		uint32_t written = present & ~had;
+		const uint8_t *was = old->values + o * rep->stride;
+		const uint8_t *now = state->values + s * rep->stride;
+		for (int i = 0; i < rep->compCount; i++) {
+			size_t off = rep->offsets[i];
+			if ((present & had & (1u << i)) &&
+			    memcmp(was + off, now + off, rep->sizes[i]))
+				written |= 1u << i;
+		}
+		if (written || had != present)
+			pushChange(rep, (ReplChange){ s, false, had, present, written });
+		o++;
+	}
+	for (; o < old->count; o++) pushRemoved(rep, old->ents[o]);
+}
+
+/* created entities first, grouped by their components */
+static int comparChange(const void *a, const void *b)
+{
+	const ReplChange *ca = a;
+	const ReplChange *cb = b;
+	if (ca->created != cb->created) return ca->created ? -1 : 1;
+	if (ca->present != cb->present) return ca->present < cb->present ? -1 : 1;
+	return ca->index - cb->index;
+}
+
+/*
+  makes the world match the decoded state. Only the recorded entities
+  are touched: new ones are made in their archetype in bulk, then every
+  component gets one scatter of the values the packet changed
+ */
+static void applyState(EcsReplicator *rep, EcsWorld *w,
+		       const ReplState *state)
+{
+	for (int i = 0; i < rep->removedCount; i++) {
+		Entity *local = remapped(rep, rep->removed[i]);
+		ecs_destroy(w, *local);
+		*local = 0;
+	}
+
+	if (rep->batchCap < rep->changeCount) {
+		rep->batch = growArray(rep->batch, rep->changeCount * sizeof(Entity));
+		rep->batchValues = growArray(rep->batchValues,
+					     rep->changeCount * rep->stride);
+		rep->batchCap = rep->changeCount;
+	}
+	if (rep->changeCount)
+		qsort(rep->changes, rep->changeCount, sizeof(ReplChange),
+		      comparChange);
+
+	int c = 0;
+	while (c < rep->changeCount && rep->changes[c].created) {
+		uint32_t present = rep->changes[c].present;
+		int end = c + 1;
+		while (end < rep->changeCount && rep->changes[end].created &&
+		       rep->changes[end].present == present)
+			end++;
+
+		EcsComponent comps[MAX_REPL_COMPONENTS];
+		int n = 0;
+		for (int i = 0; i < rep->compCount; i++)
+			if (present & (1u << i)) comps[n++] = rep->comps[i];
+		ecs_newEntities(w, comps, n, end - c, rep->batch);
+
+		for (int k = c; k < end; k++)
+			*remapped(rep, state->ents[rep->changes[k].index]) =
+				rep->batch[k - c];
+		c = end;
+	}
+
+	//gained or lost components move the entity, which is rare
+	for (; c < rep->changeCount; c++) {
+		const ReplChange *ch = &rep->changes[c];
+		if (ch->had == ch->present) continue;
+
+		Entity local = *remapped(rep, state->ents[ch->index]);
+		for (int i = 0; i < rep->compCount; i++) {
+			uint32_t bit = 1u << i;
+			if ((ch->present & bit) && !(ch->had & bit))
+				ecs_addComponent(w, local, rep->comps[i]);
+			else if (!(ch->present & bit) && (ch->had & bit))
+				ecs_removeComponent(w, local, rep->comps[i]);
+		}
+	}
+
+	for (int i = 0; i < rep->compCount; i++) {
+		size_t size = rep->sizes[i];
+		int n = 0;
+		for (int c = 0; c < rep->changeCount; c++) {
+			const ReplChange *ch = &rep->changes[c];
+			if (!(ch->written & (1u << i))) continue;
+			rep->batch[n] = *remapped(rep, state->ents[ch->index]);
+			memcpy(rep->batchValues + n * size,
+			       state->values + ch->index * rep->stride +
+			       rep->offsets[i], size);
+			n++;
+		}
+		if (n)
+			ecs_scatterComponent(w, rep->batch, n, rep->comps[i],
+					     rep->batchValues);
+	}
+
+	rep->applied.count = 0;
+	reserveState(rep, &rep->applied, state->count);
+	for (int s = 0; s < state->count; s++)
+		copyEntity(rep, &rep->applied, state, s);
+	rep->applied.tick = state->tick;
+}
+
+bool ecs_replicateDecode(EcsReplicator *rep, EcsWorld *w,
+			 const uint8_t *data, size_t size)
+{
+	static const ReplState empty;
+	BitReader br = { data, size, 0, false };
+	uint32_t tick = getBits(&br, 32);
+	uint32_t baseTick = getBits(&br, 32);
+	if (br.overflow || tick <= rep->lastTick) return false;
+
+	const ReplState *base = &empty;
+	if (baseTick) {
+		base = findState(rep, baseTick);
+		if (!base) return false;
+	}
+
+	ReplState *state = nextState(rep, base);
+	if (!decodeState(rep, &br, base, state)) {
+		state->tick = 0;
+		return false;
+	}
+	state->tick = tick;
+
+	if (base->tick != rep->applied.tick) diffApplied(rep, state);
+	applyState(rep, w, state);
+	rep->lastTick = tick;
+
+	return true;
+}
+
+uint32_t ecs_replicateTick(const EcsReplicator *rep)
+{
+	return rep->lastTick;
+}
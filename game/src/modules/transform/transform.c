@@ -5,10 +5,337 @@
 #include <ryu/component.h>
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Storage is a set of parallel arrays indexed by slot. Slots are sorted by
+  depth, so a parent always comes before its children and one pass in slot
+  order propagates the whole hierarchy. Within a level, the children of a
+  parent are contiguous and follow the order of their parents
+
+  Handles point to slots through a table with a free list, like the ECS
+  entities. Hierarchy changes only mark the order as dirty, the storage is
+  sorted again (counting sort per level) by the next propagation
+ */
+
+#define MAX_TRANSFORM_COUNT 1024
+
+#define NO_PARENT UINT32_MAX
+
+#define CREATE_HANDLE(i, g) (((uint64_t)(i) << 32) | (g))
+#define HANDLE_INDEX(h) ((uint32_t)((h) >> 32))
+#define HANDLE_GENERATION(h) ((h) & 0xFFFFFFFF)
+
+typedef struct {
+	TransformIndex id; //index of the next free handle if not alive
+	uint32_t slot;
+} HandleDesc;
 
 int transform__id = 0;
 
+static HandleDesc handles[MAX_TRANSFORM_COUNT];
+static uint32_t nextFreeHandle = 0;
+
+//slot arrays
+static uint32_t count = 0;
+static uint32_t slotHandles[MAX_TRANSFORM_COUNT];
+static Entity entities[MAX_TRANSFORM_COUNT];
+static uint32_t parents[MAX_TRANSFORM_COUNT]; //handle index of the parent
+static uint32_t parentSlots[MAX_TRANSFORM_COUNT]; //valid after reorder
+static Transform locals[MAX_TRANSFORM_COUNT];
+static Transform worlds[MAX_TRANSFORM_COUNT];
+static uint8_t dirty[MAX_TRANSFORM_COUNT];
+
+static uint32_t rootCount = 0; //size of the first level
+static bool orderDirty = false;
+static bool anyDirty = false;
+
 void transform_regModule()
 {
 	transform__id = ryu_regComponent();
+
+	for (uint32_t i = 0; i < MAX_TRANSFORM_COUNT - 1; i++)
+		handles[i].id = CREATE_HANDLE(i + 1, 0);
+	handles[MAX_TRANSFORM_COUNT - 1].id = CREATE_HANDLE(UINT32_MAX, 0);
+	nextFreeHandle = 0;
+
+	count = 0;
+	rootCount = 0;
+	orderDirty = false;
+	anyDirty = false;
+}
+
+/* returns the slot of the handle or -1 if invalid */
+static int64_t slotOf(TransformIndex t)
+{
+	if (t == TRANSFORM_NONE) return -1;
+
+	uint32_t index = HANDLE_INDEX(t);
+	if (index >= MAX_TRANSFORM_COUNT || handles[index].id != t) return -1;
+	return handles[index].slot;
+}
+
+static void markDirty(uint32_t slot)
+{
+	dirty[slot] = 1;
+	anyDirty = true;
+}
+
+TransformIndex transform_regEntity(Entity ent)
+{
+	if (nextFreeHandle == UINT32_MAX) {
+		fprintf(stderr, "transform_regEntity: out of transforms (max %d)\n", MAX_TRANSFORM_COUNT);
+		exit(1);
+	}
+
+	uint32_t index = nextFreeHandle;
+	HandleDesc *desc = &handles[index];
+	nextFreeHandle = HANDLE_INDEX(desc->id);
+	desc->id = CREATE_HANDLE(index, HANDLE_GENERATION(desc->id) + 1);
+
+	uint32_t slot = count++;
+	desc->slot = slot;
+	slotHandles[slot] = index;
+	entities[slot] = ent;
+	parents[slot] = NO_PARENT;
+	parentSlots[slot] = slot;
+	locals[slot] = (Transform){
+		.rotation = { 1.0f, 0.0f },
+		.scale = { 1.0f, 1.0f },
+	};
+	markDirty(slot);
+
+	//a root appended after roots only keeps the order
+	if (rootCount == slot) rootCount++;
+	else orderDirty = true;
+
+	return desc->id;
+}
+
+void transform_destroy(TransformIndex t)
+{
+	int64_t slot = slotOf(t);
+	if (slot < 0) return;
+	uint32_t index = HANDLE_INDEX(t);
+
+	for (uint32_t s = 0; s < count; s++) {
+		if (parents[s] != index) continue;
+		parents[s] = NO_PARENT;
+		markDirty(s);
+	}
+
+	//the last slot takes the place of the removed one
+	uint32_t last = --count;
+	if (slot != last) {
+		slotHandles[slot] = slotHandles[last];
+		entities[slot] = entities[last];
+		parents[slot] = parents[last];
+		locals[slot] = locals[last];
+		worlds[slot] = worlds[last];
+		dirty[slot] = dirty[last];
+		handles[slotHandles[slot]].slot = slot;
+	}
+	orderDirty = true;
+
+	handles[index].id = CREATE_HANDLE(nextFreeHandle,
+					  HANDLE_GENERATION(t) + 1);
+	nextFreeHandle = index;
+}
+
+bool transform_isValid(TransformIndex t)
+{
+	return slotOf(t) >= 0;
+}
+
+Entity transform_getEntity(TransformIndex t)
+{
+	int64_t slot = slotOf(t);
+	return slot < 0 ? 0 : entities[slot];
+}
+
+bool transform_setParent(TransformIndex t, TransformIndex parent)
+{
+	int64_t slot = slotOf(t);
+	if (slot < 0) return false;
+
+	uint32_t parentIndex = NO_PARENT;
+	if (parent != TRANSFORM_NONE) {
+		int64_t parentSlot = slotOf(parent);
+		if (parentSlot < 0) return false;
+		parentIndex = HANDLE_INDEX(parent);
+
+		//the new parent must not be in the subtree
+		for (uint32_t cur = parentIndex; cur != NO_PARENT;
+		     cur = parents[handles[cur].slot]) {
+			if (cur == HANDLE_INDEX(t)) return false;
+		}
+	}
+
+	if (parents[slot] == parentIndex) return true;
+	parents[slot] = parentIndex;
+	markDirty(slot);
+	orderDirty = true;
+
+	return true;
+}
+
+TransformIndex transform_getParent(TransformIndex t)
+{
+	int64_t slot = slotOf(t);
+	if (slot < 0 || parents[slot] == NO_PARENT) return TRANSFORM_NONE;
+	return handles[parents[slot]].id;
+}
+
+Transform *transform_getLocal(TransformIndex t)
+{
+	int64_t slot = slotOf(t);
+	if (slot < 0) return NULL;
+
+	markDirty(slot);
+	return &locals[slot];
+}
+
+const Transform *transform_getWorld(TransformIndex t)
+{
+	int64_t slot = slotOf(t);
+	return slot < 0 ? NULL : &worlds[slot];
+}
+
+/* reorders the slot array by the new to old slot mapping */
+static void permute(void *array, size_t size, const uint32_t *order)
+{
+	static uint8_t scratch[MAX_TRANSFORM_COUNT * sizeof(Transform)];
+	uint8_t *data = array;
+
+	for (uint32_t i = 0; i < count; i++)
+		memcpy(scratch + i * size, data + order[i] * size, size);
+	memcpy(data, scratch, count * size);
+}
+
+/*
+  sorts the slots by depth. Depths are found by walking up to the first
+  ancestor with a known depth, then slots are grouped by depth and every
+  level is counting sorted by the new slot of the parents
+ */
+static void reorder(void)
+{
+	static int32_t depths[MAX_TRANSFORM_COUNT];
+	static uint32_t stack[MAX_TRANSFORM_COUNT];
+	static uint32_t byDepth[MAX_TRANSFORM_COUNT];
+	static uint32_t order[MAX_TRANSFORM_COUNT]; //new slot to old slot
+	static uint32_t newSlots[MAX_TRANSFORM_COUNT]; //old slot to new slot
+	static uint32_t levelStart[MAX_TRANSFORM_COUNT + 1];
+	static uint32_t counts[MAX_TRANSFORM_COUNT + 1];
+
+	for (uint32_t s = 0; s < count; s++) depths[s] = -1;
+
+	int32_t maxDepth = 0;
+	for (uint32_t s = 0; s < count; s++) {
+		uint32_t cur = s;
+		uint32_t n = 0;
+		while (depths[cur] < 0 && parents[cur] != NO_PARENT) {
+			stack[n++] = cur;
+			cur = handles[parents[cur]].slot;
+		}
+		if (depths[cur] < 0) depths[cur] = 0;
+
+		int32_t depth = depths[cur];
+		while (n) depths[stack[--n]] = ++depth;
+		if (depth > maxDepth) maxDepth = depth;
+	}
+
+	//group by depth, keeping the current order
+	memset(levelStart, 0, (maxDepth + 2) * sizeof(uint32_t));
+	for (uint32_t s = 0; s < count; s++) levelStart[depths[s] + 1]++;
+	for (int32_t d = 0; d <= maxDepth; d++)
+		levelStart[d + 1] += levelStart[d];
+	memcpy(counts, levelStart, (maxDepth + 1) * sizeof(uint32_t));
+	for (uint32_t s = 0; s < count; s++)
+		byDepth[counts[depths[s]]++] = s;
+
+	//roots keep their order
+	for (uint32_t i = 0; i < levelStart[1]; i++) {
+		order[i] = byDepth[i];
+		newSlots[byDepth[i]] = i;
+	}
+
+	//siblings get contiguous, in the order of their parents
+	for (int32_t d = 1; d <= maxDepth; d++) {
+		uint32_t parentBase = levelStart[d - 1];
+		uint32_t parentCount = levelStart[d] - parentBase;
+		uint32_t first = levelStart[d];
+		uint32_t end = levelStart[d + 1];
+
+		memset(counts, 0, (parentCount + 1) * sizeof(uint32_t));
+		for (uint32_t i = first; i < end; i++) {
+			uint32_t p = handles[parents[byDepth[i]]].slot;
+			counts[newSlots[p] - parentBase + 1]++;
+		}
+		for (uint32_t k = 0; k < parentCount; k++)
+			counts[k + 1] += counts[k];
+
+		for (uint32_t i = first; i < end; i++) {
+			uint32_t s = byDepth[i];
+			uint32_t p = handles[parents[s]].slot;
+			uint32_t pos = first + counts[newSlots[p] - parentBase]++;
+			order[pos] = s;
+			newSlots[s] = pos;
+		}
+	}
+
+	permute(slotHandles, sizeof(uint32_t), order);
+	permute(entities, sizeof(Entity), order);
+	permute(parents, sizeof(uint32_t), order);
+	permute(locals, sizeof(Transform), order);
+	permute(worlds, sizeof(Transform), order);
+	permute(dirty, sizeof(uint8_t), order);
+
+	for (uint32_t s = 0; s < count; s++) {
+		handles[slotHandles[s]].slot = s;
+		parentSlots[s] = s;
+	}
+	for (uint32_t s = levelStart[1]; s < count; s++)
+		parentSlots[s] = handles[parents[s]].slot;
+
+	rootCount = levelStart[1];
+	orderDirty = false;
+}
+
+/* world transform of a child from the world transform of its parent */
+static void compose(Transform *out, const Transform *parent,
+		    const Transform *local)
+{
+	float x = local->position.x * parent->scale.x;
+	float y = local->position.y * parent->scale.y;
+	vec2 r = parent->rotation;
+
+	out->position.x = parent->position.x + x * r.x - y * r.y;
+	out->position.y = parent->position.y + x * r.y + y * r.x;
+	out->rotation.x = r.x * local->rotation.x - r.y * local->rotation.y;
+	out->rotation.y = r.x * local->rotation.y + r.y * local->rotation.x;
+	out->scale.x = parent->scale.x * local->scale.x;
+	out->scale.y = parent->scale.y * local->scale.y;
+}
+
+void transform_propagate(void)
+{
+	if (orderDirty) reorder();
+	if (!anyDirty) return;
+
+	for (uint32_t s = 0; s < rootCount; s++)
+		if (dirty[s]) worlds[s] = locals[s];
+
+	//parents come first, so their dirty flag is final
+	for (uint32_t s = rootCount; s < count; s++) {
+		uint32_t p = parentSlots[s];
+		if (!dirty[s] && !dirty[p]) continue;
+
+		dirty[s] = 1;
+		compose(&worlds[s], &worlds[p], &locals[s]);
+	}
+
+	memset(dirty, 0, count);
+	anyDirty = false;
 }
@@ -0,0 +1,158 @@
+/*
+  This test unit adds, removes and destroys through whole queries, in and
+  out of deferred mode, and checks the values kept by the moved entities,
+  the entities left alone and the events seen by the observers
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+
+#define ENTITY_COUNT 60
+#define HALF (ENTITY_COUNT / 2)
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int hp;
+} Health;
+
+typedef struct {
+	int since;
+} Frozen;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Health);
+ECS_DECL_COMP(Frozen);
+ECS_DECL_COMP(Marked); //tag
+
+static int added;
+static int removed;
+static int marked;
+
+static void onAdd(EcsWorld *w, Archetype *arch, const Entity *ents,
+		  int count, void *ctx)
+{
+	(void)arch;
+	(void)ctx;
+	for (int i = 0; i < count; i++)
+		assert(ECS_GET_COMPONENT(w, ents[i], Frozen));
+	added += count;
+}
+
+static void onRemove(EcsWorld *w, Archetype *arch, const Entity *ents,
+		     int count, void *ctx)
+{
+	(void)w;
+	(void)arch;
+	(void)ents;
+	(void)ctx;
+	removed += count;
+}
+
+static void onMark(EcsWorld *w, Archetype *arch, const Entity *ents,
+		   int count, void *ctx)
+{
+	(void)arch;
+	(void)ctx;
+	for (int i = 0; i < count; i++)
+		assert(ecs_hasComponent(w, ents[i], ECS_ID(Marked)));
+	marked += count;
+}
+
+static int countRows(EcsWorld *w, EcsQuery *q)
+{
+	int count = 0;
+	EcsIter it = ecs_queryIter(w, q);
+	while (ecs_iterNext(&it)) count++;
+	return count;
+}
+
+static void testBulk(bool deferred)
+{
+	EcsWorld *w = ecs_createWorld();
+	ecs_observe(w, (EcsObserverDesc){ ECS_ON_ADD, ECS_ID(Frozen), NULL,
+					  onAdd, NULL });
+	ecs_observe(w, (EcsObserverDesc){ ECS_ON_REMOVE, ECS_ID(Frozen), NULL,
+					  onRemove, NULL });
+	ecs_observe(w, (EcsObserverDesc){ ECS_ON_ADD, ECS_ID(Marked), NULL,
+					  onMark, NULL });
+	added = removed = marked = 0;
+
+	Archetype *pos = ECS_REG_ARCH(w, Pos);
+	Archetype *both = ECS_REG_ARCH(w, Pos, Health);
+	Entity ents[ENTITY_COUNT];
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntityInArch(w, i < HALF ? pos : both);
+		ECS_GET_COMPONENT(w, ents[i], Pos)->x = i;
+		if (i >= HALF) ECS_GET_COMPONENT(w, ents[i], Health)->hp = i;
+	}
+	//disabled rows are not matched, so they are left alone
+	ecs_setEnabled(w, ents[0], false);
+	Entity lone = ecs_newEntity(w);
+	ECS_ADD_COMPONENT(w, lone, Health)->hp = -1;
+
+	EcsQuery *withPos = ECS_QUERY(w, ECS_ACCESS(include, Pos));
+	EcsQuery *frozen = ECS_QUERY(w, ECS_ACCESS(include, Frozen));
+
+	if (deferred) ecs_deferBegin(w);
+	ecs_addComponentToQuery(w, withPos, ECS_ID(Frozen));
+	ecs_addComponentToQuery(w, withPos, ECS_ID(Marked));
+	if (deferred) ecs_deferEnd(w);
+
+	assert(countRows(w, frozen) == ENTITY_COUNT - 1);
+	assert(added == ENTITY_COUNT - 1);
+	assert(marked == ENTITY_COUNT - 1);
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		assert(ECS_GET_COMPONENT(w, ents[i], Pos)->x == i);
+		assert(!ECS_GET_COMPONENT(w, ents[i], Frozen) == (i == 0));
+		assert(ecs_hasComponent(w, ents[i], ECS_ID(Marked)) == (i != 0));
+		if (i >= HALF)
+			assert(ECS_GET_COMPONENT(w, ents[i], Health)->hp == i);
+	}
+	assert(!ECS_GET_COMPONENT(w, lone, Frozen));
+
+	if (deferred) ecs_deferBegin(w);
+	ecs_removeComponentFromQuery(w, withPos, ECS_ID(Frozen));
+	if (deferred) ecs_deferEnd(w);
+
+	assert(countRows(w, frozen) == 0);
+	assert(removed == ENTITY_COUNT - 1);
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		assert(ECS_GET_COMPONENT(w, ents[i], Pos)->x == i);
+
+	//destroys every matched entity, the query remains usable
+	ecs_setEnabled(w, ents[0], true);
+	EcsQuery *withHealth = ECS_QUERY(w, ECS_ACCESS(include, Health));
+	if (deferred) ecs_deferBegin(w);
+	ecs_destroyQuery(w, withHealth);
+	if (deferred) ecs_deferEnd(w);
+
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		assert(ecs_isValid(w, ents[i]) == (i < HALF));
+	assert(!ecs_isValid(w, lone));
+	assert(countRows(w, withHealth) == 0);
+	assert(countRows(w, withPos) == HALF);
+
+	Entity later = ecs_newEntity(w);
+	ECS_ADD_COMPONENT(w, later, Health)->hp = 1;
+	assert(countRows(w, withHealth) == 1);
+
+	ecs_destroyWorld(w);
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Health);
+	ECS_REG_COMP(Frozen);
+	ECS_REG_TAG(Marked);
+
+	testBulk(false);
+	testBulk(true);
+
+	return 0;
+}
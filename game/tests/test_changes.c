@@ -0,0 +1,112 @@
+/*
+  This test unit writes components through the different ways of getting
+  a mutable pointer and checks which archetypes the change filtered
+  iterators report, tick after tick
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	float x;
+	float y;
+} Vel;
+
+typedef struct {
+	int hp;
+} Health;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Health);
+
+static EcsWorld *world;
+
+static int countChanged(EcsQuery *q, uint32_t since)
+{
+	int count = 0;
+	EcsIter it = ecs_queryIterChangedSince(world, q, since);
+	while (ecs_iterNext(&it)) count++;
+	return count;
+}
+
+/* runs the query like a system would */
+static void runSystem(EcsQuery *q)
+{
+	EcsIter it = ecs_queryIter(world, q);
+	while (ecs_iterNext(&it)) ((Pos*)it.includes[0])->x += 1;
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Vel);
+	ECS_REG_COMP(Health);
+
+	world = ecs_createWorld();
+	Archetype *moving = ECS_REG_ARCH(world, Pos, Vel);
+	Archetype *living = ECS_REG_ARCH(world, Pos, Health);
+	Entity mover = ecs_newEntityInArch(world, moving);
+	Entity liver = ecs_newEntityInArch(world, living);
+
+	EcsQuery *move = ECS_QUERY(world, ECS_ACCESS(include, Pos, Vel),
+				   ECS_ACCESS(write, Pos));
+	EcsQuery *watchPos = ECS_QUERY(world, ECS_ACCESS(include, Pos));
+	EcsQuery *watchVel = ECS_QUERY(world, ECS_ACCESS(include, Pos),
+				       ECS_ACCESS(changed, Vel));
+
+	//rows added in a tick count as written
+	uint32_t last = ecs_getTick(world);
+	ecs_progressTick(world);
+	assert(countChanged(watchPos, last) == 2);
+
+	last = ecs_getTick(world);
+	ecs_progressTick(world);
+	assert(countChanged(watchPos, last) == 0);
+
+	//only the archetype written by the system is reported
+	runSystem(move);
+	assert(countChanged(watchPos, last) == 1);
+	assert(countChanged(watchVel, last) == 0);
+
+	//the filter is inclusive, writes of the last tick show up again
+	last = ecs_getTick(world);
+	ecs_progressTick(world);
+	assert(countChanged(watchPos, last) == 1);
+
+	last = ecs_getTick(world);
+	ecs_progressTick(world);
+	assert(countChanged(watchPos, last) == 0);
+
+	//unwatched components are not reported
+	ECS_GET_COMPONENT(world, liver, Health)->hp = 3;
+	assert(countChanged(watchPos, last) == 0);
+	ECS_GET_COMPONENT(world, liver, Pos)->x = 3;
+	assert(countChanged(watchPos, last) == 1);
+	ECS_GET_COMPONENT(world, mover, Vel)->x = 1;
+	assert(countChanged(watchVel, last) == 1);
+
+	//commands applied by a flush stamp the columns they write
+	ecs_progressTick(world);
+	last = ecs_getTick(world);
+	ecs_deferBegin(world);
+	ECS_ADD_COMPONENT(world, mover, Health)->hp = 5;
+	ecs_deferEnd(world);
+	assert(countChanged(watchPos, last) == 1);
+
+	//a removal moves the row, which writes the archetype it joins
+	ecs_progressTick(world);
+	last = ecs_getTick(world);
+	ecs_removeComponent(world, liver, ECS_ID(Health));
+	assert(countChanged(watchPos, last) == 1);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+  This test unit goes through far more component combinations than there
+  are archetype slots, letting the idle archetypes be collected, and
+  checks that slots and storage are reused while queries, pinned
+  archetypes and prefabs keep working
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+
+#define COMP_COUNT 10
+#define ROUND_COUNT 200
+#define ROUND_ENTITIES 20
+#define IDLE_TICKS 2
+
+typedef struct {
+	int v;
+	char pad[60];
+} Big;
+
+static EcsComponent comps[COMP_COUNT];
+
+/* the components of the nth entity, at most 8 as allowed per archetype */
+static int maskOf(int n)
+{
+	int mask = n % 1023 + 1;
+	int bits = 0;
+	for (int b = 0; b < COMP_COUNT; b++) bits += mask >> b & 1;
+	return bits > 8 ? mask & 0xFF : mask;
+}
+
+static int countRows(EcsWorld *w, EcsQuery *q)
+{
+	int count = 0;
+	EcsIter it = ecs_queryIter(w, q);
+	while (ecs_iterNext(&it)) count++;
+	return count;
+}
+
+int main(void)
+{
+	for (int i = 0; i < COMP_COUNT; i++)
+		comps[i] = ecs_registerComponent(sizeof(Big), alignof(Big));
+
+	EcsWorld *w = ecs_createWorld();
+	ecs_setArchetypeIdleTicks(w, IDLE_TICKS);
+
+	EcsQuery *all = ecs_makeQuery(w, (EcsQueryDesc){0});
+	EcsQuery *first = ecs_makeQuery(w, (EcsQueryDesc){
+		.include = &comps[0], .includeCount = 1,
+		.groupBy = comps[0], .groupOffset = offsetof(Big, v),
+		.groupSize = sizeof(int),
+	});
+
+	//kept although empty
+	Archetype *pinned = ecs_registerArchetype(w, (EcsComponent[]){
+		comps[1], comps[2] }, 2);
+	EcsPrefab *prefab = ecs_makePrefab(w, ecs_registerArchetype(w,
+		(EcsComponent[]){ comps[3] }, 1));
+	((Big*)ecs_getPrefabComponent(prefab, comps[3]))->v = 3;
+
+	Entity keep = ecs_newEntity(w);
+	((Big*)ecs_addComponent(w, keep, comps[0]))->v = 7;
+
+	//about 1000 masks, several times the archetype slots
+	for (int round = 0; round < ROUND_COUNT; round++) {
+		Entity ents[ROUND_ENTITIES];
+		for (int k = 0; k < ROUND_ENTITIES; k++) {
+			int mask = maskOf(round * ROUND_ENTITIES + k);
+			ents[k] = ecs_newEntity(w);
+			for (int b = 0; b < COMP_COUNT; b++) {
+				if (!(mask >> b & 1)) continue;
+				((Big*)ecs_addComponent(w, ents[k], comps[b]))->v = mask;
+			}
+		}
+
+		assert(countRows(w, all) == ROUND_ENTITIES + 1);
+		EcsIter it = ecs_queryIter(w, first);
+		while (ecs_iterNext(&it)) {
+			int v = ((Big*)it.includes[0])->v;
+			assert(v == 7 || (v & 1));
+		}
+		it = ecs_queryIterGroup(w, first, 7);
+		assert(ecs_iterNext(&it) && it.entity == keep);
+
+		for (int k = 0; k < ROUND_ENTITIES; k++) {
+			int mask = maskOf(round * ROUND_ENTITIES + k);
+			for (int b = 0; b < COMP_COUNT; b++) {
+				if (!(mask >> b & 1)) continue;
+				assert(((Big*)ecs_getComponent(w, ents[k],
+							 comps[b]))->v == mask);
+			}
+			ecs_destroy(w, ents[k]);
+		}
+		for (int t = 0; t <= IDLE_TICKS; t++) ecs_progressTick(w);
+	}
+
+	assert(((Big*)ecs_getComponent(w, keep, comps[0]))->v == 7);
+	assert(countRows(w, all) == 1);
+
+	//the pinned archetype and the prefab's one were never collected
+	Entity inPinned = ecs_newEntityInArch(w, pinned);
+	assert(ecs_getEntityArch(w, inPinned) == pinned);
+	Entity instance;
+	ecs_instantiate(w, prefab, 1, &instance);
+	assert(((Big*)ecs_getComponent(w, instance, comps[3]))->v == 3);
+
+	//an emptied archetype lives until the idle period is over
+	Entity mover = ecs_newEntity(w);
+	ecs_addComponent(w, mover, comps[9]);
+	Archetype *left = ecs_getEntityArch(w, mover);
+	ecs_removeComponent(w, mover, comps[9]);
+	ecs_collectArchetypes(w);
+	ecs_addComponent(w, mover, comps[9]);
+	assert(ecs_getEntityArch(w, mover) == left);
+
+	//a collected slot is reused by the next archetype
+	ecs_removeComponent(w, mover, comps[9]);
+	for (int t = 0; t <= IDLE_TICKS; t++) ecs_progressTick(w);
+	ecs_addComponent(w, mover, comps[8]);
+	assert(ecs_getEntityArch(w, mover) == left);
+	assert(!ecs_getComponent(w, mover, comps[9]));
+
+	ecs_destroyWorld(w);
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+  This test unit touches from a handful up to every entity of the world in
+  deferred mode, so the command buckets and their lookup table grow and
+  are reused across flushes, and checks the values after every flush
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 240 //fits in one archetype
+#define ROUND_COUNT 40
+
+typedef struct {
+	int x;
+} A;
+
+typedef struct {
+	int y;
+} B;
+
+typedef struct {
+	double z;
+} C;
+
+ECS_DECL_COMP(A);
+ECS_DECL_COMP(B);
+ECS_DECL_COMP(C);
+
+static EcsWorld *world;
+static Entity ents[ENTITY_COUNT];
+static int expectedA[ENTITY_COUNT];
+static int expectedB[ENTITY_COUNT]; //0 if removed
+
+static void check(void)
+{
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		assert(ECS_GET_COMPONENT(world, ents[i], A)->x == expectedA[i]);
+		B *b = ECS_GET_COMPONENT(world, ents[i], B);
+		assert(!b == !expectedB[i]);
+		if (b) assert(b->y == expectedB[i]);
+		assert(ECS_GET_COMPONENT(world, ents[i], C)->z == i * 0.5);
+	}
+}
+
+static void runRound(int touched)
+{
+	ecs_deferBegin(world);
+	for (int k = 0; k < touched; k++) {
+		int i = rand() % ENTITY_COUNT;
+		int value = rand() % 1000 + 1;
+
+		//staged and live values are both written in place
+		ECS_ADD_COMPONENT(world, ents[i], A)->x = value;
+		expectedA[i] = value;
+
+		if (rand() % 2) {
+			ecs_removeComponent(world, ents[i], ECS_ID(B));
+			expectedB[i] = 0;
+		} else {
+			ECS_ADD_COMPONENT(world, ents[i], B)->y = value;
+			expectedB[i] = value;
+		}
+	}
+	ecs_deferEnd(world);
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(A);
+	ECS_REG_COMP(B);
+	ECS_REG_COMP(C);
+
+	world = ecs_createWorld();
+	Archetype *arch = ECS_REG_ARCH(world, A, C);
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntityInArch(world, arch);
+		ECS_GET_COMPONENT(world, ents[i], A)->x = 0;
+		ECS_GET_COMPONENT(world, ents[i], C)->z = i * 0.5;
+	}
+
+	for (int r = 0; r < ROUND_COUNT; r++) {
+		//from a few commands up to several per entity
+		runRound(r % 4 == 3 ? ENTITY_COUNT * 3 : rand() % 20);
+		check();
+	}
+
+	//an add disabled by a removal starts from zero when added again
+	ecs_deferBegin(world);
+	ECS_ADD_COMPONENT(world, ents[0], B)->y = 7;
+	ecs_removeComponent(world, ents[0], ECS_ID(B));
+	assert(ECS_ADD_COMPONENT(world, ents[0], B)->y == 0);
+	ecs_deferEnd(world);
+	assert(ECS_GET_COMPONENT(world, ents[0], B)->y == 0);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
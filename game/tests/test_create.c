@@ -0,0 +1,132 @@
+/*
+  This test unit creates entities in deferred mode while iterating a
+  query and checks that they are usable right away, stay out of queries
+  until the flush and end up with their staged components
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+
+#define SPAWNER_COUNT 5
+#define CYCLE_COUNT 3
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	float x;
+	float y;
+} Vel;
+
+typedef struct {
+	int hp;
+} Health;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Health);
+
+static int countRows(EcsWorld *w, EcsQuery *q)
+{
+	int count = 0;
+	EcsIter it = ecs_queryIter(w, q);
+	while (ecs_iterNext(&it)) count++;
+	return count;
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Vel);
+	ECS_REG_COMP(Health);
+
+	EcsWorld *w = ecs_createWorld();
+	Archetype *moving = ECS_REG_ARCH(w, Pos, Vel);
+	for (int i = 0; i < SPAWNER_COUNT; i++) {
+		Entity ent = ecs_newEntityInArch(w, moving);
+		ECS_GET_COMPONENT(w, ent, Pos)->x = i;
+		ECS_GET_COMPONENT(w, ent, Vel)->x = 1;
+	}
+
+	EcsQuery *movingQuery = ECS_QUERY(w, ECS_ACCESS(include, Pos, Vel));
+	EcsQuery *healthQuery = ECS_QUERY(w, ECS_ACCESS(include, Health));
+
+	static Entity copies[1 << 10];
+	static Entity healthy[1 << 10];
+	static Entity destroyed[1 << 10];
+	int copyCount = 0;
+	int healthyCount = 0;
+	int destroyedCount = 0;
+	int rows = SPAWNER_COUNT;
+
+	for (int cycle = 0; cycle < CYCLE_COUNT; cycle++) {
+		ecs_deferBegin(w);
+
+		//every row spawns a copy, which the iterator does not visit
+		int seen = 0;
+		EcsIter it = ecs_queryIter(w, movingQuery);
+		while (ecs_iterNext(&it)) {
+			Pos *p = it.includes[0];
+			Entity copy = ecs_newEntityInArch(w, moving);
+			assert(ecs_isValid(w, copy));
+			assert(!ecs_getEntityArch(w, copy));
+			//components of the archetype start zeroed
+			assert(ECS_GET_COMPONENT(w, copy, Vel)->x == 0);
+			ECS_GET_COMPONENT(w, copy, Pos)->x = p->x + 100;
+			copies[copyCount++] = copy;
+
+			Entity h = ecs_newEntity(w);
+			ECS_ADD_COMPONENT(w, h, Health)->hp = copyCount;
+			healthy[healthyCount++] = h;
+
+			//created and destroyed in the same batch
+			Entity gone = ecs_newEntity(w);
+			ECS_ADD_COMPONENT(w, gone, Health)->hp = -1;
+			ecs_destroy(w, gone);
+			assert(!ECS_GET_COMPONENT(w, gone, Health));
+			destroyed[destroyedCount++] = gone;
+
+			seen++;
+		}
+		assert(seen == rows);
+		assert(countRows(w, healthQuery) == healthyCount - seen);
+		ecs_deferEnd(w);
+
+		rows *= 2;
+		assert(countRows(w, movingQuery) == rows);
+		assert(countRows(w, healthQuery) == healthyCount);
+		for (int i = 0; i < destroyedCount; i++)
+			assert(!ecs_isValid(w, destroyed[i]));
+	}
+
+	//created entities of the same components share one archetype
+	for (int i = 0; i < copyCount; i++) {
+		assert(ecs_getEntityArch(w, copies[i]) == moving);
+		assert(ECS_GET_COMPONENT(w, copies[i], Pos)->x >= 100);
+		assert(ECS_GET_COMPONENT(w, copies[i], Vel)->x == 0);
+	}
+	Archetype *healthArch = ecs_getEntityArch(w, healthy[0]);
+	for (int i = 0; i < healthyCount; i++) {
+		assert(ecs_getEntityArch(w, healthy[i]) == healthArch);
+		assert(ECS_GET_COMPONENT(w, healthy[i], Health)->hp == i + 1);
+		assert(!ECS_GET_COMPONENT(w, healthy[i], Pos));
+	}
+
+	//removing a component of the requested archetype before the flush
+	ecs_deferBegin(w);
+	Entity still = ecs_newEntityInArch(w, moving);
+	ecs_removeComponent(w, still, ECS_ID(Vel));
+	assert(!ECS_GET_COMPONENT(w, still, Vel));
+	ECS_GET_COMPONENT(w, still, Pos)->y = 3;
+	ecs_deferEnd(w);
+	assert(ecs_getEntityArch(w, still) != moving);
+	assert(ECS_GET_COMPONENT(w, still, Pos)->y == 3);
+	assert(!ECS_GET_COMPONENT(w, still, Vel));
+
+	ecs_destroyWorld(w);
+
+	return 0;
+}
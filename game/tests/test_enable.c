@@ -0,0 +1,115 @@
+/*
+  This test unit enables and disables random entities while they move
+  between archetypes and get destroyed, and checks that queries visit
+  exactly the enabled ones unless made with includeDisabled
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 200
+#define STEP_COUNT 3000
+
+typedef struct {
+	int id;
+} Pos;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Moved); //tag
+
+static EcsWorld *world;
+static Entity ents[ENTITY_COUNT];
+static bool enabled[ENTITY_COUNT];
+
+static void check(EcsQuery *q, EcsQuery *all)
+{
+	int expected = 0;
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		assert(ecs_isEnabled(world, ents[i]) == enabled[i]);
+		expected += enabled[i];
+	}
+
+	int count = 0;
+	EcsIter it = ecs_queryIter(world, q);
+	while (ecs_iterNext(&it)) {
+		int id = ((Pos*)it.includes[0])->id;
+		assert(ents[id] == it.entity);
+		assert(enabled[id]);
+		count++;
+	}
+	assert(count == expected);
+
+	count = 0;
+	it = ecs_queryIter(world, all);
+	while (ecs_iterNext(&it)) count++;
+	assert(count == ENTITY_COUNT);
+}
+
+static void spawn(int i, Archetype *arch)
+{
+	ents[i] = ecs_newEntityInArch(world, arch);
+	ECS_GET_COMPONENT(world, ents[i], Pos)->id = i;
+	enabled[i] = true;
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_TAG(Moved);
+
+	world = ecs_createWorld();
+	Archetype *arch = ECS_REG_ARCH(world, Pos);
+	for (int i = 0; i < ENTITY_COUNT; i++) spawn(i, arch);
+
+	EcsQuery *q = ECS_QUERY(world, ECS_ACCESS(include, Pos));
+	EcsQuery *all = ECS_QUERY(world, ECS_ACCESS(include, Pos),
+				  .includeDisabled = true);
+
+	for (int step = 0; step < STEP_COUNT; step++) {
+		int i = rand() % ENTITY_COUNT;
+		int op = rand() % 10;
+		if (op < 5) {
+			enabled[i] = !enabled[i];
+			ecs_setEnabled(world, ents[i], enabled[i]);
+		} else if (op < 7) {
+			//the state follows the row
+			if (ecs_hasComponent(world, ents[i], ECS_ID(Moved)))
+				ecs_removeComponent(world, ents[i], ECS_ID(Moved));
+			else
+				ecs_addComponent(world, ents[i], ECS_ID(Moved));
+		} else if (op < 8) {
+			//the last row is swapped into the hole
+			ecs_destroy(world, ents[i]);
+			spawn(i, arch);
+		} else {
+			ecs_deferBegin(world);
+			for (int k = 0; k < 10; k++) {
+				int j = rand() % ENTITY_COUNT;
+				enabled[j] = rand() % 2;
+				ecs_setEnabled(world, ents[j], enabled[j]);
+				assert(ecs_isEnabled(world, ents[j]) == enabled[j]);
+			}
+			ecs_deferEnd(world);
+		}
+		if (step % 50 == 0) check(q, all);
+	}
+	check(q, all);
+
+	//the bulk operations only touch the enabled rows
+	ecs_addComponentToQuery(world, q, ECS_ID(Moved));
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		if (enabled[i])
+			assert(ecs_hasComponent(world, ents[i], ECS_ID(Moved)));
+	ecs_destroyQuery(world, q);
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		assert(ecs_isValid(world, ents[i]) == !enabled[i]);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
@@ -0,0 +1,157 @@
+/*
+  This test unit issues random adds, removes and destroys in deferred
+  mode, several per entity, and checks that the flush leaves every entity
+  with the components and values of the last commands
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 200
+#define ROUND_COUNT 50
+#define COMMAND_COUNT 400
+
+typedef struct {
+	int x;
+	int y;
+} Pos;
+
+typedef struct {
+	int dx;
+} Vel;
+
+typedef struct {
+	int hp;
+} Health;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Health);
+
+#define COMP_COUNT 3
+
+//what the world should hold for an entity
+typedef struct {
+	Entity ent;
+	bool alive;
+	bool has[COMP_COUNT];
+	int value[COMP_COUNT];
+} Expected;
+
+static EcsWorld *world;
+static EcsComponent comps[COMP_COUNT];
+static Expected expected[ENTITY_COUNT];
+
+static void setValue(void *data, int c, int value)
+{
+	if (c == 0) *(Pos*)data = (Pos){ value, -value };
+	else if (c == 1) ((Vel*)data)->dx = value;
+	else ((Health*)data)->hp = value;
+}
+
+static int getValue(const void *data, int c)
+{
+	if (c == 0) {
+		assert(((Pos*)data)->y == -((Pos*)data)->x);
+		return ((Pos*)data)->x;
+	}
+	if (c == 1) return ((Vel*)data)->dx;
+	return ((Health*)data)->hp;
+}
+
+static void check(void)
+{
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		Expected *e = &expected[i];
+		assert(ecs_isValid(world, e->ent) == e->alive);
+		if (!e->alive) continue;
+
+		for (int c = 0; c < COMP_COUNT; c++) {
+			void *data = ecs_getComponent(world, e->ent, comps[c]);
+			assert(!data == !e->has[c]);
+			if (data) assert(getValue(data, c) == e->value[c]);
+		}
+	}
+}
+
+/* entities with the same components share an archetype */
+static void checkArchetypes(void)
+{
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		if (!expected[i].alive) continue;
+		for (int j = 0; j < i; j++) {
+			if (!expected[j].alive) continue;
+			bool same = true;
+			for (int c = 0; c < COMP_COUNT; c++)
+				same &= expected[i].has[c] == expected[j].has[c];
+			assert(same == (ecs_getEntityArch(world, expected[i].ent) ==
+					ecs_getEntityArch(world, expected[j].ent)));
+		}
+	}
+}
+
+static void runRound(void)
+{
+	ecs_deferBegin(world);
+	for (int k = 0; k < COMMAND_COUNT; k++) {
+		Expected *e = &expected[rand() % ENTITY_COUNT];
+		if (!e->alive) continue;
+
+		int c = rand() % COMP_COUNT;
+		int op = rand() % 20;
+		if (op < 10) {
+			int value = rand() % 1000;
+			setValue(ecs_addComponent(world, e->ent, comps[c]), c, value);
+			e->has[c] = true;
+			e->value[c] = value;
+		} else if (op < 19) {
+			ecs_removeComponent(world, e->ent, comps[c]);
+			assert(!ecs_getComponent(world, e->ent, comps[c]));
+			e->has[c] = false;
+		} else {
+			ecs_destroy(world, e->ent);
+			e->alive = false;
+		}
+	}
+	ecs_deferEnd(world);
+
+	//destroyed entities come back empty
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		if (expected[i].alive) continue;
+		expected[i] = (Expected){ .ent = ecs_newEntity(world), .alive = true };
+	}
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Vel);
+	ECS_REG_COMP(Health);
+	comps[0] = ECS_ID(Pos);
+	comps[1] = ECS_ID(Vel);
+	comps[2] = ECS_ID(Health);
+
+	world = ecs_createWorld();
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		expected[i] = (Expected){ .ent = ecs_newEntity(world), .alive = true };
+
+	for (int r = 0; r < ROUND_COUNT; r++) {
+		runRound();
+		check();
+		checkArchetypes();
+	}
+
+	//a flush with nothing staged changes nothing
+	ecs_deferBegin(world);
+	ecs_deferEnd(world);
+	check();
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*
+  This test unit gathers and scatters a component for shuffled entity
+  lists, with dead entities and entities lacking the component, before
+  and after sorting the lists, and checks every value against the world
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 400
+#define LIST_COUNT 50
+#define LIST_SIZE 300
+
+typedef struct {
+	int hp;
+	short armor;
+} Health;
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int burning;
+} Fire;
+
+typedef struct {
+	int team;
+} Team;
+
+ECS_DECL_COMP(Health);
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Fire);
+ECS_DECL_COMP(Team);
+
+static EcsWorld *world;
+static Entity ents[ENTITY_COUNT];
+
+/* what a gather should give for the entity */
+static bool expected(Entity ent, EcsComponent comp, void *out, size_t size)
+{
+	void *data = ecs_isValid(world, ent) ?
+		ecs_getComponent(world, ent, comp) : NULL;
+	for (size_t b = 0; b < size; b++)
+		((uint8_t*)out)[b] = data ? ((uint8_t*)data)[b] : 0;
+	return data;
+}
+
+static void checkGather(const Entity *list, EcsComponent comp, size_t size)
+{
+	static uint8_t out[LIST_SIZE * 16];
+	static uint8_t want[16];
+	int count = ecs_gatherComponent(world, list, LIST_SIZE, comp, out);
+
+	int wantCount = 0;
+	for (int i = 0; i < LIST_SIZE; i++) {
+		wantCount += expected(list[i], comp, want, size);
+		for (size_t b = 0; b < size; b++)
+			assert(out[i * size + b] == want[b]);
+	}
+	assert(count == wantCount);
+}
+
+static void makeList(Entity *list)
+{
+	for (int i = 0; i < LIST_SIZE; i++)
+		list[i] = ents[rand() % ENTITY_COUNT];
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Health);
+	ECS_REG_COMP(Pos);
+	ECS_REG_SPARSE_COMP(Fire);
+	ECS_REG_SHARED_COMP(Team);
+
+	world = ecs_createWorld();
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntity(world);
+		if (i % 7)
+			*ECS_ADD_COMPONENT(world, ents[i], Health) =
+				(Health){ i, -i };
+		if (i % 2) ECS_ADD_COMPONENT(world, ents[i], Pos)->x = i;
+		if (i % 3 == 0) ECS_ADD_COMPONENT(world, ents[i], Fire)->burning = i;
+		ecs_setShared(world, ents[i], ECS_ID(Team), &(Team){ i % 4 });
+	}
+	for (int i = 0; i < ENTITY_COUNT; i += 11) ecs_destroy(world, ents[i]);
+
+	static Entity list[LIST_SIZE];
+	static Health values[LIST_SIZE];
+	for (int l = 0; l < LIST_COUNT; l++) {
+		makeList(list);
+		if (l % 2) ecs_sortEntities(world, list, LIST_SIZE);
+		checkGather(list, ECS_ID(Health), sizeof(Health));
+		checkGather(list, ECS_ID(Pos), sizeof(Pos));
+		checkGather(list, ECS_ID(Fire), sizeof(Fire));
+		checkGather(list, ECS_ID(Team), sizeof(Team));
+
+		//scatter back modified values, duplicates get the last one
+		ecs_gatherComponent(world, list, LIST_SIZE, ECS_ID(Health), values);
+		int had = 0;
+		for (int i = 0; i < LIST_SIZE; i++) {
+			values[i].armor = l;
+			values[i].hp = i;
+			had += ecs_isValid(world, list[i]) &&
+			       ECS_GET_COMPONENT(world, list[i], Health);
+		}
+		int count = ecs_scatterComponent(world, list, LIST_SIZE,
+						 ECS_ID(Health), values);
+		assert(count == had);
+		for (int i = 0; i < LIST_SIZE; i++) {
+			if (!ecs_isValid(world, list[i])) continue;
+			Health *h = ECS_GET_COMPONENT(world, list[i], Health);
+			if (!h) continue;
+			int last = i;
+			for (int j = i + 1; j < LIST_SIZE; j++)
+				if (list[j] == list[i]) last = j;
+			assert(h->hp == last && h->armor == l);
+		}
+	}
+
+	//sorting puts the dead entities last
+	makeList(list);
+	ecs_sortEntities(world, list, LIST_SIZE);
+	bool dead = false;
+	for (int i = 0; i < LIST_SIZE; i++) {
+		if (!ecs_isValid(world, list[i])) dead = true;
+		else assert(!dead);
+	}
+
+	//staged values are gathered in deferred mode
+	Entity ent = ents[1];
+	ecs_deferBegin(world);
+	ECS_ADD_COMPONENT(world, ent, Fire)->burning = 5;
+	Fire fire;
+	assert(ecs_gatherComponent(world, &ent, 1, ECS_ID(Fire), &fire) == 1);
+	assert(fire.burning == 5);
+	ecs_deferEnd(world);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*
+  This test unit groups the rows of a query by a key field while the keys
+  are rewritten and entities move, die or get disabled, and checks every
+  group and the sorted key list against the expected keys
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 250 //fits in one archetype
+#define STEP_COUNT 2000
+#define KEY_COUNT 12
+
+typedef struct {
+	float x;
+	float y;
+	uint8_t layer;
+	int team;
+} Sprite;
+
+typedef struct {
+	int dx;
+} Vel;
+
+typedef struct {
+	uint16_t tint;
+} Material;
+
+ECS_DECL_COMP(Sprite);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Material);
+
+static EcsWorld *world;
+static Entity ents[ENTITY_COUNT];
+static int layers[ENTITY_COUNT]; //-1 if not visited by the query
+
+static void checkGroups(EcsQuery *q)
+{
+	int expected[KEY_COUNT] = {0};
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		if (layers[i] >= 0) expected[layers[i]]++;
+
+	uint64_t keys[KEY_COUNT];
+	int keyCount = ecs_queryGroupKeys(world, q, keys, KEY_COUNT);
+	int k = 0;
+	for (int key = 0; key < KEY_COUNT; key++) {
+		if (!expected[key]) continue;
+		assert(k < keyCount && keys[k++] == (uint64_t)key);
+
+		int count = 0;
+		EcsIter it = ecs_queryIterGroup(world, q, key);
+		while (ecs_iterNext(&it)) {
+			assert(((Sprite*)it.includes[0])->layer == key);
+			count++;
+		}
+		assert(count == expected[key]);
+	}
+	assert(k == keyCount);
+}
+
+static void testRandom(void)
+{
+	Archetype *still = ECS_REG_ARCH(world, Sprite);
+	Archetype *moving = ECS_REG_ARCH(world, Sprite, Vel);
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntityInArch(world, i % 3 ? still : moving);
+		layers[i] = rand() % KEY_COUNT;
+		ECS_GET_COMPONENT(world, ents[i], Sprite)->layer = layers[i];
+	}
+
+	EcsQuery *q = ECS_QUERY(world, ECS_ACCESS(include, Sprite),
+				ECS_GROUP_BY(Sprite, layer));
+	checkGroups(q);
+
+	for (int step = 0; step < STEP_COUNT; step++) {
+		int i = rand() % ENTITY_COUNT;
+		if (layers[i] < 0) continue;
+
+		int op = rand() % 10;
+		if (op < 6) {
+			layers[i] = rand() % KEY_COUNT;
+			ECS_GET_COMPONENT(world, ents[i], Sprite)->layer = layers[i];
+		} else if (op < 8) {
+			if (ECS_GET_COMPONENT(world, ents[i], Vel))
+				ecs_removeComponent(world, ents[i], ECS_ID(Vel));
+			else
+				ECS_ADD_COMPONENT(world, ents[i], Vel)->dx = 1;
+		} else if (op < 9) {
+			ecs_setEnabled(world, ents[i], false);
+			layers[i] = -1;
+		} else {
+			ecs_destroy(world, ents[i]);
+			layers[i] = -1;
+		}
+		//mostly unchanged orders, then many writes between checks
+		if (step % (step < STEP_COUNT / 2 ? 7 : 97) == 0) checkGroups(q);
+		if (step % 100 == 0) ecs_progressTick(world);
+	}
+	checkGroups(q);
+}
+
+static void testKeys(void)
+{
+	Archetype *arch = ECS_REG_ARCH(world, Sprite, Material);
+	Entity ent = ecs_newEntityInArch(world, arch);
+	ECS_GET_COMPONENT(world, ent, Sprite)->team = -5;
+
+	//keys are the unsigned value of the field
+	EcsQuery *teams = ECS_QUERY(world, ECS_ACCESS(include, Sprite, Material),
+				    ECS_GROUP_BY(Sprite, team));
+	EcsIter it = ecs_queryIterGroup(world, teams, (uint32_t)-5);
+	assert(ecs_iterNext(&it) && it.entity == ent);
+	assert(!ecs_iterNext(&it));
+
+	//shared keys group whole archetypes
+	Material red = { .tint = 3 };
+	ecs_setShared(world, ent, ECS_ID(Material), &red);
+	EcsQuery *tints = ECS_QUERY(world, ECS_ACCESS(include, Sprite, Material),
+				    ECS_GROUP_BY(Material, tint));
+	it = ecs_queryIterGroup(world, tints, 3);
+	assert(ecs_iterNext(&it) && it.entity == ent);
+	assert(!ecs_iterNext(&it));
+
+	//an ungrouped query has no groups
+	EcsQuery *plain = ECS_QUERY(world, ECS_ACCESS(include, Sprite));
+	it = ecs_queryIterGroup(world, plain, 0);
+	assert(!ecs_iterNext(&it));
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Sprite);
+	ECS_REG_COMP(Vel);
+	ECS_REG_SHARED_COMP(Material);
+
+	world = ecs_createWorld();
+
+	testRandom();
+	testKeys();
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
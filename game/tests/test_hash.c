@@ -0,0 +1,174 @@
+/*
+  This test unit writes, moves, retags and replaces random entities
+  every tick, hashing the world each time so the archetype hashes are
+  reused, and checks the cached hash against the hash of a fresh world
+  holding the same state but built in another order
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 100
+#define TICK_COUNT 200
+#define STEP_COUNT 10
+#define CHECK_TICKS 10
+#define MAX_LOG (ENTITY_COUNT + TICK_COUNT * STEP_COUNT)
+
+typedef struct {
+	int x;
+} Pos;
+
+typedef struct {
+	int v;
+} Vel;
+
+typedef struct {
+	int team;
+} Team;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Team);
+ECS_DECL_COMP(Dead); //tag
+
+static EcsWorld *world;
+static Entity ents[ENTITY_COUNT];
+static int pos[ENTITY_COUNT];
+static int vel[ENTITY_COUNT]; //0 if not added
+static int team[ENTITY_COUNT];
+static bool dead[ENTITY_COUNT];
+
+//the creations (slot) and destructions (-slot - 1), handles follow them
+static int logged[MAX_LOG];
+static int logCount;
+
+static void spawn(int i)
+{
+	ents[i] = ecs_newEntity(world);
+	logged[logCount++] = i;
+	pos[i] = rand() % 10000 + 1;
+	vel[i] = 0;
+	team[i] = rand() % 3;
+	dead[i] = false;
+	ECS_ADD_COMPONENT(world, ents[i], Pos)->x = pos[i];
+	ecs_setShared(world, ents[i], ECS_ID(Team), &(Team){ team[i] });
+}
+
+/* the same handles and values, components added in the reverse order */
+static EcsWorld *rebuild(void)
+{
+	EcsWorld *w = ecs_createWorld();
+	Entity made[ENTITY_COUNT];
+	for (int l = 0; l < logCount; l++) {
+		if (logged[l] >= 0) made[logged[l]] = ecs_newEntity(w);
+		else ecs_destroy(w, made[-logged[l] - 1]);
+	}
+	for (int i = ENTITY_COUNT - 1; i >= 0; i--) {
+		assert(made[i] == ents[i]);
+		if (dead[i]) ecs_addComponent(w, made[i], ECS_ID(Dead));
+		ecs_setShared(w, made[i], ECS_ID(Team), &(Team){ team[i] });
+		if (vel[i]) ECS_ADD_COMPONENT(w, made[i], Vel)->v = vel[i];
+		ECS_ADD_COMPONENT(w, made[i], Pos)->x = pos[i];
+	}
+	return w;
+}
+
+static void check(void)
+{
+	EcsWorld *fresh = rebuild();
+	assert(ECS_HASH_STATE(world, Pos, Vel, Team, Dead) ==
+	       ECS_HASH_STATE(fresh, Pos, Vel, Team, Dead));
+	assert(ECS_HASH_STATE(world, Vel) == ECS_HASH_STATE(fresh, Vel));
+	ecs_destroyWorld(fresh);
+}
+
+static void step(EcsQuery *writer, EcsQuery *reader)
+{
+	EcsIter it = ecs_queryIter(world, writer);
+	while (ecs_iterNext(&it)) ((Vel*)it.includes[0])->v++;
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		if (vel[i]) vel[i]++;
+
+	//reading leaves the cached hashes valid
+	int count = 0;
+	it = ecs_queryIter(world, reader);
+	while (ecs_iterNext(&it)) count += ((Pos*)it.includes[0])->x != 0;
+	assert(count <= ENTITY_COUNT);
+
+	for (int s = 0; s < STEP_COUNT; s++) {
+		int i = rand() % ENTITY_COUNT;
+		int op = rand() % 10;
+		if (op < 1) {
+			ecs_destroy(world, ents[i]);
+			logged[logCount++] = -i - 1;
+			spawn(i);
+		} else if (op < 3) {
+			if (vel[i]) {
+				ecs_removeComponent(world, ents[i], ECS_ID(Vel));
+				vel[i] = 0;
+			} else {
+				vel[i] = rand() % 100 + 1;
+				ECS_ADD_COMPONENT(world, ents[i], Vel)->v = vel[i];
+			}
+		} else if (op < 4) {
+			if (dead[i])
+				ecs_removeComponent(world, ents[i], ECS_ID(Dead));
+			else
+				ecs_addComponent(world, ents[i], ECS_ID(Dead));
+			dead[i] = !dead[i];
+		} else if (op < 5) {
+			team[i] = rand() % 3;
+			ecs_setShared(world, ents[i], ECS_ID(Team),
+				      &(Team){ team[i] });
+		} else {
+			pos[i] = rand() % 10000 + 1;
+			ECS_GET_COMPONENT(world, ents[i], Pos)->x = pos[i];
+		}
+	}
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Vel);
+	ECS_REG_SHARED_COMP(Team);
+	ECS_REG_TAG(Dead);
+
+	world = ecs_createWorld();
+	EcsQuery *writer = ECS_QUERY(world, ECS_ACCESS(include, Vel),
+				     ECS_ACCESS(write, Vel));
+	EcsQuery *reader = ECS_QUERY(world, ECS_ACCESS(include, Pos));
+	for (int i = 0; i < ENTITY_COUNT; i++) spawn(i);
+	check();
+
+	for (int t = 0; t < TICK_COUNT; t++) {
+		step(writer, reader);
+		ECS_HASH_STATE(world, Pos, Vel, Team, Dead);
+		if (t % CHECK_TICKS == 0) check();
+		ecs_progressTick(world);
+	}
+	check();
+
+	//a single different value changes the hash, restoring it gives it back
+	uint64_t hash = ECS_HASH_STATE(world, Pos, Vel, Team, Dead);
+	ECS_GET_COMPONENT(world, ents[0], Pos)->x++;
+	assert(ECS_HASH_STATE(world, Pos, Vel, Team, Dead) != hash);
+	ECS_GET_COMPONENT(world, ents[0], Pos)->x--;
+	assert(ECS_HASH_STATE(world, Pos, Vel, Team, Dead) == hash);
+	ecs_setShared(world, ents[0], ECS_ID(Team), &(Team){ 7 });
+	assert(ECS_HASH_STATE(world, Pos, Vel, Team, Dead) != hash);
+	ecs_setShared(world, ents[0], ECS_ID(Team), &(Team){ team[0] });
+	assert(ECS_HASH_STATE(world, Pos, Vel, Team, Dead) == hash);
+
+	//the hashed components are part of it
+	assert(ECS_HASH_STATE(world, Pos, Vel, Team) != hash);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
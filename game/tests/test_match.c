@@ -0,0 +1,122 @@
+/*
+  This test unit makes random queries before, between and after the
+  archetypes they match are created and checks their rows against the
+  components each entity actually has
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define TAG_COUNT 6
+#define ENTITY_COUNT 400
+#define QUERY_COUNT 40
+
+typedef struct {
+	int id;
+} Val;
+
+ECS_DECL_COMP(Val);
+
+typedef struct {
+	EcsQuery *query;
+	EcsComponent include[3];
+	int includeCount;
+	EcsComponent exclude[2];
+	int excludeCount;
+} TestQuery;
+
+static EcsWorld *world;
+static EcsComponent tags[TAG_COUNT];
+static Entity ents[ENTITY_COUNT];
+static int entCount = 0;
+static TestQuery queries[QUERY_COUNT];
+static int queryCount = 0;
+
+static void makeQuery(void)
+{
+	TestQuery *t = &queries[queryCount++];
+	t->includeCount = rand() % 3;
+	t->excludeCount = rand() % 2;
+	for (int i = 0; i < t->includeCount; i++)
+		t->include[i] = tags[rand() % TAG_COUNT];
+	//every query reads the values, some only through Val
+	t->include[t->includeCount++] = ECS_ID(Val);
+	for (int i = 0; i < t->excludeCount; i++)
+		t->exclude[i] = tags[rand() % TAG_COUNT];
+
+	t->query = ecs_makeQuery(world, (EcsQueryDesc){
+		.include = t->include,
+		.includeCount = t->includeCount,
+		.exclude = t->exclude,
+		.excludeCount = t->excludeCount,
+	});
+}
+
+static bool matches(const TestQuery *t, Entity ent)
+{
+	for (int i = 0; i < t->includeCount; i++)
+		if (!ecs_hasComponent(world, ent, t->include[i])) return false;
+	for (int i = 0; i < t->excludeCount; i++)
+		if (ecs_hasComponent(world, ent, t->exclude[i])) return false;
+	return true;
+}
+
+static void check(void)
+{
+	for (int q = 0; q < queryCount; q++) {
+		TestQuery *t = &queries[q];
+		int expected = 0;
+		for (int i = 0; i < entCount; i++) expected += matches(t, ents[i]);
+
+		int count = 0;
+		EcsIter it = ecs_queryIter(world, t->query);
+		while (ecs_iterNext(&it)) {
+			int id = ((Val*)it.includes[t->includeCount - 1])->id;
+			assert(ents[id] == it.entity);
+			assert(matches(t, it.entity));
+			count++;
+		}
+		assert(count == expected);
+	}
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Val);
+	for (int i = 0; i < TAG_COUNT; i++)
+		tags[i] = ecs_registerComponent(0, 1);
+
+	world = ecs_createWorld();
+	for (int q = 0; q < QUERY_COUNT / 2; q++) makeQuery();
+
+	while (entCount < ENTITY_COUNT) {
+		Entity ent = ecs_newEntity(world);
+		ECS_ADD_COMPONENT(world, ent, Val)->id = entCount;
+		int mask = rand() % (1 << TAG_COUNT);
+		for (int b = 0; b < TAG_COUNT; b++)
+			if (mask >> b & 1) ecs_addComponent(world, ent, tags[b]);
+		ents[entCount++] = ent;
+
+		if (entCount % 20 == 0) {
+			if (queryCount < QUERY_COUNT) makeQuery();
+			check();
+		}
+	}
+	check();
+
+	//a query including nothing matches every archetype
+	EcsQuery *all = ecs_makeQuery(world, (EcsQueryDesc){0});
+	int count = 0;
+	EcsIter it = ecs_queryIter(world, all);
+	while (ecs_iterNext(&it)) count++;
+	assert(count == ENTITY_COUNT);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
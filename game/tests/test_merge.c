@@ -0,0 +1,227 @@
+/*
+  This test unit builds worlds of random entities linking each other
+  through table, sparse and shared entity fields, merges them into a
+  populated world and checks every value and remapped link, that the
+  merged world is left empty and that a merge lacking room changes
+  neither world
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define DST_COUNT 50
+#define SRC_COUNT 100
+#define ROUND_COUNT 5
+#define MAX_COUNT (DST_COUNT + SRC_COUNT * ROUND_COUNT)
+#define LEADER_COUNT 3
+#define ARCH_ROWS 256 //MAX_ARCH_ENTITY of the ecs
+
+typedef struct {
+	int x;
+} Pos;
+
+typedef struct {
+	int n;
+	Entity target;
+} Link;
+
+typedef struct {
+	Entity ent;
+} Target;
+
+typedef struct {
+	Entity leader;
+} Squad;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Link);
+ECS_DECL_COMP(Target);
+ECS_DECL_COMP(Squad);
+
+//what an entity of the destination should hold, 0 handles pointed out
+typedef struct {
+	Entity ent;
+	int x;
+	bool hasLink;
+	Link link;
+	bool hasTarget;
+	Entity target;
+	bool hasLeader;
+	Entity leader;
+} Expected;
+
+static EcsWorld *dst;
+static EcsWorld *src;
+static Expected expected[MAX_COUNT];
+static int expectedCount;
+
+//a source entity linked to: another source entity, or -1 for a dead one
+typedef struct {
+	Entity ent;
+	int link; //-2 if not added
+	int target; //-2 if not added
+	int leader; //-2 if not added
+} Made;
+
+static Made made[SRC_COUNT];
+static Entity dead;
+
+static int pickLink(void)
+{
+	return rand() % 4 ? rand() % SRC_COUNT : -1;
+}
+
+static Entity linked(int link)
+{
+	return link >= 0 ? made[link].ent : dead;
+}
+
+static void buildSource(int round)
+{
+	dead = ecs_newEntity(src);
+	ECS_ADD_COMPONENT(src, dead, Pos)->x = -1;
+	for (int i = 0; i < SRC_COUNT; i++) {
+		made[i].ent = ecs_newEntity(src);
+		ECS_ADD_COMPONENT(src, made[i].ent, Pos)->x =
+			round * SRC_COUNT + i;
+	}
+	ecs_destroy(src, dead);
+
+	//links are set once every handle is known
+	for (int i = 0; i < SRC_COUNT; i++) {
+		Entity ent = made[i].ent;
+		made[i].link = rand() % 2 ? pickLink() : -2;
+		made[i].target = rand() % 3 == 0 ? pickLink() : -2;
+		made[i].leader = rand() % 2 ?
+			(rand() % 4 ? rand() % LEADER_COUNT : -1) : -2;
+		if (made[i].link != -2)
+			*ECS_ADD_COMPONENT(src, ent, Link) =
+				(Link){ i, linked(made[i].link) };
+		if (made[i].target != -2)
+			ECS_ADD_COMPONENT(src, ent, Target)->ent =
+				linked(made[i].target);
+		if (made[i].leader != -2)
+			ecs_setShared(src, ent, ECS_ID(Squad),
+				      &(Squad){ linked(made[i].leader) });
+	}
+}
+
+static Entity remapped(int link)
+{
+	return link >= 0 ? ecs_mergedEntity(src, made[link].ent) : 0;
+}
+
+static void expectMerged(int round)
+{
+	assert(!ecs_mergedEntity(src, dead));
+	for (int i = 0; i < SRC_COUNT; i++) {
+		Expected *e = &expected[expectedCount++];
+		e->ent = ecs_mergedEntity(src, made[i].ent);
+		assert(e->ent);
+		assert(!ecs_isValid(src, made[i].ent));
+		e->x = round * SRC_COUNT + i;
+		e->hasLink = made[i].link != -2;
+		e->link = (Link){ i, e->hasLink ? remapped(made[i].link) : 0 };
+		e->hasTarget = made[i].target != -2;
+		e->target = e->hasTarget ? remapped(made[i].target) : 0;
+		e->hasLeader = made[i].leader != -2;
+		e->leader = e->hasLeader ? remapped(made[i].leader) : 0;
+	}
+}
+
+static void check(void)
+{
+	for (int i = 0; i < expectedCount; i++) {
+		Expected *e = &expected[i];
+		assert(ecs_isValid(dst, e->ent));
+		assert(ECS_GET_COMPONENT(dst, e->ent, Pos)->x == e->x);
+		Link *link = ECS_GET_COMPONENT(dst, e->ent, Link);
+		assert(!link == !e->hasLink);
+		if (link) {
+			assert(link->n == e->link.n);
+			assert(link->target == e->link.target);
+		}
+		Target *target = ECS_GET_COMPONENT(dst, e->ent, Target);
+		assert(!target == !e->hasTarget);
+		if (target) assert(target->ent == e->target);
+		Squad *squad = ECS_GET_COMPONENT(dst, e->ent, Squad);
+		assert(!squad == !e->hasLeader);
+		if (squad) assert(squad->leader == e->leader);
+	}
+}
+
+/* nothing is left in the source */
+static int sourceRows(EcsQuery *q)
+{
+	int rows = 0;
+	EcsIter it = ecs_queryIter(src, q);
+	while (ecs_iterNext(&it)) rows++;
+	return rows;
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Link);
+	ECS_REG_SPARSE_COMP(Target);
+	ECS_REG_SHARED_COMP(Squad);
+	ECS_ENTITY_FIELD(Link, target);
+	ECS_ENTITY_FIELD(Target, ent);
+	ECS_ENTITY_FIELD(Squad, leader);
+
+	dst = ecs_createWorld();
+	src = ecs_createWorld();
+	EcsQuery *all = ECS_QUERY(src, ECS_ACCESS(include, Pos));
+
+	for (int i = 0; i < DST_COUNT; i++) {
+		Expected *e = &expected[expectedCount++];
+		*e = (Expected){ .ent = ecs_newEntity(dst), .x = -i - 2 };
+		ECS_ADD_COMPONENT(dst, e->ent, Pos)->x = e->x;
+	}
+
+	for (int round = 0; round < ROUND_COUNT; round++) {
+		buildSource(round);
+		assert(ecs_merge(dst, src));
+		expectMerged(round);
+		assert(sourceRows(all) == 0);
+		check();
+		ecs_progressTick(dst);
+		ecs_progressTick(src);
+	}
+
+	//the rows of the only Pos archetype run out, nothing moves
+	int rows = 0;
+	for (int i = 0; i < expectedCount; i++)
+		rows += ecs_getEntityArch(dst, expected[i].ent) ==
+			ecs_getEntityArch(dst, expected[0].ent);
+	Entity full[ARCH_ROWS];
+	for (int i = 0; i < ARCH_ROWS - rows + 1; i++) {
+		full[i] = ecs_newEntity(src);
+		ECS_ADD_COMPONENT(src, full[i], Pos)->x = i;
+	}
+	uint64_t dstHash = ECS_HASH_STATE(dst, Pos, Link, Squad);
+	uint64_t srcHash = ECS_HASH_STATE(src, Pos, Link, Squad);
+	assert(!ecs_merge(dst, src));
+	assert(ECS_HASH_STATE(dst, Pos, Link, Squad) == dstHash);
+	assert(ECS_HASH_STATE(src, Pos, Link, Squad) == srcHash);
+	for (int i = 0; i < ARCH_ROWS - rows + 1; i++) {
+		assert(ecs_isValid(src, full[i]));
+		assert(ECS_GET_COMPONENT(src, full[i], Pos)->x == i);
+	}
+	check();
+
+	//not while deferred
+	ecs_deferBegin(dst);
+	assert(!ecs_merge(dst, src));
+	ecs_deferEnd(dst);
+
+	ecs_destroyWorld(dst);
+	ecs_destroyWorld(src);
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+  This test unit moves entities between many archetypes of components
+  of various sizes and destroys them at random, and checks that every
+  byte of every component survives the moves and swap-removes
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define COMP_COUNT 8
+#define ENTITY_COUNT 60
+#define STEP_COUNT 5000
+
+//covers the sizes copied with a constant size and the others
+static const size_t sizes[COMP_COUNT] = { 1, 2, 3, 4, 8, 12, 16, 40 };
+
+static EcsWorld *world;
+static EcsComponent comps[COMP_COUNT];
+static Entity ents[ENTITY_COUNT];
+static uint8_t seeds[ENTITY_COUNT][COMP_COUNT]; //0 if not added
+
+static void fill(int i, int c)
+{
+	uint8_t *data = ecs_addComponent(world, ents[i], comps[c]);
+	for (size_t b = 0; b < sizes[c]; b++) data[b] = seeds[i][c] + b;
+}
+
+static void check(int i)
+{
+	for (int c = 0; c < COMP_COUNT; c++) {
+		uint8_t *data = ecs_getComponent(world, ents[i], comps[c]);
+		assert(!data == !seeds[i][c]);
+		for (size_t b = 0; data && b < sizes[c]; b++)
+			assert(data[b] == (uint8_t)(seeds[i][c] + b));
+	}
+}
+
+static void spawn(int i)
+{
+	ents[i] = ecs_newEntity(world);
+	for (int c = 0; c < COMP_COUNT; c++) {
+		seeds[i][c] = rand() % 2 ? rand() % 255 + 1 : 0;
+		if (seeds[i][c]) fill(i, c);
+	}
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	for (int c = 0; c < COMP_COUNT; c++)
+		comps[c] = ecs_registerComponent(sizes[c], 1);
+
+	//more masks than archetype slots, plans of collected targets go stale
+	world = ecs_createWorld();
+	ecs_setArchetypeIdleTicks(world, 1);
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		spawn(i);
+		ecs_progressTick(world);
+	}
+
+	for (int step = 0; step < STEP_COUNT; step++) {
+		int i = rand() % ENTITY_COUNT;
+		int c = rand() % COMP_COUNT;
+		int op = rand() % 10;
+		if (op < 4) {
+			seeds[i][c] = rand() % 255 + 1;
+			fill(i, c);
+		} else if (op < 8) {
+			ecs_removeComponent(world, ents[i], comps[c]);
+			seeds[i][c] = 0;
+		} else if (op < 9) {
+			//deferred moves use the same plans
+			ecs_deferBegin(world);
+			ecs_removeComponent(world, ents[i], comps[c]);
+			seeds[i][c] = 0;
+			int other = (c + 1) % COMP_COUNT;
+			seeds[i][other] = rand() % 255 + 1;
+			fill(i, other);
+			ecs_deferEnd(world);
+		} else {
+			ecs_destroy(world, ents[i]);
+			spawn(i);
+		}
+		ecs_progressTick(world);
+		if (step % 100 == 0)
+			for (int j = 0; j < ENTITY_COUNT; j++) check(j);
+	}
+	for (int i = 0; i < ENTITY_COUNT; i++) check(i);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
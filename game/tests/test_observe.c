@@ -0,0 +1,180 @@
+/*
+  This test unit flushes random batches of commands with observers
+  registered and checks that every entity which gained or lost a table,
+  sparse or tag component is reported once, and nothing else
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 150
+#define ROUND_COUNT 100
+#define COMMAND_COUNT 60
+#define MAX_INDEX 1024
+
+typedef struct {
+	int hp;
+} Health;
+
+typedef struct {
+	int burning;
+} Fire;
+
+typedef struct {
+	int dx;
+} Vel;
+
+ECS_DECL_COMP(Health);
+ECS_DECL_COMP(Fire);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Dead); //tag
+
+#define COMP_COUNT 3
+
+static EcsWorld *world;
+static EcsComponent comps[COMP_COUNT];
+static Entity ents[ENTITY_COUNT];
+static bool had[ENTITY_COUNT][COMP_COUNT]; //before the flush
+
+//events seen by entity index, for ECS_ON_ADD and ECS_ON_REMOVE
+static int seen[2][COMP_COUNT][MAX_INDEX];
+static Entity seenEnt[MAX_INDEX];
+static int sets;
+static int movingAdds;
+
+static void observe(EcsWorld *w, Archetype *arch, const Entity *list,
+		    int count, void *ctx)
+{
+	int event = (int)((intptr_t)ctx / COMP_COUNT);
+	int c = (int)((intptr_t)ctx % COMP_COUNT);
+	for (int i = 0; i < count; i++) {
+		uint32_t index = ECS_ENTITY_INDEX(list[i]);
+		seen[event][c][index]++;
+		seenEnt[index] = list[i];
+		if (event == ECS_ON_ADD) {
+			assert(ecs_getEntityArch(w, list[i]) == arch);
+			assert(ecs_hasComponent(w, list[i], comps[c]));
+		} else if (ecs_isValid(w, list[i])) {
+			assert(!ecs_hasComponent(w, list[i], comps[c]));
+		}
+	}
+}
+
+static void onSet(EcsWorld *w, Archetype *arch, const Entity *list,
+		  int count, void *ctx)
+{
+	(void)arch;
+	(void)ctx;
+	for (int i = 0; i < count; i++)
+		assert(ECS_GET_COMPONENT(w, list[i], Health)->hp == 42);
+	sets += count;
+}
+
+static void onMovingAdd(EcsWorld *w, Archetype *arch, const Entity *list,
+			int count, void *ctx)
+{
+	(void)arch;
+	(void)ctx;
+	for (int i = 0; i < count; i++)
+		assert(ECS_GET_COMPONENT(w, list[i], Vel));
+	movingAdds += count;
+
+	//a flush from an observer is allowed
+	ecs_deferBegin(w);
+	ecs_deferEnd(w);
+}
+
+static void runRound(void)
+{
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		for (int c = 0; c < COMP_COUNT; c++)
+			had[i][c] = ecs_hasComponent(world, ents[i], comps[c]);
+	memset(seen, 0, sizeof(seen));
+
+	Entity old[ENTITY_COUNT];
+	memcpy(old, ents, sizeof(ents));
+
+	ecs_deferBegin(world);
+	for (int k = 0; k < COMMAND_COUNT; k++) {
+		int i = rand() % ENTITY_COUNT;
+		int c = rand() % COMP_COUNT;
+		int op = rand() % 10;
+		if (op < 5) ecs_addComponent(world, ents[i], comps[c]);
+		else if (op < 9) ecs_removeComponent(world, ents[i], comps[c]);
+		else ecs_destroy(world, ents[i]);
+	}
+	ecs_deferEnd(world);
+
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		uint32_t index = ECS_ENTITY_INDEX(old[i]);
+		bool alive = ecs_isValid(world, old[i]);
+		for (int c = 0; c < COMP_COUNT; c++) {
+			bool has = alive && ecs_hasComponent(world, old[i], comps[c]);
+			assert(seen[ECS_ON_ADD][c][index] == (!had[i][c] && has));
+			assert(seen[ECS_ON_REMOVE][c][index] == (had[i][c] && !has));
+			if (seen[ECS_ON_ADD][c][index] || seen[ECS_ON_REMOVE][c][index])
+				assert(seenEnt[index] == old[i]);
+		}
+		if (!alive) ents[i] = ecs_newEntity(world);
+	}
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Health);
+	ECS_REG_SPARSE_COMP(Fire);
+	ECS_REG_COMP(Vel);
+	ECS_REG_TAG(Dead);
+	comps[0] = ECS_ID(Health);
+	comps[1] = ECS_ID(Fire);
+	comps[2] = ECS_ID(Dead);
+
+	world = ecs_createWorld();
+	for (int event = ECS_ON_ADD; event <= ECS_ON_REMOVE; event++) {
+		for (int c = 0; c < COMP_COUNT; c++) {
+			ecs_observe(world, (EcsObserverDesc){
+				.event = event,
+				.comp = comps[c],
+				.callback = observe,
+				.ctx = (void*)(intptr_t)(event * COMP_COUNT + c),
+			});
+		}
+	}
+	for (int i = 0; i < ENTITY_COUNT; i++) ents[i] = ecs_newEntity(world);
+
+	for (int r = 0; r < ROUND_COUNT; r++) runRound();
+
+	//written values and query filtered observers
+	EcsQuery *moving = ECS_QUERY(world, ECS_ACCESS(include, Vel));
+	ecs_observe(world, (EcsObserverDesc){ ECS_ON_SET, ECS_ID(Health), NULL,
+					      onSet, NULL });
+	ecs_observe(world, (EcsObserverDesc){ ECS_ON_ADD, ECS_ID(Health),
+					      moving, onMovingAdd, NULL });
+	Entity made[50];
+	ecs_deferBegin(world);
+	for (int i = 0; i < 50; i++) {
+		made[i] = ecs_newEntity(world);
+		ECS_ADD_COMPONENT(world, made[i], Health)->hp = 42;
+		if (i % 2) ECS_ADD_COMPONENT(world, made[i], Vel)->dx = 1;
+	}
+	ecs_deferEnd(world);
+	assert(sets == 50);
+	assert(movingAdds == 25);
+
+	//immediate changes are not observed
+	Entity lone = ecs_newEntity(world);
+	ECS_ADD_COMPONENT(world, lone, Health)->hp = 1;
+	ECS_ADD_COMPONENT(world, lone, Vel)->dx = 1;
+	assert(sets == 50);
+	assert(movingAdds == 25);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*
+  This test unit instantiates prefabs in and out of deferred mode and
+  checks that every instance starts from the defaults, in the prefab's
+  archetype, without touching the rows already there
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+
+#define INSTANCE_COUNT 150
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int hp;
+	char pad[5]; //odd sized rows
+} Health;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Health);
+ECS_DECL_COMP(Enemy); //tag
+
+static void checkInstance(EcsWorld *w, Entity ent, Archetype *arch)
+{
+	assert(ecs_isValid(w, ent));
+	assert(ecs_getEntityArch(w, ent) == arch);
+	assert(ECS_GET_COMPONENT(w, ent, Pos)->x == 7);
+	assert(ECS_GET_COMPONENT(w, ent, Pos)->y == -1);
+	assert(ECS_GET_COMPONENT(w, ent, Health)->hp == 100);
+	assert(ECS_GET_COMPONENT(w, ent, Health)->pad[4] == 'z');
+	assert(ecs_hasComponent(w, ent, ECS_ID(Enemy)));
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Health);
+	ECS_REG_TAG(Enemy);
+
+	EcsWorld *w = ecs_createWorld();
+	Archetype *arch = ECS_REG_ARCH(w, Pos, Health, Enemy);
+	EcsPrefab *prefab = ecs_makePrefab(w, arch);
+	assert(((Health*)ecs_getPrefabComponent(prefab, ECS_ID(Health)))->hp == 0);
+	*(Pos*)ecs_getPrefabComponent(prefab, ECS_ID(Pos)) = (Pos){ 7, -1 };
+	Health *health = ecs_getPrefabComponent(prefab, ECS_ID(Health));
+	health->hp = 100;
+	health->pad[4] = 'z';
+
+	Entity before = ecs_newEntityInArch(w, arch);
+	ECS_GET_COMPONENT(w, before, Health)->hp = 1;
+
+	Entity ents[INSTANCE_COUNT];
+	ecs_instantiate(w, prefab, INSTANCE_COUNT, ents);
+	for (int i = 0; i < INSTANCE_COUNT; i++)
+		checkInstance(w, ents[i], arch);
+	assert(ECS_GET_COMPONENT(w, before, Health)->hp == 1);
+
+	//instances are independent of each other and of the prefab
+	ECS_GET_COMPONENT(w, ents[0], Health)->hp = 5;
+	assert(ECS_GET_COMPONENT(w, ents[1], Health)->hp == 100);
+	assert(health->hp == 100);
+
+	ecs_instantiate(w, prefab, 0, NULL);
+	ecs_instantiate(w, prefab, 1, NULL);
+
+	//deferred instances get the defaults unless written before the flush
+	health->hp = 50;
+	ecs_deferBegin(w);
+	Entity later[3];
+	ecs_instantiate(w, prefab, 3, later);
+	assert(!ecs_getEntityArch(w, later[0]));
+	assert(ECS_GET_COMPONENT(w, later[0], Health)->hp == 50);
+	ECS_GET_COMPONENT(w, later[1], Health)->hp = 9;
+	ecs_deferEnd(w);
+
+	assert(ECS_GET_COMPONENT(w, later[0], Health)->hp == 50);
+	assert(ECS_GET_COMPONENT(w, later[1], Health)->hp == 9);
+	assert(ECS_GET_COMPONENT(w, later[1], Health)->pad[4] == 'z');
+	assert(ECS_GET_COMPONENT(w, later[2], Pos)->x == 7);
+	assert(ecs_getEntityArch(w, later[2]) == arch);
+	assert(ECS_GET_COMPONENT(w, ents[1], Health)->hp == 100);
+
+	ecs_destroyWorld(w);
+
+	return 0;
+}
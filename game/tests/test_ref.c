@@ -0,0 +1,124 @@
+/*
+  This test unit keeps references to random entities while they move
+  between archetypes, die and get replaced, and checks that every
+  reference always gives the same address as ecs_getComponent
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 100
+#define STEP_COUNT 5000
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int v;
+} Vel;
+
+typedef struct {
+	int burning;
+} Fire;
+
+typedef struct {
+	int team;
+} Team;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Fire);
+ECS_DECL_COMP(Team);
+
+static EcsWorld *world;
+static Entity ents[ENTITY_COUNT];
+static EcsRef posRefs[ENTITY_COUNT];
+static EcsRef fireRefs[ENTITY_COUNT];
+static EcsRef teamRefs[ENTITY_COUNT];
+
+static void spawn(int i)
+{
+	ents[i] = ecs_newEntity(world);
+	ECS_ADD_COMPONENT(world, ents[i], Pos)->x = i;
+	posRefs[i] = ECS_REF(world, ents[i], Pos);
+	fireRefs[i] = ECS_REF(world, ents[i], Fire);
+	teamRefs[i] = ECS_REF(world, ents[i], Team);
+}
+
+static void check(int i)
+{
+	assert(ECS_REF_GET(world, &posRefs[i], Pos) ==
+	       ECS_GET_COMPONENT(world, ents[i], Pos));
+	assert(ECS_REF_GET(world, &fireRefs[i], Fire) ==
+	       ECS_GET_COMPONENT(world, ents[i], Fire));
+	assert(ECS_REF_GET(world, &teamRefs[i], Team) ==
+	       ECS_GET_COMPONENT(world, ents[i], Team));
+	Pos *p = ECS_REF_GET(world, &posRefs[i], Pos);
+	if (p) assert(p->x == i);
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Vel);
+	ECS_REG_SPARSE_COMP(Fire);
+	ECS_REG_SHARED_COMP(Team);
+
+	world = ecs_createWorld();
+	for (int i = 0; i < ENTITY_COUNT; i++) spawn(i);
+
+	for (int step = 0; step < STEP_COUNT; step++) {
+		int i = rand() % ENTITY_COUNT;
+		int op = rand() % 10;
+		if (op < 2) {
+			//moves the entity and the last row of its archetype
+			if (ECS_GET_COMPONENT(world, ents[i], Vel))
+				ecs_removeComponent(world, ents[i], ECS_ID(Vel));
+			else
+				ECS_ADD_COMPONENT(world, ents[i], Vel)->v = 1;
+		} else if (op < 4) {
+			if (ECS_GET_COMPONENT(world, ents[i], Fire))
+				ecs_removeComponent(world, ents[i], ECS_ID(Fire));
+			else
+				ECS_ADD_COMPONENT(world, ents[i], Fire)->burning = 1;
+		} else if (op < 5) {
+			Team team = { rand() % 3 };
+			ecs_setShared(world, ents[i], ECS_ID(Team), &team);
+		} else if (op < 6) {
+			//the reference of a dead entity gives NULL
+			ecs_destroy(world, ents[i]);
+			check(i);
+			spawn(i);
+		} else if (op < 7) {
+			ecs_removeComponent(world, ents[i], ECS_ID(Pos));
+			check(i);
+			ECS_ADD_COMPONENT(world, ents[i], Pos)->x = i;
+		} else {
+			Pos *p = ECS_REF_GET(world, &posRefs[i], Pos);
+			p->y += 1;
+		}
+		check(i);
+		if (step % 100 == 0)
+			for (int j = 0; j < ENTITY_COUNT; j++) check(j);
+	}
+
+	//in deferred mode references see the staged state
+	ecs_deferBegin(world);
+	ecs_removeComponent(world, ents[0], ECS_ID(Pos));
+	assert(!ECS_REF_GET(world, &posRefs[0], Pos));
+	Fire *fire = ECS_ADD_COMPONENT(world, ents[1], Fire);
+	assert(ECS_REF_GET(world, &fireRefs[1], Fire) == fire);
+	ecs_deferEnd(world);
+	for (int i = 0; i < ENTITY_COUNT; i++) check(i);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
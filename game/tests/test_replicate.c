@@ -0,0 +1,213 @@
+/*
+  This test unit replicates a randomly changing server world to two client
+  worlds through one encoder, with packets which may be lost or encoded
+  against an old ack, and checks that the clients end up with the same
+  values
+ */
+
+#include <ecs.h>
+#include <ecs_replicate.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define TICK_COUNT 400
+#define ACK_LAG 3 //packets in flight before the server sees an ack
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int hp;
+	short armor;
+} Health;
+
+//not replicated
+typedef struct {
+	int secret;
+} Local;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Health);
+ECS_DECL_COMP(Local);
+
+static EcsWorld *server;
+static Entity live[256];
+static int liveCount = 0;
+
+static void mutate(void)
+{
+	for (int k = 0; k < 4; k++) {
+		int r = rand() % 10;
+		if (r < 3 && liveCount < 200) {
+			Entity ent = ecs_newEntity(server);
+			ECS_ADD_COMPONENT(server, ent, Pos)->x = rand() % 1000;
+			if (rand() % 2)
+				ECS_ADD_COMPONENT(server, ent, Health)->hp = rand();
+			if (rand() % 3 == 0)
+				ECS_ADD_COMPONENT(server, ent, Local)->secret = 1;
+			live[liveCount++] = ent;
+		} else if (r < 5 && liveCount) {
+			int i = rand() % liveCount;
+			ecs_destroy(server, live[i]);
+			live[i] = live[--liveCount];
+		} else if (r < 7 && liveCount) {
+			Entity ent = live[rand() % liveCount];
+			if (ecs_hasComponent(server, ent, ECS_ID(Health)))
+				ecs_removeComponent(server, ent, ECS_ID(Health));
+			else
+				ECS_ADD_COMPONENT(server, ent, Health)->armor = 3;
+		} else if (liveCount) {
+			Entity ent = live[rand() % liveCount];
+			ECS_GET_COMPONENT(server, ent, Pos)->y += 0.5f;
+		}
+	}
+}
+
+/* order independent sum of the replicated values (handles differ) */
+static uint64_t signature(EcsWorld *w, EcsQuery *withHealth,
+			  EcsQuery *withoutHealth)
+{
+	uint64_t sum = 0;
+	EcsIter it = ecs_queryIter(w, withHealth);
+	while (ecs_iterNext(&it)) {
+		Pos *p = it.includes[0];
+		Health *h = it.includes[1];
+		uint64_t v = (uint64_t)(p->x * 3 + p->y * 7) * 31 +
+			(uint64_t)h->hp * 13 + h->armor;
+		sum += v * 2654435761u ^ (v >> 3);
+	}
+
+	it = ecs_queryIter(w, withoutHealth);
+	while (ecs_iterNext(&it)) {
+		Pos *p = it.includes[0];
+		uint64_t v = (uint64_t)(p->x * 3 + p->y * 7) * 31 + 99;
+		sum += v * 2654435761u ^ (v >> 3);
+	}
+	return sum;
+}
+
+static int countChanged(EcsWorld *w, EcsQuery *q, uint32_t since)
+{
+	int count = 0;
+	EcsIter it = ecs_queryIterChangedSince(w, q, since);
+	while (ecs_iterNext(&it)) count++;
+	return count;
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Health);
+	ECS_REG_COMP(Local);
+
+	server = ecs_createWorld();
+	EcsWorld *client = ecs_createWorld();
+	ecs_enableSnapshot(server, ECS_ID(Pos));
+	ecs_enableSnapshot(server, ECS_ID(Health));
+
+	EcsQuery *serverWith = ECS_QUERY(server, ECS_ACCESS(include, Pos, Health));
+	EcsQuery *serverWithout = ECS_QUERY(server, ECS_ACCESS(include, Pos),
+					    ECS_ACCESS(exclude, Health));
+	EcsQuery *clientWith = ECS_QUERY(client, ECS_ACCESS(include, Pos, Health));
+	EcsQuery *clientWithout = ECS_QUERY(client, ECS_ACCESS(include, Pos),
+					    ECS_ACCESS(exclude, Health));
+	EcsQuery *clientAll = ECS_QUERY(client, ECS_ACCESS(include, Pos));
+
+	//acks every packet right away
+	EcsWorld *other = ecs_createWorld();
+	EcsQuery *otherWith = ECS_QUERY(other, ECS_ACCESS(include, Pos, Health));
+	EcsQuery *otherWithout = ECS_QUERY(other, ECS_ACCESS(include, Pos),
+					   ECS_ACCESS(exclude, Health));
+
+	EcsReplicator *encoder = ECS_REPLICATOR(Pos, Health);
+	EcsReplicator *decoder = ECS_REPLICATOR(Pos, Health);
+	EcsReplicator *otherDecoder = ECS_REPLICATOR(Pos, Health);
+
+	static uint8_t packet[1 << 16];
+	static uint8_t otherPacket[1 << 16];
+	uint32_t acks[ACK_LAG] = {0};
+	bool delivered = false;
+
+	for (int t = 0; t < TICK_COUNT; t++) {
+		bool quiet = t % 10 == 9;
+		if (!quiet) mutate();
+		ecs_progressTick(server);
+
+		const EcsSnapshot *snap = ecs_acquireSnapshot(server);
+		size_t size = ecs_replicateEncode(encoder, snap, acks[0],
+						  packet, sizeof(packet));
+		assert(size);
+
+		size_t otherSize = ecs_replicateEncode(encoder, snap,
+				ecs_replicateTick(otherDecoder), otherPacket,
+				sizeof(otherPacket));
+		assert(ecs_replicateDecode(otherDecoder, other, otherPacket,
+					   otherSize));
+		assert(signature(other, otherWith, otherWithout) ==
+		       signature(server, serverWith, serverWithout));
+
+		//the ack of this packet reaches the server later
+		for (int i = 0; i < ACK_LAG - 1; i++) acks[i] = acks[i + 1];
+
+		if (rand() % 8 == 0) {
+			acks[ACK_LAG - 1] = ecs_replicateTick(decoder);
+			ecs_releaseSnapshot(snap);
+			delivered = false;
+			continue;
+		}
+
+		ecs_progressTick(client);
+		uint32_t since = ecs_getTick(client);
+		assert(ecs_replicateDecode(decoder, client, packet, size));
+		assert(ecs_replicateTick(decoder) == ecs_snapshotTick(snap));
+		acks[ACK_LAG - 1] = ecs_replicateTick(decoder);
+
+		assert(signature(client, clientWith, clientWithout) ==
+		       signature(server, serverWith, serverWithout));
+
+		//nothing changed since the last packet, nothing was written
+		if (quiet && delivered)
+			assert(countChanged(client, clientAll, since) == 0);
+		delivered = true;
+
+		//a packet is never applied twice
+		assert(!ecs_replicateDecode(decoder, client, packet, size));
+		ecs_releaseSnapshot(snap);
+	}
+
+	//a full state rebuilds a fresh client
+	EcsWorld *late = ecs_createWorld();
+	EcsQuery *lateWith = ECS_QUERY(late, ECS_ACCESS(include, Pos, Health));
+	EcsQuery *lateWithout = ECS_QUERY(late, ECS_ACCESS(include, Pos),
+					  ECS_ACCESS(exclude, Health));
+	EcsReplicator *lateDecoder = ECS_REPLICATOR(Pos, Health);
+
+	const EcsSnapshot *snap = ecs_acquireSnapshot(server);
+	size_t size = ecs_replicateEncode(encoder, snap, 0, packet,
+					  sizeof(packet));
+	assert(ecs_replicateDecode(lateDecoder, late, packet, size));
+	assert(signature(late, lateWith, lateWithout) ==
+	       signature(server, serverWith, serverWithout));
+
+	//truncated packets and small buffers are refused
+	assert(!ecs_replicateDecode(lateDecoder, late, packet, 3));
+	assert(ecs_replicateEncode(encoder, snap, 0, packet, 4) == 0);
+	ecs_releaseSnapshot(snap);
+
+	ecs_destroyReplicator(encoder);
+	ecs_destroyReplicator(decoder);
+	ecs_destroyReplicator(lateDecoder);
+	ecs_destroyReplicator(otherDecoder);
+	ecs_destroyWorld(server);
+	ecs_destroyWorld(client);
+	ecs_destroyWorld(other);
+	ecs_destroyWorld(late);
+
+	return 0;
+}
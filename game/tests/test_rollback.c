@@ -0,0 +1,180 @@
+/*
+  This test unit creates, destroys, moves, disables and writes random
+  entities every tick with rollback enabled, rolls back to random saved
+  ticks and checks that the values, shared values and alive entities are
+  the ones recorded at that tick, then keeps simulating from there
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEED 1234
+#define DEPTH 8
+#define ENTITY_COUNT 100
+#define TICK_COUNT 1000
+#define STEP_COUNT 10
+
+typedef struct {
+	int x;
+} Pos;
+
+typedef struct {
+	int v;
+} Vel;
+
+typedef struct {
+	int team;
+} Team;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Vel);
+ECS_DECL_COMP(Team);
+
+//what the world should hold, 0 handles are empty slots
+typedef struct {
+	uint32_t tick;
+	Entity ents[ENTITY_COUNT];
+	int pos[ENTITY_COUNT];
+	int vel[ENTITY_COUNT]; //0 if not added
+	int team[ENTITY_COUNT];
+	bool enabled[ENTITY_COUNT];
+} State;
+
+static EcsWorld *world;
+static State cur;
+static State saved[DEPTH];
+static int savedCount;
+
+static void spawn(int i)
+{
+	cur.ents[i] = ecs_newEntity(world);
+	cur.pos[i] = rand();
+	cur.vel[i] = rand() % 2 ? rand() % 100 + 1 : 0;
+	cur.team[i] = rand() % 3;
+	cur.enabled[i] = true;
+	ECS_ADD_COMPONENT(world, cur.ents[i], Pos)->x = cur.pos[i];
+	if (cur.vel[i])
+		ECS_ADD_COMPONENT(world, cur.ents[i], Vel)->v = cur.vel[i];
+	ecs_setShared(world, cur.ents[i], ECS_ID(Team),
+		      &(Team){ cur.team[i] });
+}
+
+static void check(void)
+{
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		Entity ent = cur.ents[i];
+		if (!ent) continue;
+		assert(ecs_isValid(world, ent));
+		assert(ECS_GET_COMPONENT(world, ent, Pos)->x == cur.pos[i]);
+		Vel *vel = ECS_GET_COMPONENT(world, ent, Vel);
+		assert(!vel == !cur.vel[i]);
+		if (vel) assert(vel->v == cur.vel[i]);
+		assert(ECS_GET_COMPONENT(world, ent, Team)->team == cur.team[i]);
+		assert(ecs_isEnabled(world, ent) == cur.enabled[i]);
+	}
+}
+
+static void step(EcsQuery *q)
+{
+	//the written columns of every archetype
+	EcsIter it = ecs_queryIter(world, q);
+	while (ecs_iterNext(&it)) ((Pos*)it.includes[0])->x++;
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		if (cur.ents[i] && cur.enabled[i]) cur.pos[i]++;
+
+	for (int s = 0; s < STEP_COUNT; s++) {
+		int i = rand() % ENTITY_COUNT;
+		int op = rand() % 10;
+		Entity ent = cur.ents[i];
+		if (!ent) {
+			spawn(i);
+		} else if (op < 2) {
+			ecs_destroy(world, ent);
+			cur.ents[i] = 0;
+		} else if (op < 4) {
+			if (cur.vel[i]) {
+				ecs_removeComponent(world, ent, ECS_ID(Vel));
+				cur.vel[i] = 0;
+			} else {
+				cur.vel[i] = rand() % 100 + 1;
+				ECS_ADD_COMPONENT(world, ent, Vel)->v = cur.vel[i];
+			}
+		} else if (op < 5) {
+			cur.team[i] = rand() % 3;
+			ecs_setShared(world, ent, ECS_ID(Team),
+				      &(Team){ cur.team[i] });
+		} else if (op < 6) {
+			cur.enabled[i] = !cur.enabled[i];
+			ecs_setEnabled(world, ent, cur.enabled[i]);
+		} else {
+			cur.pos[i] = rand();
+			ECS_GET_COMPONENT(world, ent, Pos)->x = cur.pos[i];
+		}
+	}
+
+	//the ring keeps the last DEPTH ticks
+	cur.tick = ecs_getTick(world);
+	ecs_progressTick(world);
+	if (savedCount == DEPTH) {
+		memmove(saved, saved + 1, sizeof(State) * (DEPTH - 1));
+		savedCount--;
+	}
+	saved[savedCount++] = cur;
+}
+
+static void rollback(int back)
+{
+	State *to = &saved[savedCount - 1 - back];
+	State now = cur;
+	assert(ecs_rollbackTo(world, to->tick));
+	assert(ecs_getTick(world) == to->tick + 1);
+	cur = *to;
+	savedCount -= back;
+	check();
+
+	//entities created after the tick are gone
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		if (now.ents[i] && now.ents[i] != cur.ents[i])
+			assert(!ecs_isValid(world, now.ents[i]));
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Vel);
+	ECS_REG_SHARED_COMP(Team);
+
+	world = ecs_createWorld();
+	ecs_setArchetypeIdleTicks(world, 1);
+	EcsQuery *q = ECS_QUERY(world, ECS_ACCESS(include, Pos),
+				ECS_ACCESS(write, Pos));
+	ecs_enableRollback(world, DEPTH);
+	assert(!ecs_rollbackTo(world, ecs_getTick(world)));
+
+	for (int t = 0; t < TICK_COUNT; t++) {
+		step(q);
+		if (t % 7 == 6) rollback(rand() % savedCount);
+		check();
+	}
+
+	//dropped and unsaved ticks
+	uint32_t tick = ecs_getTick(world);
+	assert(!ecs_rollbackTo(world, tick));
+	assert(!ecs_rollbackTo(world, tick - DEPTH - 1));
+	rollback(1);
+	assert(!ecs_rollbackTo(world, tick - 1));
+
+	//not while deferred
+	ecs_deferBegin(world);
+	assert(!ecs_rollbackTo(world, saved[0].tick));
+	ecs_deferEnd(world);
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
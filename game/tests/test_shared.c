@@ -0,0 +1,124 @@
+/*
+  This test unit groups entities by a shared component, in and out of
+  deferred mode, and checks that moves keep the group, that every group
+  holds one value and that singletons belong to their world
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <string.h>
+
+#define ENTITY_COUNT 20
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int damage;
+	char name[200];
+} Weapon;
+
+typedef struct {
+	double seconds;
+} Time;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Weapon);
+ECS_DECL_COMP(Time);
+
+static void testSingletons(void)
+{
+	EcsWorld *w = ecs_createWorld();
+	EcsWorld *other = ecs_createWorld();
+
+	assert(ECS_SINGLETON(w, Time)->seconds == 0);
+	ECS_SINGLETON(w, Time)->seconds = 3;
+	assert(ECS_SINGLETON(w, Time)->seconds == 3);
+	assert(ECS_SINGLETON(w, Time) == ECS_SINGLETON(w, Time));
+	assert(ECS_SINGLETON(other, Time)->seconds == 0);
+
+	//no entity holds it
+	EcsQuery *q = ECS_QUERY(w, ECS_ACCESS(include, Time));
+	EcsIter it = ecs_queryIter(w, q);
+	assert(!ecs_iterNext(&it));
+
+	ecs_destroyWorld(w);
+	ecs_destroyWorld(other);
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_SHARED_COMP(Weapon);
+	ECS_REG_COMP(Time);
+
+	EcsWorld *w = ecs_createWorld();
+	Archetype *rifles = ECS_REG_ARCH(w, Pos, Weapon);
+	Weapon *rifle = ecs_getSharedInArch(rifles, ECS_ID(Weapon));
+	rifle->damage = 10;
+	strcpy(rifle->name, "rifle");
+
+	Entity ents[ENTITY_COUNT];
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntityInArch(w, rifles);
+		ECS_GET_COMPONENT(w, ents[i], Pos)->x = i;
+	}
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		assert(ECS_GET_COMPONENT(w, ents[i], Weapon) == rifle);
+
+	Weapon gun = { .damage = 5 };
+	strcpy(gun.name, "gun");
+	for (int i = ENTITY_COUNT / 2; i < ENTITY_COUNT; i++)
+		ecs_setShared(w, ents[i], ECS_ID(Weapon), &gun);
+	Weapon *guns = ECS_GET_COMPONENT(w, ents[ENTITY_COUNT / 2], Weapon);
+	assert(guns != rifle);
+	assert(guns->damage == 5);
+	assert(!strcmp(guns->name, "gun"));
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		Weapon *expected = i < ENTITY_COUNT / 2 ? rifle : guns;
+		assert(ECS_GET_COMPONENT(w, ents[i], Weapon) == expected);
+		assert(ECS_GET_COMPONENT(w, ents[i], Pos)->x == i);
+	}
+
+	//moves keep the group
+	Entity mover = ents[ENTITY_COUNT - 1];
+	ECS_ADD_COMPONENT(w, mover, Time)->seconds = 1;
+	assert(ECS_GET_COMPONENT(w, mover, Weapon)->damage == 5);
+	ecs_removeComponent(w, mover, ECS_ID(Time));
+	assert(ECS_GET_COMPONENT(w, mover, Weapon) == guns);
+	assert(ECS_GET_COMPONENT(w, mover, Pos)->x == ENTITY_COUNT - 1);
+
+	ecs_deferBegin(w);
+	Entity made = ecs_newEntityInArch(w, rifles);
+	ecs_setShared(w, ents[0], ECS_ID(Weapon), &gun);
+	Entity added = ecs_newEntity(w);
+	Weapon *staged = ECS_ADD_COMPONENT(w, added, Weapon);
+	*staged = gun;
+	ecs_deferEnd(w);
+	assert(ECS_GET_COMPONENT(w, made, Weapon) == rifle);
+	assert(ECS_GET_COMPONENT(w, ents[0], Weapon) == guns);
+	assert(ECS_GET_COMPONENT(w, ents[0], Pos)->x == 0);
+	assert(ECS_GET_COMPONENT(w, added, Weapon)->damage == 5);
+
+	//writing through the group changes it for every member
+	EcsQuery *armed = ECS_QUERY(w, ECS_ACCESS(include, Pos, Weapon));
+	guns->damage = 6;
+	int count = 0;
+	int damage = 0;
+	EcsIter it = ecs_queryIter(w, armed);
+	while (ecs_iterNext(&it)) {
+		damage += ((Weapon*)it.includes[1])->damage;
+		count++;
+	}
+	assert(count == ENTITY_COUNT + 1);
+	assert(damage == 10 * (ENTITY_COUNT / 2) + 6 * (ENTITY_COUNT / 2 + 1));
+
+	ecs_destroyWorld(w);
+
+	testSingletons();
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+  This test unit reads the published snapshots from two threads while the
+  simulation keeps writing, moving and replacing entities, and checks
+  that every snapshot stays consistent with its tick and unchanged while
+  held, and that unchanged archetypes share their chunks
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define READER_COUNT 2
+#define ENTITY_COUNT 100
+#define TICK_COUNT 300
+
+typedef struct {
+	int tick;
+} Pos;
+
+typedef struct {
+	int v;
+} Vel;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Vel);
+
+static EcsWorld *world;
+static atomic_bool stop;
+
+/* every snapshotted row holds the tick of its snapshot */
+static int checkSnapshot(const EcsSnapshot *snap)
+{
+	int tick = ecs_snapshotTick(snap);
+	int rows = 0;
+	for (int c = 0; c < ecs_snapshotChunkCount(snap); c++) {
+		const Entity *ents;
+		int count;
+		const Pos *p = ecs_snapshotColumn(snap, c, ECS_ID(Pos), &ents,
+						  &count);
+		assert(p);
+		assert(!ecs_snapshotColumn(snap, c, ECS_ID(Vel), NULL, NULL));
+		for (int r = 0; r < count; r++) {
+			assert(p[r].tick == tick);
+			assert(ents[r]);
+		}
+		rows += count;
+	}
+	return rows;
+}
+
+static void *readSnapshots(void *arg)
+{
+	(void)arg;
+	while (!atomic_load(&stop)) {
+		const EcsSnapshot *snap = ecs_acquireSnapshot(world);
+		if (!snap) continue;
+		assert(checkSnapshot(snap) == ENTITY_COUNT);
+		ecs_releaseSnapshot(snap);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Vel);
+
+	world = ecs_createWorld();
+	assert(!ecs_acquireSnapshot(world));
+	ecs_enableSnapshot(world, ECS_ID(Pos));
+
+	EcsQuery *q = ECS_QUERY(world, ECS_ACCESS(include, Pos),
+				ECS_ACCESS(write, Pos));
+	Entity ents[ENTITY_COUNT];
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntity(world);
+		ECS_ADD_COMPONENT(world, ents[i], Pos)->tick = ecs_getTick(world);
+		if (i % 2) ECS_ADD_COMPONENT(world, ents[i], Vel)->v = i;
+	}
+	ecs_progressTick(world);
+
+	const EcsSnapshot *first = ecs_acquireSnapshot(world);
+	assert(ecs_snapshotChunkCount(first) == 2);
+
+	pthread_t readers[READER_COUNT];
+	for (int i = 0; i < READER_COUNT; i++)
+		pthread_create(&readers[i], NULL, readSnapshots, NULL);
+
+	for (int t = 0; t < TICK_COUNT; t++) {
+		int tick = ecs_getTick(world);
+		EcsIter it = ecs_queryIter(world, q);
+		while (ecs_iterNext(&it)) ((Pos*)it.includes[0])->tick = tick;
+
+		if (t % 10 == 0) {
+			int i = t / 10;
+			ecs_destroy(world, ents[i]);
+			ents[i] = ecs_newEntity(world);
+			ECS_ADD_COMPONENT(world, ents[i], Pos)->tick = tick;
+			if (i % 2) ECS_ADD_COMPONENT(world, ents[i], Vel)->v = i;
+		}
+		ecs_progressTick(world);
+	}
+
+	atomic_store(&stop, true);
+	for (int i = 0; i < READER_COUNT; i++) pthread_join(readers[i], NULL);
+
+	//held snapshots never change
+	assert(checkSnapshot(first) == ENTITY_COUNT);
+
+	//nothing written, the chunks are shared
+	ecs_progressTick(world);
+	const EcsSnapshot *a = ecs_acquireSnapshot(world);
+	ecs_progressTick(world);
+	const EcsSnapshot *b = ecs_acquireSnapshot(world);
+	assert(ecs_snapshotTick(b) == ecs_snapshotTick(a) + 1);
+	for (int c = 0; c < ecs_snapshotChunkCount(a); c++)
+		assert(ecs_snapshotColumn(a, c, ECS_ID(Pos), NULL, NULL) ==
+		       ecs_snapshotColumn(b, c, ECS_ID(Pos), NULL, NULL));
+	ecs_retainSnapshot(b);
+	ecs_releaseSnapshot(a);
+
+	//snapshots outlive their world
+	ecs_destroyWorld(world);
+	ecs_releaseSnapshot(b);
+	ecs_releaseSnapshot(b);
+	ecs_releaseSnapshot(first);
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+  This test unit toggles sparse components on random entities, in and out
+  of deferred mode, and checks that the entities never move and that
+  values and queries follow the toggles
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SEED 1234
+#define ENTITY_COUNT 200
+#define STEP_COUNT 2000
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int ticks;
+} Burning;
+
+typedef struct {
+	int damage;
+} Hit;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Burning);
+ECS_DECL_COMP(Hit);
+
+static EcsWorld *world;
+static Archetype *arch;
+static Entity ents[ENTITY_COUNT];
+static int burning[ENTITY_COUNT]; //expected value, 0 if not burning
+
+static void check(EcsQuery *withBurning, EcsQuery *withoutBurning)
+{
+	int expected = 0;
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		assert(ecs_getEntityArch(world, ents[i]) == arch);
+		Burning *b = ECS_GET_COMPONENT(world, ents[i], Burning);
+		assert(!b == !burning[i]);
+		if (b) assert(b->ticks == burning[i]);
+		expected += burning[i] != 0;
+	}
+
+	int count = 0;
+	EcsIter it = ecs_queryIter(world, withBurning);
+	while (ecs_iterNext(&it)) {
+		Pos *p = it.includes[0];
+		Burning *b = it.includes[1];
+		assert(b->ticks == burning[(int)p->x]);
+		count++;
+	}
+	assert(count == expected);
+
+	count = 0;
+	it = ecs_queryIter(world, withoutBurning);
+	while (ecs_iterNext(&it)) {
+		Pos *p = it.includes[0];
+		assert(!burning[(int)p->x]);
+		count++;
+	}
+	assert(count == ENTITY_COUNT - expected);
+}
+
+static void toggle(int i)
+{
+	if (burning[i]) {
+		ecs_removeComponent(world, ents[i], ECS_ID(Burning));
+		burning[i] = 0;
+	} else {
+		burning[i] = rand() % 1000 + 1;
+		ECS_ADD_COMPONENT(world, ents[i], Burning)->ticks = burning[i];
+	}
+}
+
+int main(void)
+{
+	srand(SEED);
+
+	ECS_REG_COMP(Pos);
+	ECS_REG_SPARSE_COMP(Burning);
+	ECS_REG_SPARSE_COMP(Hit);
+
+	world = ecs_createWorld();
+	arch = ECS_REG_ARCH(world, Pos);
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntityInArch(world, arch);
+		ECS_GET_COMPONENT(world, ents[i], Pos)->x = i;
+	}
+
+	EcsQuery *withBurning = ECS_QUERY(world, ECS_ACCESS(include, Pos, Burning));
+	EcsQuery *withoutBurning = ECS_QUERY(world, ECS_ACCESS(include, Pos),
+					     ECS_ACCESS(exclude, Burning));
+
+	for (int step = 0; step < STEP_COUNT; step++) {
+		if (step % 50 == 0) {
+			//a batch of toggles, an entity may be toggled twice
+			ecs_deferBegin(world);
+			for (int k = 0; k < 30; k++) toggle(rand() % ENTITY_COUNT);
+			ecs_deferEnd(world);
+		} else {
+			toggle(rand() % ENTITY_COUNT);
+		}
+		if (step % 100 == 0) check(withBurning, withoutBurning);
+	}
+	check(withBurning, withoutBurning);
+
+	//the bulk operations work on sparse components too
+	ecs_addComponentToQuery(world, withoutBurning, ECS_ID(Hit));
+	EcsQuery *withHit = ECS_QUERY(world, ECS_ACCESS(include, Hit));
+	EcsIter it = ecs_queryIter(world, withHit);
+	while (ecs_iterNext(&it))
+		assert(!ECS_GET_COMPONENT(world, it.entity, Burning));
+
+	//destroyed entities leave the sets
+	int victim = 0;
+	while (!burning[victim]) victim++;
+	ecs_destroy(world, ents[victim]);
+	Entity reused = ecs_newEntityInArch(world, arch);
+	assert(!ECS_GET_COMPONENT(world, reused, Burning));
+	assert(!ECS_GET_COMPONENT(world, reused, Hit));
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+  This test unit adds and removes tags, table and sparse ones, in and out
+  of deferred mode, and checks that they take part in queries without
+  any storage and without disturbing the values of the entities
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+
+#define ENTITY_COUNT 10
+#define EXTRA_TAG_COUNT 12
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Enemy);
+ECS_DECL_COMP(Boss);
+ECS_DECL_COMP(Stunned);
+
+static int countRows(EcsWorld *w, EcsQuery *q)
+{
+	int count = 0;
+	EcsIter it = ecs_queryIter(w, q);
+	while (ecs_iterNext(&it)) count++;
+	return count;
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_TAG(Enemy);
+	ECS_REG_TAG(Boss);
+	ECS_ID(Stunned) = ecs_registerComponentEx(0, 1, ECS_STORAGE_SPARSE);
+	EcsComponent extra[EXTRA_TAG_COUNT];
+	for (int i = 0; i < EXTRA_TAG_COUNT; i++)
+		extra[i] = ecs_registerComponent(0, 1);
+	assert(ecs_componentSize(ECS_ID(Enemy)) == 0);
+
+	EcsWorld *w = ecs_createWorld();
+	Archetype *arch = ECS_REG_ARCH(w, Pos);
+	Entity ents[ENTITY_COUNT];
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntityInArch(w, arch);
+		ECS_GET_COMPONENT(w, ents[i], Pos)->x = i;
+	}
+
+	//tags have no data to hand out
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		assert(!ecs_addComponent(w, ents[i], ECS_ID(Enemy)));
+		assert(ecs_hasComponent(w, ents[i], ECS_ID(Enemy)));
+		assert(!ecs_getComponent(w, ents[i], ECS_ID(Enemy)));
+	}
+	//many tags on one entity, the values moved with it stay
+	for (int i = 0; i < EXTRA_TAG_COUNT; i++)
+		ecs_addComponent(w, ents[0], extra[i]);
+	for (int i = 0; i < EXTRA_TAG_COUNT; i++)
+		assert(ecs_hasComponent(w, ents[0], extra[i]));
+
+	ecs_deferBegin(w);
+	ecs_addComponent(w, ents[1], ECS_ID(Boss));
+	assert(ecs_hasComponent(w, ents[1], ECS_ID(Boss)));
+	ecs_removeComponent(w, ents[2], ECS_ID(Enemy));
+	assert(!ecs_hasComponent(w, ents[2], ECS_ID(Enemy)));
+	ecs_addComponent(w, ents[4], ECS_ID(Stunned));
+	ecs_deferEnd(w);
+	assert(ecs_hasComponent(w, ents[1], ECS_ID(Boss)));
+	assert(!ecs_hasComponent(w, ents[2], ECS_ID(Enemy)));
+
+	//sparse tags don't move the entity
+	Archetype *before = ecs_getEntityArch(w, ents[3]);
+	assert(!ecs_addComponent(w, ents[3], ECS_ID(Stunned)));
+	assert(ecs_hasComponent(w, ents[3], ECS_ID(Stunned)));
+	assert(!ecs_getComponent(w, ents[3], ECS_ID(Stunned)));
+	assert(ecs_getEntityArch(w, ents[3]) == before);
+
+	EcsQuery *enemies = ECS_QUERY(w, ECS_ACCESS(include, Pos, Enemy));
+	EcsQuery *bosses = ECS_QUERY(w, ECS_ACCESS(include, Enemy, Boss));
+	EcsQuery *stunned = ECS_QUERY(w, ECS_ACCESS(include, Pos, Stunned));
+	EcsQuery *calm = ECS_QUERY(w, ECS_ACCESS(include, Pos),
+				   ECS_ACCESS(exclude, Stunned));
+	assert(countRows(w, enemies) == ENTITY_COUNT - 1);
+	assert(countRows(w, bosses) == 1);
+	assert(countRows(w, stunned) == 2);
+	assert(countRows(w, calm) == ENTITY_COUNT - 2);
+
+	EcsIter it = ecs_queryIter(w, enemies);
+	while (ecs_iterNext(&it)) {
+		assert(!it.includes[1]);
+		assert(it.includes[0] == ECS_GET_COMPONENT(w, it.entity, Pos));
+	}
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		assert(ECS_GET_COMPONENT(w, ents[i], Pos)->x == i);
+
+	ecs_removeComponentFromQuery(w, enemies, ECS_ID(Enemy));
+	assert(countRows(w, enemies) == 0);
+	assert(countRows(w, bosses) == 0);
+	for (int i = 0; i < ENTITY_COUNT; i++)
+		assert(ECS_GET_COMPONENT(w, ents[i], Pos)->x == i);
+
+	ecs_destroyWorld(w);
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+  This test unit issues commands from several threads in deferred mode,
+  each with its own command buffer, and checks the merged result after
+  the flush: destroy wins and otherwise the later buffer wins
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+#define THREAD_COUNT 4
+#define ENTITY_COUNT 200
+#define SPAWN_COUNT 20
+#define PER_THREAD (ENTITY_COUNT / THREAD_COUNT)
+
+typedef struct {
+	float x;
+	float y;
+} Pos;
+
+typedef struct {
+	int hp;
+} Health;
+
+typedef struct {
+	int owner;
+} Owner;
+
+ECS_DECL_COMP(Pos);
+ECS_DECL_COMP(Health);
+ECS_DECL_COMP(Owner);
+
+static EcsWorld *world;
+static Entity ents[ENTITY_COUNT];
+static Entity spawned[THREAD_COUNT][SPAWN_COUNT];
+
+static void *work(void *arg)
+{
+	int t = (int)(intptr_t)arg;
+	ecs_setThreadIndex(t);
+
+	//every thread has its own range of entities
+	for (int i = t * PER_THREAD; i < (t + 1) * PER_THREAD; i++) {
+		ECS_ADD_COMPONENT(world, ents[i], Health)->hp = i;
+		if (i % 5 == 0) ecs_destroy(world, ents[i]);
+	}
+
+	//and they all write to the same one
+	ECS_ADD_COMPONENT(world, ents[3], Owner)->owner = t;
+
+	for (int k = 0; k < SPAWN_COUNT; k++) {
+		Entity ent = ecs_newEntity(world);
+		ECS_ADD_COMPONENT(world, ent, Pos)->x = t * 1000 + k;
+		spawned[t][k] = ent;
+	}
+	return NULL;
+}
+
+static void testThreads(void)
+{
+	Archetype *arch = ECS_REG_ARCH(world, Pos);
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		ents[i] = ecs_newEntityInArch(world, arch);
+		ECS_GET_COMPONENT(world, ents[i], Pos)->x = i;
+	}
+
+	ecs_deferBegin(world);
+	pthread_t threads[THREAD_COUNT];
+	for (int t = 0; t < THREAD_COUNT; t++)
+		pthread_create(&threads[t], NULL, work, (void*)(intptr_t)t);
+	for (int t = 0; t < THREAD_COUNT; t++)
+		pthread_join(threads[t], NULL);
+	ecs_setThreadIndex(0);
+	ecs_deferEnd(world);
+
+	for (int i = 0; i < ENTITY_COUNT; i++) {
+		if (i % 5 == 0) {
+			assert(!ecs_isValid(world, ents[i]));
+			continue;
+		}
+		assert(ECS_GET_COMPONENT(world, ents[i], Pos)->x == i);
+		assert(ECS_GET_COMPONENT(world, ents[i], Health)->hp == i);
+	}
+	assert(ECS_GET_COMPONENT(world, ents[3], Owner)->owner ==
+	       THREAD_COUNT - 1);
+
+	//the handles reserved by different threads never collide
+	for (int t = 0; t < THREAD_COUNT; t++) {
+		for (int k = 0; k < SPAWN_COUNT; k++) {
+			Entity ent = spawned[t][k];
+			assert(ecs_isValid(world, ent));
+			assert(ECS_GET_COMPONENT(world, ent, Pos)->x == t * 1000 + k);
+		}
+	}
+}
+
+static void testConflicts(void)
+{
+	Archetype *arch = ECS_REG_ARCH(world, Pos);
+	Entity ent = ecs_newEntityInArch(world, arch);
+	Entity doomed = ecs_newEntityInArch(world, arch);
+
+	ecs_deferBegin(world);
+	ecs_setThreadIndex(0);
+	ECS_ADD_COMPONENT(world, ent, Owner)->owner = 1;
+	ecs_removeComponent(world, ent, ECS_ID(Pos));
+	ecs_destroy(world, doomed);
+	ecs_setThreadIndex(2);
+	ECS_ADD_COMPONENT(world, ent, Owner)->owner = 2;
+	ECS_ADD_COMPONENT(world, doomed, Health)->hp = 1;
+	ecs_setThreadIndex(1);
+	ECS_ADD_COMPONENT(world, ent, Health)->hp = 5;
+	ecs_setThreadIndex(0);
+	ecs_deferEnd(world);
+
+	//the commands of every buffer apply, the later one wins
+	assert(ECS_GET_COMPONENT(world, ent, Owner)->owner == 2);
+	assert(ECS_GET_COMPONENT(world, ent, Health)->hp == 5);
+	assert(!ECS_GET_COMPONENT(world, ent, Pos));
+	assert(!ecs_isValid(world, doomed));
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Pos);
+	ECS_REG_COMP(Health);
+	ECS_REG_COMP(Owner);
+
+	world = ecs_createWorld();
+
+	testThreads();
+	testConflicts();
+
+	ecs_destroyWorld(world);
+
+	return 0;
+}
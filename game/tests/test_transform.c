@@ -0,0 +1,148 @@
+/*
+  This test unit checks the world transforms computed by the transform
+  module after reparenting and destroying transforms
+ */
+
+#include <modules/transform/transform.h>
+#include <modules/transform/reg_module.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define NODE_COUNT 200
+#define STEP_COUNT 300
+
+static TransformIndex nodes[NODE_COUNT];
+
+static void checkPos(TransformIndex t, float x, float y)
+{
+	const Transform *world = transform_getWorld(t);
+	assert(world);
+	assert(world->position.x == x);
+	assert(world->position.y == y);
+}
+
+/* world position of a translated only transform, from its ancestors */
+static vec2 expected(TransformIndex t)
+{
+	vec2 pos = transform_getLocal(t)->position;
+	TransformIndex parent = transform_getParent(t);
+	if (parent == TRANSFORM_NONE) return pos;
+
+	vec2 base = expected(parent);
+	return (vec2){ base.x + pos.x, base.y + pos.y };
+}
+
+static bool inSubtree(TransformIndex t, TransformIndex root)
+{
+	for (; t != TRANSFORM_NONE; t = transform_getParent(t))
+		if (t == root) return true;
+	return false;
+}
+
+static void testChain(void)
+{
+	TransformIndex root = transform_regEntity(1);
+	TransformIndex child = transform_regEntity(2);
+	TransformIndex leaf = transform_regEntity(3);
+	assert(transform_getEntity(leaf) == 3);
+
+	//attached before the parent exists in the order
+	assert(transform_setParent(leaf, child));
+	assert(transform_setParent(child, root));
+	assert(transform_getParent(leaf) == child);
+	assert(!transform_setParent(root, leaf)); //cycle
+
+	transform_getLocal(root)->position = (vec2){ 10, 0 };
+	transform_getLocal(child)->position = (vec2){ 1, 0 };
+	transform_getLocal(leaf)->position = (vec2){ 0, 2 };
+	transform_propagate();
+	checkPos(root, 10, 0);
+	checkPos(child, 11, 0);
+	checkPos(leaf, 11, 2);
+
+	//quarter turn and doubled scale of the root
+	Transform *local = transform_getLocal(root);
+	local->rotation = (vec2){ 0, 1 };
+	local->scale = (vec2){ 2, 2 };
+	transform_propagate();
+	checkPos(child, 10, 2);
+	checkPos(leaf, 6, 2);
+	assert(transform_getWorld(leaf)->scale.x == 2);
+
+	//only the moved subtree changes
+	assert(transform_setParent(leaf, root));
+	transform_propagate();
+	checkPos(leaf, 6, 0);
+	checkPos(child, 10, 2);
+
+	//children of a destroyed transform become roots
+	assert(transform_setParent(leaf, child));
+	transform_destroy(child);
+	assert(!transform_isValid(child));
+	assert(transform_getParent(leaf) == TRANSFORM_NONE);
+	transform_propagate();
+	checkPos(leaf, 0, 2);
+
+	//the slot is reused with a new generation
+	TransformIndex other = transform_regEntity(4);
+	assert(other != child);
+	assert(!transform_isValid(child));
+	assert(!transform_setParent(leaf, child));
+
+	transform_destroy(root);
+	transform_destroy(leaf);
+	transform_destroy(other);
+}
+
+static void testRandom(void)
+{
+	srand(42);
+	for (int i = 0; i < NODE_COUNT; i++) {
+		nodes[i] = transform_regEntity(i);
+		transform_getLocal(nodes[i])->position =
+			(vec2){ rand() % 100, rand() % 100 };
+	}
+
+	for (int step = 0; step < STEP_COUNT; step++) {
+		int i = rand() % NODE_COUNT;
+		TransformIndex t = nodes[i];
+		int op = rand() % 8;
+
+		if (op == 0) {
+			//destroyed nodes come back as roots
+			transform_destroy(nodes[i]);
+			nodes[i] = transform_regEntity(i);
+			transform_getLocal(nodes[i])->position =
+				(vec2){ rand() % 100, 0 };
+		} else if (op == 1) {
+			assert(transform_setParent(t, TRANSFORM_NONE));
+		} else if (op < 6) {
+			TransformIndex parent = nodes[rand() % NODE_COUNT];
+			bool cycle = inSubtree(parent, t);
+			assert(transform_setParent(t, parent) == !cycle);
+		} else {
+			transform_getLocal(t)->position.y += 1;
+		}
+
+		if (step % 10 == 0) {
+			transform_propagate();
+			for (int i = 0; i < NODE_COUNT; i++) {
+				vec2 pos = expected(nodes[i]);
+				checkPos(nodes[i], pos.x, pos.y);
+			}
+		}
+	}
+
+	for (int i = 0; i < NODE_COUNT; i++) transform_destroy(nodes[i]);
+}
+
+int main(void)
+{
+	transform_regModule();
+
+	testChain();
+	testRandom();
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+  This test unit runs one world per thread, each creating, deferring and
+  destroying its own entities, and checks that no world sees the
+  entities, queries or singletons of another
+ */
+
+#include <ecs.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+#define WORLD_COUNT 4
+#define ENTITY_COUNT 200
+#define ROUND_COUNT 50
+
+typedef struct {
+	int v;
+} Val;
+
+typedef struct {
+	int x;
+} Marker;
+
+ECS_DECL_COMP(Val);
+ECS_DECL_COMP(Marker);
+
+static void *run(void *arg)
+{
+	int base = (int)(intptr_t)arg;
+	EcsWorld *w = ecs_createWorld();
+	Archetype *arch = ECS_REG_ARCH(w, Val);
+	EcsQuery *q = ECS_QUERY(w, ECS_ACCESS(include, Val));
+	ECS_SINGLETON(w, Val)->v = base;
+
+	Entity ents[ENTITY_COUNT];
+	for (int r = 0; r < ROUND_COUNT; r++) {
+		for (int i = 0; i < ENTITY_COUNT; i++) {
+			ents[i] = ecs_newEntityInArch(w, arch);
+			ECS_GET_COMPONENT(w, ents[i], Val)->v = base + i;
+		}
+		ecs_deferBegin(w);
+		for (int i = 0; i < ENTITY_COUNT; i += 2)
+			ECS_ADD_COMPONENT(w, ents[i], Marker)->x = base;
+		ecs_deferEnd(w);
+
+		long sum = 0;
+		EcsIter it = ecs_queryIter(w, q);
+		while (ecs_iterNext(&it)) sum += ((Val*)it.includes[0])->v;
+		assert(sum == (long)ENTITY_COUNT * base +
+		       ENTITY_COUNT * (ENTITY_COUNT - 1) / 2);
+		for (int i = 0; i < ENTITY_COUNT; i += 2)
+			assert(ECS_GET_COMPONENT(w, ents[i], Marker)->x == base);
+
+		ecs_destroyQuery(w, q);
+		for (int i = 0; i < ENTITY_COUNT; i++)
+			assert(!ecs_isValid(w, ents[i]));
+		assert(ECS_SINGLETON(w, Val)->v == base);
+		ecs_progressTick(w);
+	}
+
+	ecs_destroyWorld(w);
+	return NULL;
+}
+
+int main(void)
+{
+	ECS_REG_COMP(Val);
+	ECS_REG_SPARSE_COMP(Marker);
+
+	pthread_t threads[WORLD_COUNT];
+	for (int t = 0; t < WORLD_COUNT; t++)
+		pthread_create(&threads[t], NULL, run, (void*)(intptr_t)(t * 1000));
+	for (int t = 0; t < WORLD_COUNT; t++)
+		pthread_join(threads[t], NULL);
+
+	//the same handle means different entities in different worlds
+	EcsWorld *a = ecs_createWorld();
+	EcsWorld *b = ecs_createWorld();
+	Entity inA = ecs_newEntity(a);
+	Entity inB = ecs_newEntity(b);
+	assert(inA == inB);
+	ECS_ADD_COMPONENT(a, inA, Val)->v = 1;
+	assert(!ECS_GET_COMPONENT(b, inB, Val));
+	ecs_destroy(a, inA);
+	assert(ecs_isValid(b, inB));
+
+	ecs_destroyWorld(a);
+	ecs_destroyWorld(b);
+
+	return 0;
+}